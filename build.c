@@ -1,14 +1,17 @@
 #include "build.h"
 #include "parse.h"
+#include "pool.h"
 #include "remark.h"
 #include "render.h"
 #include "store.h"
+#include "test.h"
 #include "util.h"
 
+#include <sys/stat.h>
 #include <time.h>
 
 struct input_list input_list;
-static struct string input_content;
+static thread_local struct string input_content;
 static struct output output;
 
 struct output_file {
@@ -43,7 +46,8 @@ static struct error open_output(struct output_file *of) {
 
   struct error err = {};
   if (output.file) {
-    const char *tmp = get_tmp(of, output.file);
+    // Sites are rendered in place, as directories can't be replaced at once
+    const char *tmp = output.kind != OK_SITE ? get_tmp(of, output.file) : NULL;
     const char *filename = ALT(tmp, output.file);
 
     switch (output.kind) {
@@ -56,6 +60,9 @@ static struct error open_output(struct output_file *of) {
       err = store_open(filename);
       break;
 
+    case OK_SITE:
+      break;
+
     default:
       err = (struct error){ES_UNKNOWN_OUTPUT};
       break;
@@ -80,6 +87,9 @@ static struct error close_output(struct output_file *of) {
       err = store_close();
       break;
 
+    case OK_SITE:
+      break;
+
     default:
       err = (struct error){ES_UNKNOWN_OUTPUT};
       break;
@@ -108,6 +118,8 @@ struct parse_context {
   YYLTYPE lloc;
   UserContext uctx;
   int errs;
+  unsigned lines; // the number of remarks given, by lines or values
+  size_t size;    // the size of lines given
 };
 
 #define PARSE_CONTEXT_INIT(type, data)                                         \
@@ -117,6 +129,9 @@ struct parse_context {
 
 typedef struct error (*build_t)(struct input i);
 
+// Builds all inputs of the given kind at once.
+typedef struct error (*batch_t)(int kind);
+
 static struct error parse_line_and_dump(char *line, size_t n, size_t cap,
                                         YYLTYPE *lloc, UserContext *uctx) {
   struct error err = {};
@@ -163,28 +178,84 @@ static struct error parse_text(FILE *in, FILE *out) {
 static int remark_line(char *line, size_t n, size_t cap, void *data) {
   struct parse_context *ctx = data;
 
+  ++ctx->lines;
+  ctx->size += n;
+
   // Parsing failure does not abort the remark process, so we count the errors
   ctx->errs += !!parse_line_and_dump(line, n, cap, &ctx->lloc, &ctx->uctx).es;
   return ctx->errs;
 }
 
-static struct error remark_c(const struct input *i, FILE *out) {
-#ifdef USE_CLANG_TOOL
-  struct error err;
-  FILE *in;
+static void remark_node(const struct remark_node *node, void *data) {
+  struct parse_context *ctx = data;
 
-  if ((err = open_file(i->file, "r", &in)).es)
-    return err;
+  ++ctx->lines;
+  ctx->errs += !parse_node(node);
+}
 
-  if (!(err = reads(in, &input_content, NULL)).es) {
-    struct parse_context ctx = PARSE_CONTEXT_INIT(1, out);
-    err = remark(string_get(&input_content), string_len(&input_content),
-                 ALT(i->tu, i->file), i->opts, remark_line, &ctx);
-    err = next_error(err, ctx.errs ? (struct error){ES_PARSE, ctx.errs}
-                                   : (struct error){});
+static void remark_meta(const char *tu, long ts, const char *cwd,
+                        void *data) {
+  parse_meta(tu, ts, cwd);
+}
+
+static void remark_semantics(const char *kind, const char *name,
+                             struct remark_loc begin, struct remark_loc end,
+                             void *data) {
+  ++((struct parse_context *)data)->lines;
+  parse_semantics(kind, name,
+                  (Range){parse_loc(begin.file, begin.line, begin.col),
+                          parse_loc(end.file, end.line, end.col)});
+}
+
+static void remark_header(const char *file, const char *tu, void *data) {
+  parse_lent_header(file, tu);
+}
+
+// Headers are left out once remarked by another TU given the same registry.
+static struct error remark_c(const struct input *i, FILE *out,
+                             struct remark_headers *headers) {
+#ifdef USE_CLANG_TOOL
+  struct error err = {};
+  struct parse_context ctx = PARSE_CONTEXT_INIT(1, out);
+  struct remark_sink sink = {remark_line, .data = &ctx, .headers = headers,
+                             .scope = output.scope};
+  // Remarks are text only when the text is asked for
+  if (!out && !output.noparse) {
+    sink.node = remark_node;
+    sink.meta = remark_meta;
+    sink.semantics = remark_semantics;
+    sink.header = remark_header;
   }
 
-  return next_error(err, close_file(in));
+  struct timespec begin, end;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+
+  // Regular files are read by the tool without copying, others are read here,
+  // e.g. the standard input, or a file remarked under another name.
+  struct stat st;
+  if (!i->tu && stat(i->file, &st) == 0 && S_ISREG(st.st_mode)) {
+    err = remark(NULL, 0, i->file, i->opts, &sink);
+  } else {
+    FILE *in;
+    if ((err = open_file(i->file, "r", &in)).es)
+      return err;
+
+    if (!(err = reads(in, &input_content, NULL)).es)
+      err = remark(string_get(&input_content), string_len(&input_content),
+                   ALT(i->tu, i->file), i->opts, &sink);
+    err = next_error(err, close_file(in));
+  }
+
+  // The cost of a TU, e.g. to compare scopes
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  TOGGLE(log_remark_cost,
+         fprintf(stderr, "%s: %u remarks, %zu bytes of lines in %ld ms\n",
+                 ALT(i->tu, i->file), ctx.lines, ctx.size,
+                 (end.tv_sec - begin.tv_sec) * 1000 +
+                     (end.tv_nsec - begin.tv_nsec) / 1000000));
+
+  return next_error(err, ctx.errs ? (struct error){ES_PARSE, ctx.errs}
+                                  : (struct error){});
 #else
   fprintf(stderr, "Clang tool is not compiled in\n");
   return (struct error){ES_REMARK_NO_CLANG};
@@ -245,7 +316,7 @@ static struct error remark_c_and_dump(struct input i) {
   bool noparse = output.noparse;
   output.noparse = 1;
   struct error err = {};
-  DO(output, remark_c(&i, of.file));
+  DO(output, remark_c(&i, of.file, NULL));
   output.noparse = noparse;
   return err;
 }
@@ -258,15 +329,15 @@ static struct error remark_c_only(struct input i) {
   return err;
 }
 
-static struct error remark_c_and_store(struct input i) {
-  struct error err = remark_c(&i, NULL);
-  DO(output, store());
-  return err;
+// Renders the opened database as the output, either a page or a site.
+static struct error render_output(struct output_file *of) {
+  return output.kind == OK_SITE ? render_site(output.file, output.gzip)
+                                : render(of->file, output.gzip);
 }
 
 static struct error render_html_only(struct input i) {
   struct error err = store_open(i.file);
-  DO(output, render(of.file));
+  DO(output, render_output(&of));
   return next_error(err, store_close());
 }
 
@@ -275,7 +346,7 @@ static struct error inmemory_store_and_render(struct error err) {
   struct output inmemory = output;
   inmemory.kind = OK_DATA;
   inmemory.file = ":memory:";
-  DO(inmemory, store(), { DO(origin, render(of.file)); });
+  DO(inmemory, store(), { DO(origin, render_output(&of)); });
   return err;
 }
 
@@ -284,7 +355,561 @@ static struct error parse_text_and_render(struct input i) {
 }
 
 static struct error remark_c_and_render(struct input i) {
-  return inmemory_store_and_render(remark_c(&i, NULL));
+  return inmemory_store_and_render(remark_c(&i, NULL, NULL));
+}
+
+struct link_context {
+  int kind;
+  unsigned parts;
+  char (*part)[PATH_MAX];
+};
+
+// Names the given number of partial databases of the output.
+static char (*new_parts(const char *name, unsigned n))[PATH_MAX] {
+  char (*part)[PATH_MAX] = calloc(n, sizeof(*part));
+  assert(part);
+
+  char str[8];
+  rands(str, sizeof(str));
+  for (unsigned i = 0; i < n; ++i)
+    snprintf(part[i], sizeof(*part), "%s.%s-%s-%u", output.file, name, str, i);
+
+  return part;
+}
+
+// Removes partial databases left, and frees their names.
+static struct error drop_parts(struct error err, char (*part)[PATH_MAX],
+                               unsigned n) {
+  for (unsigned i = 0; i < n; ++i) {
+    if (access(part[i], F_OK) == 0)
+      err = next_error(err, unlink_file(part[i]));
+  }
+
+  free(part);
+  return err;
+}
+
+static struct error link_part(unsigned job, unsigned worker, void *obj) {
+  struct link_context *ctx = obj;
+  struct error err = store_open(ctx->part[job]);
+  if (err.es)
+    return err;
+
+  for (unsigned i = job; !err.es && i < input_list.i; i += ctx->parts) {
+    if (input_list.data[i].kind == ctx->kind)
+      err = store_link(input_list.data[i].file);
+  }
+
+  return next_error(err, store_close());
+}
+
+// Links the partial databases existing into the first one of them, which is
+// given by `first`, or the number of them if none.
+static struct error merge_parts(char (*part)[PATH_MAX], unsigned n,
+                                unsigned *first) {
+  struct error err = {};
+  for (*first = 0; *first < n && access(part[*first], F_OK); ++*first)
+    ;
+  if (*first + 1 >= n || (err = store_open(part[*first])).es)
+    return err;
+
+  for (unsigned i = *first + 1; !err.es && i < n; ++i) {
+    if (access(part[i], F_OK) == 0)
+      err = store_link(part[i]);
+  }
+
+  return next_error(err, store_close());
+}
+
+// Links databases into the output one in place, so the output could be linked
+// incrementally. Inputs are linked into partial databases by workers first,
+// therefore the final pass would meet far less duplicated rows. Partial ones
+// are merged into one at last, so the output is linked by one transaction,
+// never left half relinked.
+static struct error link_data(int kind) {
+  unsigned n = 0;
+  foreach_input(i, { n += i.kind == kind; });
+
+  unsigned workers = pool_size();
+  struct link_context ctx = {kind, n / 2 < workers ? n / 2 : workers};
+  if (!ctx.parts && n > 1)
+    ctx.parts = 1;
+
+  struct error err = {};
+  unsigned first = 0;
+  if (ctx.parts) {
+    ctx.part = new_parts("part", ctx.parts);
+    err = pool_run(ctx.parts, workers, link_part, &ctx);
+    if (!err.es)
+      err = merge_parts(ctx.part, ctx.parts, &first);
+  }
+
+  if (!err.es && !(err = store_open_durable(output.file)).es) {
+    if (ctx.parts) {
+      if (first < ctx.parts)
+        err = store_link(ctx.part[first]);
+    } else {
+      foreach_input(i, {
+        if (!err.es && i.kind == kind)
+          err = store_link(i.file);
+      });
+    }
+    err = next_error(err, store_close());
+  }
+
+  return drop_parts(err, ctx.part, ctx.parts);
+}
+
+struct remark_context {
+  unsigned *order;        // the indices of inputs, the costliest first
+  unsigned *duration;     // the time of remarking each input in milliseconds
+  char (*db)[PATH_MAX];   // the database of each input
+  char (*part)[PATH_MAX]; // the partial database of each worker
+  struct remark_headers *headers; // headers remarked by any worker
+};
+
+// Returns the time since the given one in milliseconds, rounded up so it's
+// never 0, which is for unknown.
+static unsigned elapsed_ms(const struct timespec *begin) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - begin->tv_sec) * 1000 +
+         (end.tv_nsec - begin->tv_nsec) / 1000000 + 1;
+}
+
+// Each input is stored alone, as storing is for one TU at a time, then linked
+// into the partial database of the worker.
+static struct error remark_part(unsigned job, unsigned worker, void *obj) {
+  struct remark_context *ctx = obj;
+  struct input i = input_list.data[ctx->order[job]];
+
+  struct timespec begin;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+
+  struct error err = parse_init();
+  if (!err.es)
+    err = remark_c(&i, NULL, ctx->headers);
+  if (!err.es && !(err = store_open(ctx->db[job])).es)
+    err = next_error(store(), store_close());
+  err = next_error(err, parse_halt());
+  string_clear(&input_content, 1);
+
+  if (!err.es)
+    ctx->duration[job] = elapsed_ms(&begin);
+
+  if (!err.es && !(err = store_open(ctx->part[worker])).es)
+    err = next_error(store_link(ctx->db[job]), store_close());
+  if (access(ctx->db[job], F_OK) == 0)
+    err = next_error(err, unlink_file(ctx->db[job]));
+  return err;
+}
+
+// The history of a TU from the last build of the output.
+struct record {
+  char *tu;
+  unsigned includes;
+  unsigned duration;
+  uint64_t options;
+  bool stale; // some source it included has changed since
+};
+
+typedef DECL_ARRAY(RecordList, struct record) RecordList;
+static inline IMPL_ARRAY_PUSH(RecordList, struct record);
+
+static void destroy_record(void *p) { free(((struct record *)p)->tu); }
+static inline IMPL_ARRAY_CLEAR(RecordList, destroy_record);
+
+static int compare_record(const void *v, const void *element, size_t size) {
+  return strcmp(v, ((const struct record *)element)->tu);
+}
+static inline IMPL_ARRAY_BSEARCH(RecordList, compare_record);
+
+static bool history_row(const char *tu, int tu_len, unsigned includes,
+                        unsigned duration, uint64_t options, void *obj) {
+  RecordList_push(obj, (struct record){strndup(tu, tu_len), includes, duration,
+                                       options});
+  return false;
+}
+
+struct member_context {
+  RecordList *records;
+  char *file;       // the file of the last row
+  uint64_t digest;  // the digest of the file now
+  bool unreadable;  // the file is gone or can not be read
+};
+
+// Rows of a file are adjacent, so each file is digested once.
+static bool member_file_row(const char *file, uint64_t digest, const char *tu,
+                            int tu_len, void *obj) {
+  struct member_context *ctx = obj;
+  if (!ctx->file || strcmp(ctx->file, file) != 0) {
+    free(ctx->file);
+    ctx->file = strdup(file);
+    ctx->unreadable = digest_file(file, &ctx->digest).es;
+  }
+
+  ARRAY_size_t i;
+  if ((ctx->unreadable || ctx->digest != digest) &&
+      RecordList_bsearch(ctx->records, tu, &i))
+    ctx->records->data[i].stale = true;
+  return false;
+}
+
+// Bump it if TUs are remarked or stored differently given the same options, so
+// TUs kept by outputs of an older tool are remarked again.
+#define REMARK_VERSION 1
+
+// Options are digested as a whole, with each one ended by a NUL, so 0 is left
+// for unknown. The scope is an option too as it changes remarks, so are the
+// versions of the tool and of clang.
+static uint64_t hash_options(char **opts) {
+  struct string s = {};
+  for (char **o = opts; o && *o; ++o)
+    string_append(&s, *o, strlen(*o) + 1);
+  if (output.scope) {
+    string_append(&s, "-r", 3);
+    string_append(&s, output.scope, strlen(output.scope) + 1);
+  }
+
+  char version[16];
+  int n = snprintf(version, sizeof(version), "-V%d", REMARK_VERSION);
+  string_append(&s, version, n + 1);
+#ifdef USE_CLANG_TOOL
+  string_append(&s, remark_version(), strlen(remark_version()) + 1);
+#endif // USE_CLANG_TOOL
+  uint64_t digest = hash(string_get(&s), string_len(&s));
+  string_clear(&s, 1);
+  return digest ? digest : 1;
+}
+
+typedef DECL_ARRAY(DirList, char *) DirList;
+static inline IMPL_ARRAY_PUSH(DirList, char *);
+
+static void destroy_dir(void *p) { free(*(char **)p); }
+static inline IMPL_ARRAY_CLEAR(DirList, destroy_dir);
+
+// Directories searched for included files by the options of a TU, in the order
+// clang searches them but the system ones, which are not known here. Quoted
+// names are searched in all of them after the directory of the file including,
+// angled ones in those after the ones of -iquote.
+struct search_dirs {
+  DirList dirs;
+  unsigned angled; // the first one searched for angled names
+};
+
+// Relative directories are of the one given by -working-directory, or else of
+// the process, as remark() takes them.
+static void add_search_dirs(struct search_dirs *search, char **opts,
+                            const char *flag, const char *cwd) {
+  const size_t n = strlen(flag);
+  for (char **o = opts; o && *o; ++o) {
+    const char *dir = NULL;
+    if (!strcmp(*o, flag))
+      dir = o[1] ? *++o : NULL;
+    else if (starts_with(*o, flag))
+      dir = *o + n;
+    if (!dir || !*dir)
+      continue;
+
+    char path[PATH_MAX];
+    dir = expand_path(cwd, strlen(cwd), dir, path, sizeof(path));
+    DirList_push(&search->dirs, strdup(dir));
+  }
+}
+
+static void get_search_dirs(struct search_dirs *search, char **opts) {
+  char cwd[PATH_MAX], dir[PATH_MAX];
+  const char *base = getcwd(cwd, sizeof(cwd)) ? cwd : ".";
+  for (char **o = opts; o && *o; ++o) {
+    const char *wd = NULL;
+    if (!strcmp(*o, "-working-directory"))
+      wd = o[1];
+    else if (starts_with(*o, "-working-directory="))
+      wd = *o + strlen("-working-directory=");
+    if (wd && *wd) {
+      base = expand_path(base, strlen(base), wd, dir, sizeof(dir));
+      break;
+    }
+  }
+
+  add_search_dirs(search, opts, "-iquote", base);
+  search->angled = search->dirs.i;
+  add_search_dirs(search, opts, "-I", base);
+  add_search_dirs(search, opts, "-isystem", base);
+  add_search_dirs(search, opts, "-idirafter", base);
+}
+
+struct inclusion_context {
+  const struct search_dirs *search;
+  char *file;       // the file including of the last row
+  const char *data; // its content
+  size_t size;
+  size_t pos;    // the offset of the line
+  unsigned line; // the line at the offset
+  bool shadowed; // some name included is found elsewhere now
+};
+
+// Returns the line of the file including at the row, reading rows of the same
+// file forward, as they are ordered.
+static const char *inclusion_line(struct inclusion_context *ctx,
+                                  const char *file, unsigned row) {
+  if (!ctx->file || strcmp(ctx->file, file) != 0) {
+    unmap_file(ctx->data, ctx->size);
+    free(ctx->file);
+    ctx->file = strdup(file);
+    ctx->pos = 0;
+    ctx->line = 1;
+    if (map_file(file, &ctx->data, &ctx->size).es)
+      ctx->data = NULL;
+  }
+
+  while (ctx->data && ctx->line < row && ctx->pos < ctx->size) {
+    const char *eol =
+        memchr(ctx->data + ctx->pos, '\n', ctx->size - ctx->pos);
+    ctx->pos = eol ? eol - ctx->data + 1 : ctx->size;
+    ++ctx->line;
+  }
+  return ctx->data && ctx->line == row ? ctx->data + ctx->pos : NULL;
+}
+
+// Names are read back from files including them, which are up to date, and
+// searched again. Names not found in the directories known are left as they
+// were found, e.g. in system ones, so are computed inclusions.
+static bool inclusion_row(const char *file, unsigned row, unsigned col,
+                          const char *path, void *obj) {
+  struct inclusion_context *ctx = obj;
+  const char *line = inclusion_line(ctx, file, row);
+  const char *end = ctx->data + ctx->size;
+  if (!line || !col || line + col > end)
+    return false;
+
+  const char *p = line + col - 1, *q = p + 1;
+  const char close = *p == '<' ? '>' : *p == '"' ? '"' : 0;
+  while (close && q < end && *q != close && *q != '\n')
+    ++q;
+  if (!close || q == end || *q != close || q == p + 1 || p[1] == '/')
+    return false;
+
+  char found[PATH_MAX], real[PATH_MAX];
+  const int n = q - p - 1;
+  const char *slash = strrchr(file, '/');
+  if (close == '"' &&
+      snprintf(found, sizeof(found), "%.*s/%.*s",
+               slash ? (int)(slash - file) : 1, slash ? file : ".", n,
+               p + 1) < (int)sizeof(found) &&
+      access(found, F_OK) == 0)
+    return ctx->shadowed = !realpath(found, real) || strcmp(real, path);
+
+  const DirList *dirs = &ctx->search->dirs;
+  for (unsigned i = close == '"' ? 0 : ctx->search->angled; i < dirs->i; ++i) {
+    if (snprintf(found, sizeof(found), "%s/%.*s", dirs->data[i], n, p + 1) <
+            (int)sizeof(found) &&
+        access(found, F_OK) == 0)
+      return ctx->shadowed = !realpath(found, real) || strcmp(real, path);
+  }
+  return false;
+}
+
+// Tells if some file included by the TU last time is shadowed by another one
+// now, e.g. a new header found earlier by the search for the same name.
+static bool shadows_inclusion(const struct input *input, const char *tu) {
+  struct search_dirs search = {};
+  get_search_dirs(&search, input->opts);
+
+  struct inclusion_context ctx = {&search};
+  query_inclusions(tu, inclusion_row, &ctx);
+  unmap_file(ctx.data, ctx.size);
+  free(ctx.file);
+  DirList_clear(&search.dirs, 1);
+  return ctx.shadowed;
+}
+
+struct input_cost {
+  double cost;
+  unsigned index;
+};
+
+static int by_cost(const void *a, const void *b) {
+  const struct input_cost *x = a, *y = b;
+  return (x->cost < y->cost) - (x->cost > y->cost);
+}
+
+// An included source is counted as this many bytes of the TU.
+#define INCLUDE_COST 8192
+
+// Orders inputs of the kind by their cost, the costliest first, and returns the
+// number of them to remark. The cost is the time of the last build, or else
+// estimated by the size of the input and the number of sources it included
+// last time, scaled to the time by TUs known.
+//
+// A TU is up to date and left out if it is built with the same options by the
+// same tool as last time, none of the sources it included has changed since,
+// and each name it included is still found as the same file. Its rows are
+// simply kept by the output.
+static unsigned order_inputs(int kind, unsigned *order, uint64_t *options) {
+  RecordList records = {};
+  const bool opened = access(output.file, F_OK) == 0 &&
+                      !store_open_readonly(output.file).es;
+  if (opened) {
+    query_history(history_row, &records);
+    struct member_context members = {&records};
+    query_member_files(member_file_row, &members);
+    free(members.file);
+  }
+
+  unsigned n = 0;
+  foreach_input(i, { n += i.kind == kind; });
+
+  struct input_cost *costs = calloc(n, sizeof(*costs));
+  assert(costs);
+
+  double known_size = 0, known_time = 0;
+  n = 0;
+  for (unsigned i = 0; i < input_list.i; ++i) {
+    const struct input *input = &input_list.data[i];
+    if (input->kind != kind)
+      continue;
+
+    ARRAY_size_t j;
+    const struct record *r = NULL;
+    if (RecordList_bsearch(&records, ALT(input->tu, input->file), &j))
+      r = &records.data[j];
+
+    const uint64_t digest = hash_options(input->opts);
+    if (r && !r->stale && r->duration && r->options == digest &&
+        !shadows_inclusion(input, r->tu))
+      continue;
+
+    struct stat st;
+    double size = stat(input->file, &st) == 0 ? st.st_size : 0;
+    if (r)
+      size += (double)r->includes * INCLUDE_COST;
+    if (r && r->duration) {
+      known_size += size;
+      known_time += r->duration;
+    }
+
+    // Costs of known TUs are negative for now
+    options[i] = digest;
+    costs[n++] = (struct input_cost){
+        r && r->duration ? -(double)r->duration : size, i};
+  }
+
+  const double scale = known_size ? known_time / known_size : 1;
+  for (unsigned i = 0; i < n; ++i)
+    costs[i].cost = costs[i].cost < 0 ? -costs[i].cost : costs[i].cost * scale;
+
+  if (opened)
+    store_close();
+
+  qsort(costs, n, sizeof(*costs), by_cost);
+  for (unsigned i = 0; i < n; ++i)
+    order[i] = costs[i].index;
+
+  free(costs);
+  RecordList_clear(&records, 1);
+  return n;
+}
+
+// Remarks C inputs by the given number of jobs at once, and links them into the
+// output. Inputs are picked by idle workers, the costliest first, so a large
+// one is not left to the end with other workers idle. The time of each input
+// is kept by the output to order inputs next time, and to leave out ones up to
+// date. A header shared by inputs is remarked once, by the first one done.
+//
+// A single input is linked as well, so other TUs of the output are kept.
+static struct error remark_c_all(int kind) {
+  unsigned n = 0;
+  foreach_input(i, { n += i.kind == kind; });
+
+  struct error err = {};
+  struct remark_context ctx = {
+      calloc(n, sizeof(*ctx.order)),
+      calloc(n, sizeof(*ctx.duration)),
+  };
+  uint64_t *options = calloc(input_list.i, sizeof(*options));
+  assert(ctx.order && ctx.duration && options);
+  if (!(n = order_inputs(kind, ctx.order, options))) {
+    free(ctx.order);
+    free(ctx.duration);
+    free(options);
+    return err;
+  }
+
+  unsigned workers = output.jobs ? output.jobs : 1;
+  if (workers > n)
+    workers = n;
+
+  ctx.db = new_parts("tu", n);
+  ctx.part = new_parts("part", workers);
+#ifdef USE_CLANG_TOOL
+  ctx.headers = remark_headers_new();
+#endif // USE_CLANG_TOOL
+  err = pool_run(n, workers, remark_part, &ctx);
+#ifdef USE_CLANG_TOOL
+  remark_headers_free(ctx.headers);
+#endif // USE_CLANG_TOOL
+
+  unsigned first = 0;
+  if (!err.es)
+    err = merge_parts(ctx.part, workers, &first);
+  if (!err.es && !(err = store_open_durable(output.file)).es) {
+    if (first < workers)
+      err = store_link(ctx.part[first]);
+
+    const char **tu = calloc(n, sizeof(*tu));
+    uint64_t *tu_options = calloc(n, sizeof(*tu_options));
+    assert(tu && tu_options);
+    for (unsigned i = 0; i < n; ++i) {
+      const struct input *input = &input_list.data[ctx.order[i]];
+      tu[i] = ALT(input->tu, input->file);
+      tu_options[i] = options[ctx.order[i]];
+    }
+    if (!err.es)
+      err = store_history(n, tu, ctx.duration, tu_options);
+    free(tu);
+    free(tu_options);
+
+    err = next_error(err, store_close());
+  }
+
+  err = drop_parts(err, ctx.db, n);
+  err = drop_parts(err, ctx.part, workers);
+  free(ctx.order);
+  free(ctx.duration);
+  free(options);
+  return err;
+}
+
+// Renders all databases as one site, which are linked into a temporary one
+// unless there is only one, so each source is rendered once no matter how many
+// TUs include it, and links work across TUs.
+static struct error render_site_all(int kind) {
+  unsigned n = 0;
+  foreach_input(i, { n += i.kind == kind; });
+
+  struct error err = {};
+  if (n == 1) {
+    foreach_input(i, {
+      if (i.kind == kind)
+        err = render_html_only(i);
+    });
+    return err;
+  }
+
+  char db[PATH_MAX], str[8];
+  snprintf(db, sizeof(db), "%s.link-%s", output.file, rands(str, sizeof(str)));
+
+  char *file = output.file;
+  output.file = db;
+  err = link_data(kind);
+  output.file = file;
+
+  if (!err.es)
+    err = render_html_only((struct input){kind, db});
+  if (access(db, F_OK) == 0)
+    err = next_error(err, unlink_file(db));
+  return err;
 }
 
 static_assert(IK_NUMS < 16 && OK_NUMS < 16, "Too many input/output kinds");
@@ -293,39 +918,52 @@ static_assert(IK_NUMS < 16 && OK_NUMS < 16, "Too many input/output kinds");
 
 struct builder {
   build_t build;
+  batch_t batch;
   const char *info;
 };
 
 static struct builder builders[128] = {
-#define IOB(a, b, c) [IO(IK_##a, OK_##b)] = {c, #a " -> " #b}
+#define IOB(a, b, c) [IO(IK_##a, OK_##b)] = {c, NULL, #a " -> " #b}
+#define IOB_ALL(a, b, c) [IO(IK_##a, OK_##b)] = {NULL, c, #a " -> " #b}
 
     IOB(TEXT, NIL, parse_text_only),
     IOB(TEXT, TEXT, parse_text_and_dump),
     IOB(TEXT, DATA, parse_text_and_store),
     IOB(TEXT, HTML, parse_text_and_render),
+    IOB(TEXT, SITE, parse_text_and_render),
 
     IOB(C, NIL, remark_c_only),
     IOB(C, TEXT, remark_c_and_dump),
-    IOB(C, DATA, remark_c_and_store),
+    IOB_ALL(C, DATA, remark_c_all),
     IOB(C, HTML, remark_c_and_render),
+    IOB(C, SITE, remark_c_and_render),
 
     IOB(DATA, HTML, render_html_only),
+    IOB_ALL(DATA, SITE, render_site_all),
+    IOB_ALL(DATA, DATA, link_data),
 
 #undef IOB
+#undef IOB_ALL
 };
 
 struct error build_output(struct output o) {
-  struct error err = next_error(parse_init(), render_init());
+  struct error err = next_error(parse_init(), render_init(o.cache));
   if (err.es)
     return err;
 
   output = o;
   srand(time(NULL));
 
+  unsigned batched = 0; // the bit set of input kinds built in batch
   foreach_input(i, {
     unsigned k = IO(i.kind, o.kind);
     assert(k < sizeof(builders) / sizeof(*builders));
-    if (!builders[k].build) {
+    if (builders[k].batch) {
+      if (!(batched & 1U << i.kind)) {
+        batched |= 1U << i.kind;
+        err = builders[k].batch(i.kind);
+      }
+    } else if (!builders[k].build) {
       fprintf(stderr, "Building is not allowed: %s\n", builders[k].info);
       err = (struct error){ES_BUILDING_PROHIBITED};
     } else {
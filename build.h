@@ -50,14 +50,19 @@ enum output_kind {
   OK_TEXT,
   OK_DATA,
   OK_HTML,
+  OK_SITE,
   OK_NUMS,
 };
 
 struct output {
   int kind;
   char *file;
+  char *cache;   // the directory to cache fragments of pages
+  unsigned jobs; // the number of C inputs remarked at once
+  char *scope;   // directories remarked besides main files, NULL for all
   unsigned char silent : 1;
   unsigned char noparse : 1;
+  unsigned char gzip : 1;
 };
 
 struct error build_output(struct output o);
\ No newline at end of file
@@ -0,0 +1,418 @@
+#include "compdb.h"
+#include "array.h"
+#include "build.h"
+#include "test.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Blocks referred by inputs, i.e. the text of databases and option lists.
+typedef DECL_ARRAY(BlockList, void *) BlockList;
+static inline IMPL_ARRAY_PUSH(BlockList, void *);
+
+static void destroy_block(void *p) { free(*(void **)p); }
+static inline IMPL_ARRAY_CLEAR(BlockList, destroy_block);
+
+static BlockList blocks;
+
+static void *own(void *p) {
+  assert(p);
+  BlockList_push(&blocks, p);
+  return p;
+}
+
+// A minimal JSON reader, strings are decoded in place as they never grow.
+struct reader {
+  char *p;
+  char *end;
+};
+
+static void skip_space(struct reader *r) {
+  while (r->p < r->end && (*r->p == ' ' || *r->p == '\t' || *r->p == '\n' ||
+                           *r->p == '\r'))
+    ++r->p;
+}
+
+static bool eat(struct reader *r, char c) {
+  skip_space(r);
+  if (r->p < r->end && *r->p == c) {
+    ++r->p;
+    return true;
+  }
+
+  return false;
+}
+
+static int hex(struct reader *r) {
+  if (r->end - r->p < 4)
+    return -1;
+
+  int v = 0;
+  for (int i = 0; i < 4; ++i) {
+    char c = *r->p++;
+    v <<= 4;
+    if (c >= '0' && c <= '9')
+      v |= c - '0';
+    else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+      v |= (c | 0x20) - 'a' + 10;
+    else
+      return -1;
+  }
+
+  return v;
+}
+
+static char *utf8(char *w, unsigned c) {
+  if (c < 0x80) {
+    *w++ = c;
+  } else if (c < 0x800) {
+    *w++ = 0xC0 | c >> 6;
+    *w++ = 0x80 | (c & 0x3F);
+  } else if (c < 0x10000) {
+    *w++ = 0xE0 | c >> 12;
+    *w++ = 0x80 | (c >> 6 & 0x3F);
+    *w++ = 0x80 | (c & 0x3F);
+  } else {
+    *w++ = 0xF0 | c >> 18;
+    *w++ = 0x80 | (c >> 12 & 0x3F);
+    *w++ = 0x80 | (c >> 6 & 0x3F);
+    *w++ = 0x80 | (c & 0x3F);
+  }
+
+  return w;
+}
+
+// Returns the decoded string terminated by NUL, NULL if malformed.
+static char *read_string(struct reader *r) {
+  if (!eat(r, '"'))
+    return NULL;
+
+  char *s = r->p, *w = r->p;
+  while (r->p < r->end && *r->p != '"') {
+    char c = *r->p++;
+    if (c != '\\') {
+      *w++ = c;
+      continue;
+    }
+
+    if (r->p == r->end)
+      return NULL;
+
+    switch ((c = *r->p++)) {
+    case 'b':
+      *w++ = '\b';
+      break;
+    case 'f':
+      *w++ = '\f';
+      break;
+    case 'n':
+      *w++ = '\n';
+      break;
+    case 'r':
+      *w++ = '\r';
+      break;
+    case 't':
+      *w++ = '\t';
+      break;
+    case 'u': {
+      int u = hex(r);
+      if (u < 0)
+        return NULL;
+      if (u >= 0xD800 && u < 0xDC00 && r->end - r->p >= 6 && r->p[0] == '\\' &&
+          r->p[1] == 'u') {
+        r->p += 2;
+        int v = hex(r);
+        if (v < 0xDC00 || v >= 0xE000)
+          return NULL;
+        u = 0x10000 + ((u - 0xD800) << 10) + (v - 0xDC00);
+      }
+      w = utf8(w, u);
+      break;
+    }
+    default:
+      *w++ = c;
+      break;
+    }
+  }
+
+  if (r->p == r->end)
+    return NULL;
+
+  ++r->p;
+  *w = 0;
+  return s;
+}
+
+static bool skip_value(struct reader *r) {
+  skip_space(r);
+  if (r->p == r->end)
+    return false;
+
+  switch (*r->p) {
+  case '"':
+    return read_string(r);
+  case '[':
+  case '{': {
+    const char close = *r->p++ == '[' ? ']' : '}';
+    if (eat(r, close))
+      return true;
+    do {
+      if (close == '}' && !(read_string(r) && eat(r, ':')))
+        return false;
+      if (!skip_value(r))
+        return false;
+    } while (eat(r, ','));
+    return eat(r, close);
+  }
+  default:
+    // Numbers and literals
+    while (r->p < r->end && !strchr(" \t\r\n,]}", *r->p))
+      ++r->p;
+    return true;
+  }
+}
+
+// Splits a command line into words in place as the shell does for quotes, and
+// returns the number of words, which are packed one after another.
+static unsigned split_command(char *s) {
+  unsigned argc = 0;
+  char *w = s;
+
+  while (*s) {
+    while (*s == ' ' || *s == '\t' || *s == '\n')
+      ++s;
+    if (!*s)
+      break;
+
+    char quote = 0;
+    for (; *s && (quote || !strchr(" \t\n", *s)); ++s) {
+      if (quote == '\'' && *s == '\'')
+        quote = 0;
+      else if (quote == '\'')
+        *w++ = *s;
+      else if (*s == '\\' && s[1] && (!quote || strchr("\"\\$`", s[1])))
+        *w++ = *++s;
+      else if (*s == '"' || (!quote && *s == '\''))
+        quote = quote ? 0 : *s;
+      else
+        *w++ = *s;
+    }
+
+    // The separator is consumed before being overwritten
+    if (*s)
+      ++s;
+    *w++ = 0;
+    ++argc;
+  }
+
+  return argc;
+}
+
+struct entry {
+  char *directory;
+  char *file;
+  char *command;
+  char **arguments;
+  unsigned argc;
+};
+
+typedef bool (*entry_t)(struct entry *e, void *obj);
+
+static struct error read_entries(char *text, size_t n, entry_t fn, void *obj) {
+  struct reader r = {text, text + n};
+  const struct error syntax = {ES_COMPDB_SYNTAX};
+
+  if (!eat(&r, '['))
+    return syntax;
+  if (eat(&r, ']'))
+    return (struct error){};
+
+  do {
+    struct entry e = {};
+    unsigned cap = 0;
+
+    if (!eat(&r, '{'))
+      return syntax;
+    if (!eat(&r, '}')) {
+      do {
+        char *key = read_string(&r);
+        if (!key || !eat(&r, ':'))
+          return syntax;
+
+        char **value = strcmp(key, "directory") == 0 ? &e.directory
+                       : strcmp(key, "file") == 0    ? &e.file
+                       : strcmp(key, "command") == 0 ? &e.command
+                                                     : NULL;
+        if (value) {
+          if (!(*value = read_string(&r)))
+            return syntax;
+        } else if (strcmp(key, "arguments") == 0) {
+          if (!eat(&r, '['))
+            return syntax;
+          if (eat(&r, ']'))
+            continue;
+          do {
+            if (e.argc == cap) {
+              cap = cap ? cap * 2 : 16;
+              e.arguments = realloc(e.arguments, cap * sizeof(char *));
+              assert(e.arguments);
+            }
+            if (!(e.arguments[e.argc++] = read_string(&r)))
+              return free(e.arguments), syntax;
+          } while (eat(&r, ','));
+          if (!eat(&r, ']'))
+            return free(e.arguments), syntax;
+        } else if (!skip_value(&r)) {
+          return free(e.arguments), syntax;
+        }
+      } while (eat(&r, ','));
+
+      if (!eat(&r, '}'))
+        return free(e.arguments), syntax;
+    }
+
+    if (!e.arguments && e.command) {
+      unsigned argc = split_command(e.command);
+      e.arguments = calloc(argc ? argc : 1, sizeof(char *));
+      assert(e.arguments);
+      for (char *s = e.command; e.argc < argc; s += strlen(s) + 1)
+        e.arguments[e.argc++] = s;
+    }
+
+    bool stop = fn(&e, obj);
+    free(e.arguments);
+    if (stop)
+      break;
+  } while (eat(&r, ','));
+
+  return eat(&r, ']') || r.p == r.end ? (struct error){} : syntax;
+}
+
+// Makes the file of an entry absolute by the directory, which is of the process
+// if relative, and without dots, so the TU is named as the remark tool records
+// it given the directory, see make_paths_absolute() of remark.cc.
+static const char *entry_path(const char *dir, const char *file,
+                              char path[PATH_MAX]) {
+  if (file[0] == '/')
+    return expand_path(NULL, 0, file + 1, path, PATH_MAX);
+
+  char cwd[PATH_MAX], base[PATH_MAX];
+  if (dir[0] != '/') {
+    if (!getcwd(cwd, sizeof(cwd)))
+      return NULL;
+    dir = expand_path(cwd, strlen(cwd), dir, base, PATH_MAX);
+  }
+  return expand_path(dir, strlen(dir), file, path, PATH_MAX);
+}
+
+static bool add_entry(struct entry *e, void *obj) {
+  if (!e->file || !e->file[0])
+    return false;
+
+  char *dir = ALT(e->directory, ".");
+  char path[PATH_MAX];
+  const char *abs = entry_path(dir, e->file, path);
+  char *file = own(strdup(ALT(abs, e->file)));
+
+  // The compiler, the output and the input itself are left to remark()
+  char **opts = own(calloc(e->argc + 3, sizeof(char *)));
+  unsigned n = 0;
+  for (unsigned i = 1; i < e->argc; ++i) {
+    char *arg = e->arguments[i];
+    if (strcmp(arg, "-o") == 0)
+      ++i;
+    else if (strcmp(arg, "-c") && strcmp(arg, e->file) && strcmp(arg, file))
+      opts[n++] = arg;
+  }
+  opts[n++] = "-working-directory";
+  opts[n++] = dir;
+
+  add_input({IK_C, file, NULL, opts});
+  return false;
+}
+
+struct error compdb_load(const char *file) {
+  FILE *fp;
+  struct error err = open_file(file, "r", &fp);
+  if (err.es)
+    return err;
+
+  struct string s = {};
+  if (!(err = reads(fp, &s, NULL)).es) {
+    size_t n = string_len(&s);
+    char *text = own(malloc(n + 1));
+    memcpy(text, string_get(&s), n);
+    text[n] = 0;
+
+    if ((err = read_entries(text, n, add_entry, NULL)).es)
+      fprintf(stderr, "%s: malformed compilation database\n", file);
+  }
+
+  string_clear(&s, 1);
+  return next_error(err, close_file(fp));
+}
+
+void compdb_free() { BlockList_clear(&blocks, 1); }
+
+struct entries {
+  unsigned n;
+  struct entry e[4];
+  char *argv[4][8];
+};
+
+static bool copy_entry(struct entry *e, void *obj) {
+  struct entries *x = obj;
+  if (x->n == 4)
+    return true;
+
+  unsigned n = x->n++;
+  for (unsigned i = 0; i < e->argc && i < 8; ++i)
+    x->argv[n][i] = e->arguments[i];
+  x->e[n] = *e;
+  x->e[n].arguments = x->argv[n];
+  return false;
+}
+
+TEST(split_command, {
+  char s[] = " cc  -DX=\"a b\" '-I$d' a\\ b.c \"\"";
+  ASSERT(split_command(s) == 5);
+
+  const char *words[] = {"cc", "-DX=a b", "-I$d", "a b.c", ""};
+  char *p = s;
+  for (unsigned i = 0; i < 5; p += strlen(p) + 1, ++i)
+    ASSERT(strcmp(p, words[i]) == 0, "%s", p);
+})
+
+TEST(entry_path, {
+  char path[PATH_MAX];
+  ASSERT(strcmp(entry_path("/a", "x.c", path), "/a/x.c") == 0);
+  ASSERT(strcmp(entry_path("/a", "./src/x.c", path), "/a/src/x.c") == 0);
+  ASSERT(strcmp(entry_path("/a/b/", "../x.c", path), "/a/x.c") == 0);
+  ASSERT(strcmp(entry_path("/a", "/b/./c/../x.c", path), "/b/x.c") == 0);
+})
+
+TEST(read_entries, {
+  char s[] = "[{\"directory\": \"/a\", \"file\": \"x.c\","
+             "  \"arguments\": [\"cc\", \"-c\", \"x\\u00e9.c\"],"
+             "  \"output\": {\"k\": [1, true, null]}},"
+             " {\"command\": \"cc -o x.o \\\"x.c\\\"\", \"file\": \"y\\n\"}]";
+  struct entries x = {};
+  ASSERT(!read_entries(s, strlen(s), copy_entry, &x).es);
+  ASSERT(x.n == 2);
+
+  ASSERT(strcmp(x.e[0].directory, "/a") == 0);
+  ASSERT(strcmp(x.e[0].file, "x.c") == 0);
+  ASSERT(x.e[0].argc == 3);
+  ASSERT(strcmp(x.e[0].arguments[2], "x\xC3\xA9.c") == 0);
+
+  ASSERT(!x.e[1].directory);
+  ASSERT(strcmp(x.e[1].file, "y\n") == 0);
+  ASSERT(x.e[1].argc == 4);
+  ASSERT(strcmp(x.e[1].arguments[3], "x.c") == 0);
+
+  char bad[] = "[{\"file\": \"x.c\"";
+  struct error err = read_entries(bad, strlen(bad), copy_entry, &x);
+  ASSERT(err.es == ES_COMPDB_SYNTAX);
+})
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "error.h"
+
+// Adds the TUs of a compilation database, i.e. compile_commands.json, as C
+// inputs. Each TU is given its own options, and its working directory by
+// `-working-directory`, so relative paths are resolved as the compiler does.
+struct error compdb_load(const char *file);
+
+// Frees what the inputs of compilation databases refer to.
+void compdb_free();
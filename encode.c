@@ -0,0 +1,139 @@
+#include "encode.h"
+#include "test.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void encode_varint(struct bytes *b, uint64_t v) {
+  uint8_t buf[10];
+  unsigned n = 0;
+  do {
+    buf[n] = v & 0x7F;
+    v >>= 7;
+    buf[n++] |= v ? 0x80 : 0;
+  } while (v);
+  bytes_append(b, buf, n);
+}
+
+static inline void encode_zigzag(struct bytes *b, int64_t v) {
+  encode_varint(b, (uint64_t)v << 1 ^ (uint64_t)(v >> 63));
+}
+
+void encode_range(struct encoder *e, unsigned begin_row, unsigned begin_col,
+                  unsigned end_row, unsigned end_col) {
+  encode_zigzag(&e->rows, (int64_t)begin_row - e->row);
+  encode_zigzag(&e->rows, (int64_t)begin_col -
+                              (begin_row == e->row ? e->col : 0));
+  encode_zigzag(&e->rows, (int64_t)end_row - begin_row);
+  encode_zigzag(&e->rows,
+                (int64_t)end_col - (end_row == begin_row ? begin_col : 0));
+  e->row = begin_row;
+  e->col = begin_col;
+  ++e->count;
+}
+
+static void encoder_grow(struct encoder *e) {
+  unsigned cap = e->cap ? e->cap * 2 : 64;
+  struct encoder_slot *slots = calloc(cap, sizeof(*slots));
+  assert(slots);
+
+  for (unsigned i = 0; i < e->cap; ++i) {
+    if (e->slots[i].index) {
+      unsigned j = e->slots[i].hash & (cap - 1);
+      while (slots[j].index)
+        j = (j + 1) & (cap - 1);
+      slots[j] = e->slots[i];
+    }
+  }
+
+  free(e->slots);
+  e->slots = slots;
+  e->cap = cap;
+}
+
+void encode_string(struct encoder *e, const char *s, unsigned n) {
+  if (e->strings * 2 >= e->cap)
+    encoder_grow(e);
+
+  uint32_t hash;
+  MurmurHash3_x86_32(s, n, HASH_SEED, &hash);
+
+  unsigned i = hash & (e->cap - 1);
+  for (; e->slots[i].index; i = (i + 1) & (e->cap - 1)) {
+    struct encoder_slot *slot = &e->slots[i];
+    if (slot->hash == hash && slot->len == n &&
+        !memcmp(e->table.data + slot->offset, s, n)) {
+      encode_varint(&e->rows, slot->index - 1);
+      return;
+    }
+  }
+
+  encode_varint(&e->table, n);
+  e->slots[i] = (struct encoder_slot){hash, ++e->strings, e->table.i, n};
+  bytes_append(&e->table, (const uint8_t *)s, n);
+  encode_varint(&e->rows, e->strings - 1);
+}
+
+void encode_finish(struct encoder *e, struct bytes *out) {
+  if (e->count) {
+    encode_varint(out, e->strings);
+    bytes_append(out, e->table.data, e->table.i);
+    bytes_append(out, e->rows.data, e->rows.i);
+  }
+
+  bytes_clear(&e->table, ARRAY_DESTROY_ELEMENTS_ONLY);
+  bytes_clear(&e->rows, ARRAY_DESTROY_ELEMENTS_ONLY);
+  if (e->slots)
+    memset(e->slots, 0, e->cap * sizeof(*e->slots));
+  e->strings = e->count = e->row = e->col = 0;
+}
+
+void encoder_clear(struct encoder *e) {
+  bytes_clear(&e->table, ARRAY_DESTROY_ALL);
+  bytes_clear(&e->rows, ARRAY_DESTROY_ALL);
+  free(e->slots);
+  *e = (struct encoder){};
+}
+
+TEST(encode_varint, {
+  struct bytes b = {};
+  encode_varint(&b, 0);
+  encode_varint(&b, 127);
+  encode_varint(&b, 300);
+  ASSERT(b.i == 4);
+  ASSERT(b.data[0] == 0 && b.data[1] == 127);
+  ASSERT(b.data[2] == 0xAC && b.data[3] == 0x02);
+  bytes_clear(&b, ARRAY_DESTROY_ALL);
+})
+
+TEST(encode_finish, {
+  struct encoder e = {};
+  struct bytes b = {};
+
+  encode_finish(&e, &b);
+  ASSERT(b.i == 0, "Blocks without rows should be empty");
+
+  encode_range(&e, 3, 5, 3, 8);
+  encode_string(&e, "kind", 4);
+  encode_range(&e, 3, 9, 4, 1);
+  encode_string(&e, "kind", 4);
+  encode_finish(&e, &b);
+
+  const uint8_t block[] = {
+      1, 4, 'k', 'i', 'n', 'd', // the table
+      6, 10, 0, 6, 0,           // (3,5)-(3,8) kind
+      0, 8, 2, 2, 0,            // (3,9)-(4,1) kind
+  };
+  ASSERT(b.i == sizeof(block));
+  ASSERT(!memcmp(b.data, block, sizeof(block)));
+
+  bytes_clear(&b, ARRAY_DESTROY_ELEMENTS_ONLY);
+  encode_range(&e, 1, 1, 1, 1);
+  encode_string(&e, "other", 5);
+  encode_finish(&e, &b);
+  ASSERT(b.i == 12 && b.data[0] == 1 && b.data[1] == 5);
+
+  bytes_clear(&b, ARRAY_DESTROY_ALL);
+  encoder_clear(&e);
+})
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "array.h"
+
+#include <stdint.h>
+
+DECL_ARRAY(bytes, uint8_t);
+static inline IMPL_ARRAY_PUSH(bytes, uint8_t);
+static inline IMPL_ARRAY_APPEND(bytes, uint8_t);
+static inline IMPL_ARRAY_CLEAR(bytes, NULL);
+
+struct encoder_slot {
+  uint32_t hash;
+  unsigned index; // the index of the string plus 1, 0 for empty slots
+  unsigned offset;
+  unsigned len;
+};
+
+// Encodes rows of ranges into a block, which is laid out as
+//
+//   block := count string{count} row*
+//   string := len byte{len}
+//
+// where count and len are varints. A range is given by 4 zigzag varints, i.e.
+// the begin row from that of the last range, the begin column from that of the
+// last range on the same row, the end row from the begin row, and the end
+// column from the begin column on the same row. Other fields of a row follow
+// as varints, strings are given by indices into the table of the block.
+//
+// Tables are per block rather than per source. Only semantics have strings,
+// links are given by the hashes of sources, and each block of a source is
+// rendered, cached and decoded on its own.
+//
+// A block without rows is empty.
+struct encoder {
+  struct bytes table; // the strings following the count
+  struct bytes rows;
+  unsigned strings; // the number of strings in the table
+  unsigned count;   // the number of ranges in rows
+  unsigned cap;     // the number of slots, always a power of 2 if any
+  struct encoder_slot *slots;
+  unsigned row, col; // the beginning of the last range
+};
+
+void encode_varint(struct bytes *b, uint64_t v);
+
+void encode_range(struct encoder *e, unsigned begin_row, unsigned begin_col,
+                  unsigned end_row, unsigned end_col);
+
+static inline void encode_uint(struct encoder *e, uint64_t v) {
+  encode_varint(&e->rows, v);
+}
+
+void encode_string(struct encoder *e, const char *s, unsigned n);
+
+// Appends the block to the output and resets the encoder for the next one.
+void encode_finish(struct encoder *e, struct bytes *out);
+
+void encoder_clear(struct encoder *e);
@@ -33,9 +33,12 @@ ES(UNKNOWN_OUTPUT)
 ES(FILE, 0x0100U, OPEN, CLOSE, READ, WRITE, RENAME, UNLINK)
 ES(REMARK, 0x0200U, NO_CLANG)
 ES(PARSE, 0x0300U, INIT, HALT)
-ES(STORE, 0x0400U, OPEN, CLOSE)
+ES(STORE, 0x0400U, OPEN, CLOSE, LINK, HISTORY)
 ES(RENDER, 0x0500U)
-ES(QUERY, 0x0600U, TU, STRINGS, SEMANTICS, LINK, LINT)
+ES(QUERY, 0x0600U, TU, STRINGS, SEMANTICS, LINK, LINT, DIGESTS)
+ES(POOL, 0x0700U)
+ES(GZIP, 0x0800U)
+ES(COMPDB, 0x0900U, SYNTAX)
 
 #undef ES
 
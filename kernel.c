@@ -0,0 +1,143 @@
+#include "kernel.h"
+#include "test.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define USE_X86_KERNEL
+#endif
+
+static size_t scan_any_scalar(const char *s, size_t n, const char *set,
+                              unsigned m) {
+  for (size_t i = 0; i < n; ++i)
+    for (unsigned k = 0; k < m; ++k)
+      if (s[i] == set[k])
+        return i;
+  return n;
+}
+
+#ifdef USE_X86_KERNEL
+
+__attribute__((target("sse2"))) static size_t
+scan_any_sse2(const char *s, size_t n, const char *set, unsigned m) {
+  __m128i v[SCAN_SET_MAX];
+  for (unsigned k = 0; k < m; ++k)
+    v[k] = _mm_set1_epi8(set[k]);
+
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i eq = _mm_cmpeq_epi8(x, v[0]);
+    for (unsigned k = 1; k < m; ++k)
+      eq = _mm_or_si128(eq, _mm_cmpeq_epi8(x, v[k]));
+
+    unsigned mask = _mm_movemask_epi8(eq);
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+
+  return i + scan_any_scalar(s + i, n - i, set, m);
+}
+
+__attribute__((target("avx2"))) static size_t
+scan_any_avx2(const char *s, size_t n, const char *set, unsigned m) {
+  __m256i v[SCAN_SET_MAX];
+  for (unsigned k = 0; k < m; ++k)
+    v[k] = _mm256_set1_epi8(set[k]);
+
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(s + i));
+    __m256i eq = _mm256_cmpeq_epi8(x, v[0]);
+    for (unsigned k = 1; k < m; ++k)
+      eq = _mm256_or_si256(eq, _mm256_cmpeq_epi8(x, v[k]));
+
+    unsigned mask = _mm256_movemask_epi8(eq);
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+
+  return i + scan_any_sse2(s + i, n - i, set, m);
+}
+
+#endif // USE_X86_KERNEL
+
+size_t scan_any(const char *s, size_t n, const char *set) {
+  unsigned m = strlen(set);
+  assert(m && m <= SCAN_SET_MAX);
+
+#ifdef USE_X86_KERNEL
+  // Short inputs are not worth the setup of vectors
+  if (n >= 32 && __builtin_cpu_supports("avx2"))
+    return scan_any_avx2(s, n, set, m);
+  if (n >= 16 && __builtin_cpu_supports("sse2"))
+    return scan_any_sse2(s, n, set, m);
+#endif // USE_X86_KERNEL
+
+  return scan_any_scalar(s, n, set, m);
+}
+
+TEST(scan_any, {
+  char s[200];
+  memset(s, 'a', sizeof(s));
+
+  // Hits at every position, and at any lane of vectors
+  for (size_t i = 0; i < sizeof(s); ++i) {
+    s[i] = '\'';
+    ASSERT(scan_any(s, sizeof(s), "'\\") == i);
+    ASSERT(scan_any(s, i, "'\\") == i, "Should not scan over n");
+    s[i] = '\\';
+    ASSERT(scan_any(s, sizeof(s), "'\\") == i);
+    s[i] = 'a';
+  }
+
+  ASSERT(scan_any(s, sizeof(s), "\n") == sizeof(s));
+  ASSERT(scan_any(s, 0, "\n") == 0);
+  ASSERT(scan_any(s, sizeof(s), "<!/a") == 0);
+
+  ASSERT(scan_line("ab\ncd", 5) == 3);
+  ASSERT(scan_line("abcd", 4) == 4);
+
+  // Benchmarks by `-Tbench_scan_any -tscan_any`, see `make bench`
+  TOGGLE(bench_scan_any, {
+    const size_t n = 1 << 28;
+    char *buf = malloc(n);
+    assert(buf);
+    for (size_t i = 0; i < n; ++i)
+      buf[i] = ' ' + rand() % ('~' - ' ' - 2); // no '}' or '~'
+
+    typedef size_t (*scan_t)(const char *, size_t, const char *, unsigned);
+    struct {
+      const char *name;
+      scan_t scan;
+    } kernels[] = {
+        {"scalar", scan_any_scalar},
+#ifdef USE_X86_KERNEL
+        {"sse2", scan_any_sse2},
+        {"avx2", scan_any_avx2},
+#endif // USE_X86_KERNEL
+    };
+
+    for (unsigned k = 0; k < sizeof(kernels) / sizeof(*kernels); ++k) {
+      for (unsigned m = 1; m <= 4; m *= 2) {
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        size_t i = kernels[k].scan(buf, n, "}~}~", m);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        double sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        fprintf(stderr, "\n%8s scanning for %u byte(s): %6.2f GB/s",
+                kernels[k].name, m, i / sec / 1e9);
+      }
+    }
+
+    fputc('\n', stderr);
+    free(buf);
+  });
+})
@@ -0,0 +1,32 @@
+#pragma once
+
+#ifdef __cplusplus
+
+#include <cstddef>
+using std::size_t;
+
+extern "C" {
+#else
+#include <stddef.h>
+#endif
+
+// The maximum number of bytes in a set to scan for.
+#define SCAN_SET_MAX 8
+
+// Returns the offset of the first byte in [s, s + n) which is in the set, or n
+// if there's none. The set is a string of at most SCAN_SET_MAX bytes, so the
+// zero byte can't be in it.
+//
+// Vector instructions are used if available, i.e. AVX2 or SSE2 on x86.
+size_t scan_any(const char *s, size_t n, const char *set);
+
+// Returns the length of the first line including '\n', or n if there's no
+// complete line.
+static inline size_t scan_line(const char *s, size_t n) {
+  size_t i = scan_any(s, n, "\n");
+  return i < n ? i + 1 : n;
+}
+
+#ifdef __cplusplus
+}
+#endif
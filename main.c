@@ -1,24 +1,34 @@
 #include "build.h"
+#include "compdb.h"
 #include "parse.h"
+#include "pool.h"
 #include "test.h"
 #include "util.h"
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+// The most C inputs remarked at once, as each holds a whole AST in memory.
+#define MAX_JOBS 256U
+
 int main(int argc, char **argv) {
   int debug_flag = 0;       // the option of -d
   int silent_flag = 0;      // the option of -s
   int c_flag = 0;           // the option of -c
+  int gzip_flag = 0;        // the option of -z
+  unsigned jobs = 1;        // the option of -j
   int input_kind = IK_TEXT; // the default input file kind
   int output_kind = OK_NIL; // the default output file kind
 
   char *output_file = NULL;
+  char *cache_dir = NULL;
   char *tu_name = NULL;
+  char *scope = NULL;
 
   int c;
-  while ((c = getopt(argc, argv, "ht::T::dsCcx::i:o:")) != -1)
+  while ((c = getopt(argc, argv, "ht::T::dsCczx::i:o:k:j:p:r:")) != -1)
     switch (c) {
     case 'h':
       printf("Usage: %s [OPTION]... [-- [CLANG OPTION]...] [FILE]\n", argv[0]);
@@ -31,11 +41,20 @@ int main(int argc, char **argv) {
       printf("  -s         parse silently\n");
       printf("  -C         treat the default input file as C code\n");
       printf("  -c         the alias of -xs if no -xt given\n");
+      printf("  -z         compress the HTML output by gzip\n");
       printf("  -x         the alias of -xt\n");
       printf("  -xd        dump AST as data (SQLite3)\n");
       printf("  -xt        dump AST as text\n");
+      printf("  -xw        render AST as a site (directory)\n");
       printf("  -i NAME    set the TU name\n");
       printf("  -o OUTPUT  specify the output file\n");
+      printf("  -k DIR     cache fragments of the HTML in the directory\n");
+      printf("  -j N       remark N C inputs at once (up to %u), 0 for all "
+             "processors\n",
+             MAX_JOBS);
+      printf("  -p FILE    add C inputs of the compilation database\n");
+      printf("  -r SCOPE   remark main files and sources under DIR[:DIR]...\n");
+      printf("             or main files only by main, all by default\n");
       return 0;
     case 't':
       return optarg && strcmp(optarg, "help") == 0 ? test_help()
@@ -58,6 +77,9 @@ int main(int argc, char **argv) {
     case 'c':
       c_flag = 1;
       break;
+    case 'z':
+      gzip_flag = 1;
+      break;
     case 'x':
       if (!optarg)
         output_kind = OK_TEXT;
@@ -65,6 +87,8 @@ int main(int argc, char **argv) {
         output_kind = OK_TEXT;
       else if (strcmp(optarg, "d") == 0)
         output_kind = OK_DATA;
+      else if (strcmp(optarg, "w") == 0)
+        output_kind = OK_SITE;
       else
         return fprintf(stderr, "invalid output format: %s\n", optarg);
       break;
@@ -74,6 +98,27 @@ int main(int argc, char **argv) {
     case 'o':
       output_file = strcmp(optarg, "-") ? optarg : "/dev/stdout";
       break;
+    case 'k':
+      cache_dir = optarg;
+      break;
+    case 'j': {
+      char *end;
+      errno = 0;
+      unsigned long n = strtoul(optarg, &end, 10);
+      if (*optarg < '0' || *optarg > '9' || *end || errno)
+        return fprintf(stderr, "invalid number of jobs: %s\n", optarg);
+      jobs = !n ? pool_size() : n < MAX_JOBS ? n : MAX_JOBS;
+      break;
+    }
+    case 'p':
+      if (compdb_load(optarg).es)
+        exit(1);
+      break;
+    case 'r':
+      scope = strcmp(optarg, "all") == 0    ? NULL
+              : strcmp(optarg, "main") == 0 ? ""
+                                            : optarg;
+      break;
     default:
       exit(1);
     }
@@ -126,6 +171,10 @@ int main(int argc, char **argv) {
       output_kind = OK_HTML;
   }
 
+  // Only HTML is compressed, either a page or a site
+  if (gzip_flag && output_kind != OK_HTML && output_kind != OK_SITE)
+    return fprintf(stderr, "-z is only for HTML outputs\n");
+
   // Setup the default output file
   if (!output_file) {
     switch (output_kind) {
@@ -133,7 +182,10 @@ int main(int argc, char **argv) {
       output_file = "a.sqlite";
       break;
     case OK_HTML:
-      output_file = "a.html";
+      output_file = gzip_flag ? "a.html.gz" : "a.html";
+      break;
+    case OK_SITE:
+      output_file = "a.site";
       break;
     case OK_TEXT:
       output_file = "a.txt";
@@ -146,13 +198,18 @@ int main(int argc, char **argv) {
   struct error err = build_output((struct output){
       output_kind,
       output_file,
+      cache_dir,
+      jobs,
+      scope,
       silent_flag,
+      .gzip = gzip_flag,
   });
 
   if (!err.es && output_file)
     fprintf(stderr, "Wrote file: %s\n", output_file);
 
   clear_input();
+  compdb_free();
 
   fprintf(stderr, "Status: %s\n", get_error_name(err));
   return !!err.es;
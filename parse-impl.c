@@ -1,20 +1,27 @@
+#include "remark.h"
 #include "scan.h"
 #include "test.h"
 
-static String *last_loc_src;
-static unsigned last_loc_line;
+// The state of parsing is per thread, so TUs could be parsed at once
+static thread_local yyscan_t scanner;
+static thread_local String *last_loc_src;
+static thread_local unsigned last_loc_line;
 
-long ts;
-char tu[PATH_MAX];
-char cwd[PATH_MAX];
+thread_local long ts;
+thread_local char tu[PATH_MAX];
+thread_local char cwd[PATH_MAX];
 
-NodeList all_nodes;
-StringSet all_strings;
-SemanticsList all_semantics;
+thread_local NodeList all_nodes;
+thread_local StringSet all_strings;
+thread_local SemanticsList all_semantics;
+thread_local LentHeaderList all_lent_headers;
 
 static inline IMPL_ARRAY_CLEAR(NodeList, NULL);
 static inline IMPL_ARRAY_CLEAR(SemanticsList, NULL);
 
+static void destroy_lent_header(void *p) { free(((LentHeader *)p)->lender); }
+static inline IMPL_ARRAY_CLEAR(LentHeaderList, destroy_lent_header);
+
 String *add_string(struct string s) {
   String x = {string_hash(&s), 0, s};
 
@@ -31,8 +38,335 @@ String *add_string(struct string s) {
   return y;
 }
 
+static void add_src_property(String *src) {
+  const char *s = string_get(&src->elem);
+  if (strcmp(s, "<scratch space>") == 0 || strcmp(s, "<command line>") == 0 ||
+      strcmp(s, "<built-in>") == 0)
+    add_string_property(src, SP_BUILTIN);
+
+  add_string_property(src, SP_FILE);
+}
+
+static void set_tu(String *s) {
+  assert(string_len(&s->elem) < PATH_MAX);
+  strcpy(tu, string_get(&s->elem));
+  add_string_property(s, SP_TU);
+}
+
+static String *add_cstring(const char *s) {
+  return add_string(string_static(s, strlen(s)));
+}
+
+Loc parse_loc(const char *src, unsigned line, unsigned col) {
+  if (!src)
+    return (Loc){};
+
+  String *s = add_cstring(src);
+  add_src_property(s);
+  return (Loc){s, line, col};
+}
+
+void parse_meta(const char *file, long time, const char *dir) {
+  assert(strlen(dir) < PATH_MAX);
+  set_tu(add_cstring(file));
+  strcpy(cwd, dir);
+  ts = time;
+}
+
+void parse_semantics(const char *kind, const char *name, Range range) {
+  String *k = add_cstring(kind);
+  String *n = add_cstring(name);
+  add_string_property(k, SP_IDENTIFIER);
+  add_string_property(n, SP_IDENTIFIER);
+  SemanticsList_push(&all_semantics, (Semantics){k, n, range});
+}
+
+void parse_lent_header(const char *file, const char *lender) {
+  char *s = strdup(lender);
+  assert(s);
+  LentHeaderList_push(&all_lent_headers,
+                      (LentHeader){parse_loc(file, 0, 0).file, s});
+}
+
+// The kinds of nodes sorted by names, as the scanner tells them by the leading
+// words of lines.
+#define KIND(X, group) {#X, TOK_##X | (NG_##group << KIND_WIDTH)}
+static const struct node_kind {
+  const char *name;
+  uint32_t node;
+} node_kinds[] = {
+    KIND(AlignedAttr, Attr),
+    KIND(AllocAlignAttr, Attr),
+    KIND(AllocSizeAttr, Attr),
+    KIND(ArraySubscriptExpr, Expr),
+    KIND(AsmLabelAttr, Attr),
+    KIND(BinaryOperator, Operator),
+    KIND(BreakStmt, Stmt),
+    KIND(BuiltinAttr, Attr),
+    KIND(BuiltinType, Type),
+    KIND(CStyleCastExpr, CastExpr),
+    KIND(CallExpr, Expr),
+    KIND(CaseStmt, Stmt),
+    KIND(CharacterLiteral, Literal),
+    KIND(ColdAttr, Attr),
+    KIND(ComplexType, Type),
+    KIND(CompoundAssignOperator, Operator),
+    KIND(CompoundPPStmt, PPStmt),
+    KIND(CompoundStmt, Stmt),
+    KIND(ConditionalOperator, Operator),
+    KIND(ConditionalPPExpr, PPExpr),
+    KIND(ConstAttr, Attr),
+    KIND(ConstantArrayType, Type),
+    KIND(ConstantExpr, Expr),
+    KIND(ContinueStmt, Stmt),
+    KIND(DeclRefExpr, Expr),
+    KIND(DeclStmt, Stmt),
+    KIND(DefaultStmt, Stmt),
+    KIND(DefineDirective, Directive),
+    KIND(DefinedPPOperator, PPOperator),
+    KIND(DeprecatedAttr, Attr),
+    KIND(DoStmt, Stmt),
+    KIND(ElaboratedType, Type),
+    KIND(Enum, Enum),
+    KIND(EnumConstantDecl, Decl),
+    KIND(EnumDecl, Decl),
+    KIND(EnumType, Type),
+    KIND(Field, Field),
+    KIND(FieldDecl, Decl),
+    KIND(ForStmt, Stmt),
+    KIND(FormatAttr, Attr),
+    KIND(FullComment, Comment),
+    KIND(FunctionDecl, Decl),
+    KIND(FunctionProtoType, Type),
+    KIND(GNUInlineAttr, Attr),
+    KIND(GotoStmt, Stmt),
+    KIND(IfDirective, Directive),
+    KIND(IfStmt, Stmt),
+    KIND(ImplicitCastExpr, CastExpr),
+    KIND(InclusionDirective, Directive),
+    KIND(IndirectFieldDecl, Decl),
+    KIND(InitListExpr, Expr),
+    KIND(IntValue, IntValue),
+    KIND(IntegerLiteral, Literal),
+    KIND(LabelStmt, Stmt),
+    KIND(MacroExpansion, Expansion),
+    KIND(MacroPPDecl, PPDecl),
+    KIND(MemberExpr, Expr),
+    KIND(ModeAttr, Attr),
+    KIND(NoThrowAttr, Attr),
+    KIND(NonNullAttr, Attr),
+    KIND(NullStmt, Stmt),
+    KIND(OffsetOfExpr, Expr),
+    KIND(PackedAttr, Attr),
+    KIND(ParagraphComment, Comment),
+    KIND(ParenExpr, Expr),
+    KIND(ParenType, Type),
+    KIND(ParmVarDecl, Decl),
+    KIND(PointerType, Type),
+    KIND(Preprocessor, Preprocessor),
+    KIND(PureAttr, Attr),
+    KIND(QualType, Type),
+    KIND(Record, Record),
+    KIND(RecordDecl, Decl),
+    KIND(RecordType, Type),
+    KIND(RestrictAttr, Attr),
+    KIND(ReturnStmt, Stmt),
+    KIND(ReturnsTwiceAttr, Attr),
+    KIND(StmtExpr, Expr),
+    KIND(StringLiteral, Literal),
+    KIND(SwitchStmt, Stmt),
+    KIND(TextComment, Comment),
+    KIND(Token, Token),
+    KIND(TranslationUnitDecl, Decl),
+    KIND(TransparentUnionAttr, Attr),
+    KIND(Typedef, Typedef),
+    KIND(TypedefDecl, Decl),
+    KIND(TypedefType, Type),
+    KIND(UnaryExprOrTypeTraitExpr, Expr),
+    KIND(UnaryOperator, Operator),
+    KIND(VarDecl, Decl),
+    KIND(WarnUnusedResultAttr, Attr),
+    KIND(WhileStmt, Stmt),
+};
+#undef KIND
+
+static int compare_node_kind(const void *a, const void *b) {
+  return strcmp(a, ((const struct node_kind *)b)->name);
+}
+
+static String *add_name(const char *s, uint8_t property) {
+  if (!s)
+    return NULL;
+
+  String *x = add_cstring(s);
+  add_string_property(x, property);
+  return x;
+}
+
+static Loc parse_remark_loc(struct remark_loc loc) {
+  return parse_loc(loc.file, loc.line, loc.col);
+}
+
+bool parse_node(const struct remark_node *v) {
+  Node node = {};
+  if (v->kind) {
+    const struct node_kind *k =
+        bsearch(v->kind, node_kinds, sizeof(node_kinds) / sizeof(*node_kinds),
+                sizeof(*node_kinds), compare_node_kind);
+    if (!k)
+      return false;
+
+    node.node = k->node;
+  }
+  node.level = v->level;
+
+  uintptr_t pointer = (uintptr_t)v->pointer;
+  uintptr_t prev = (uintptr_t)v->prev;
+  AngledRange range = {parse_remark_loc(v->begin), parse_remark_loc(v->end)};
+  Loc loc = parse_remark_loc(v->loc);
+  String *name = add_name(v->name, SP_IDENTIFIER);
+  BareType type = {add_name(v->type, 0), add_name(v->desugared, 0)};
+
+  // Selves of kinds in a group share the layout, as the grammar sets them.
+  switch (node.group) {
+  case NG_Attr:
+    node.ModeAttr.self = (AttrSelf){.pointer = pointer, .range = range};
+    break;
+  case NG_Comment:
+    node.TextComment.self = (CommentSelf){.pointer = pointer, .range = range};
+    break;
+  case NG_Decl:
+    node.VarDecl.self = (DeclSelf){
+        .pointer = pointer, .prev = prev, .range = range, .loc = loc};
+    break;
+  case NG_Type:
+    add_string_property(type.qualified, SP_TYPE);
+    add_string_property(type.desugared, SP_TYPE);
+    node.BuiltinType.self = (TypeSelf){.pointer = pointer, .type = type};
+    break;
+  case NG_Stmt:
+    node.CompoundStmt.self = (StmtSelf){.pointer = pointer, .range = range};
+    break;
+  case NG_Expr:
+  case NG_Literal:
+  case NG_Operator:
+  case NG_CastExpr:
+    node.ParenExpr.self =
+        (ExprSelf){.pointer = pointer, .range = range, .type = type};
+    break;
+  case NG_Directive:
+    node.DefineDirective.self = (DirectiveSelf){
+        .pointer = pointer, .prev = prev, .range = range, .loc = loc};
+    break;
+  case NG_PPDecl:
+    node.MacroPPDecl.self = (PPDeclSelf){.pointer = pointer, .range = range};
+    break;
+  case NG_PPExpr:
+    node.ConditionalPPExpr.self =
+        (PPExprSelf){.pointer = pointer, .range = range};
+    break;
+  case NG_PPOperator:
+    node.DefinedPPOperator.self =
+        (PPOperatorSelf){.pointer = pointer, .range = range};
+    break;
+  case NG_PPStmt:
+    node.CompoundPPStmt.self = (PPStmtSelf){.pointer = pointer, .range = range};
+    break;
+  case NG_Expansion:
+    node.MacroExpansion.self =
+        (ExpansionSelf){.pointer = pointer, .range = range};
+    break;
+  }
+
+#define NAMED(X)                                                               \
+  case TOK_##X:                                                                \
+    node.X.name = name;                                                        \
+    break
+#define TYPED(X)                                                               \
+  case TOK_##X:                                                                \
+    node.X.name = name;                                                        \
+    node.X.type = type;                                                        \
+    break
+
+  switch (node.kind) {
+  case TOK_IntValue:
+    if (v->text) {
+      char *end;
+      node.IntValue.value.negative = v->text[0] == '-';
+      if (node.IntValue.value.negative)
+        node.IntValue.value.i = strtoll(v->text, &end, 10);
+      else
+        node.IntValue.value.u = strtoul(v->text, &end, 10);
+    }
+    break;
+  case TOK_Enum:
+    node.Enum.pointer = pointer;
+    node.Enum.name = add_name(v->name, 0);
+    break;
+  // The names of declarations referred are told as types by the grammar
+  case TOK_Typedef:
+    node.Typedef.pointer = pointer;
+    node.Typedef.type = (BareType){add_name(v->name, 0)};
+    break;
+  case TOK_Record:
+    node.Record.pointer = pointer;
+    node.Record.type = (BareType){add_name(v->name, 0)};
+    break;
+  case TOK_Field:
+    node.Field.pointer = pointer;
+    node.Field.name = add_name(v->name, 0);
+    node.Field.type = type;
+    break;
+  case TOK_Preprocessor:
+    node.Preprocessor.pointer = pointer;
+    break;
+  case TOK_TextComment:
+    node.TextComment.text = add_name(v->text, 0);
+    break;
+  case TOK_Token:
+    node.Token.loc = loc;
+    node.Token.text = add_name(v->text, 0);
+    break;
+    NAMED(RecordDecl);
+    NAMED(EnumDecl);
+    TYPED(TypedefDecl);
+    TYPED(FieldDecl);
+    TYPED(FunctionDecl);
+    TYPED(ParmVarDecl);
+    TYPED(IndirectFieldDecl);
+    TYPED(EnumConstantDecl);
+    TYPED(VarDecl);
+  case TOK_BuiltinType:
+    add_string_property(type.qualified, SP_BUILTIN);
+    add_string_property(type.desugared, SP_BUILTIN);
+    break;
+  case TOK_InclusionDirective:
+    node.InclusionDirective.opt_angled = v->angled;
+    node.InclusionDirective.name = name;
+    node.InclusionDirective.file = add_name(v->text, 0);
+    node.InclusionDirective.path = add_name(v->path, SP_FILE);
+    break;
+  }
+#undef NAMED
+#undef TYPED
+
+  if (node.kind == TOK_VarDecl)
+    add_string_property(name, SP_VAR);
+
+  NodeList_push(&all_nodes, node);
+  return true;
+}
+
+TEST(node_kinds, {
+  for (unsigned i = 1; i < sizeof(node_kinds) / sizeof(*node_kinds); ++i)
+    ASSERT(strcmp(node_kinds[i - 1].name, node_kinds[i].name) < 0);
+})
+
 struct error parse_init() {
   require(all_strings.n == 0, "Uninitialized");
+  if (yylex_init(&scanner))
+    return (struct error){ES_PARSE_INIT};
+
   const char *string_set_size = getenv("STRING_SET_SIZE");
   int n = string_set_size ? atoi(string_set_size) : 20071;
   TOGGLE(log_string_set_size, fprintf(stderr, "string set size is %d\n", n));
@@ -49,7 +383,13 @@ struct error parse_halt() {
   NodeList_clear(&all_nodes, 1);
   StringSet_clear(&all_strings, 1);
   SemanticsList_clear(&all_semantics, 1);
-  return (struct error){};
+  LentHeaderList_clear(&all_lent_headers, 1);
+  last_loc_src = NULL;
+  last_loc_line = 0;
+
+  int ret = yylex_destroy(scanner);
+  scanner = NULL;
+  return ret ? (struct error){ES_PARSE_HALT} : (struct error){};
 }
 
 struct error parse(YYLTYPE *lloc, const UserContext *uctx) {
@@ -59,7 +399,7 @@ struct error parse(YYLTYPE *lloc, const UserContext *uctx) {
   do {
     YYSTYPE lval;
     YY_DECL;
-    yytoken_kind_t token = yylex(&lval, lloc, uctx);
+    yytoken_kind_t token = yylex(&lval, lloc, uctx, scanner);
     status = yypush_parse(ps, token, &lval, lloc, uctx);
   } while (status == YYPUSH_MORE);
 
@@ -77,13 +417,13 @@ struct error parse_line(char *line, size_t n, size_t cap, YYLTYPE *lloc,
   line[n + 1] = 0;
 
 #ifdef NDEBUG
-  YY_BUFFER_STATE buffer = yy_scan_buffer(line, n + 2);
+  YY_BUFFER_STATE buffer = yy_scan_buffer(line, n + 2, scanner);
 #else
-  YY_BUFFER_STATE buffer = yy_scan_bytes(line, n);
+  YY_BUFFER_STATE buffer = yy_scan_bytes(line, n, scanner);
 #endif // NDEBUG
 
   struct error err = parse_hook(lloc, uctx);
-  yy_delete_buffer(buffer);
+  yy_delete_buffer(buffer, scanner);
 
   return err;
 }
@@ -10,9 +10,9 @@ enum string_property : STRING_PROPERTY_TYPE {
   SP_TU = 1U << 5,
 };
 
-extern long ts;
-extern char tu[PATH_MAX];
-extern char cwd[PATH_MAX];
+extern thread_local long ts;
+extern thread_local char tu[PATH_MAX];
+extern thread_local char cwd[PATH_MAX];
 
 typedef DECL_ARRAY(NodeList, Node) NodeList;
 static inline IMPL_ARRAY_PUSH(NodeList, Node);
@@ -20,13 +20,18 @@ static inline IMPL_ARRAY_PUSH(NodeList, Node);
 typedef DECL_ARRAY(SemanticsList, Semantics) SemanticsList;
 static inline IMPL_ARRAY_PUSH(SemanticsList, Semantics);
 
-extern NodeList all_nodes;
-extern StringSet all_strings;
-extern SemanticsList all_semantics;
+typedef DECL_ARRAY(LentHeaderList, LentHeader) LentHeaderList;
+static inline IMPL_ARRAY_PUSH(LentHeaderList, LentHeader);
 
+extern thread_local NodeList all_nodes;
+extern thread_local StringSet all_strings;
+extern thread_local SemanticsList all_semantics;
+extern thread_local LentHeaderList all_lent_headers;
+
+// The scanner is reentrant, see yyscan_t
 #define YY_DECL                                                                \
   yytoken_kind_t yylex(YYSTYPE *yylval, YYLTYPE *yylloc,                       \
-                       const UserContext *uctx)
+                       const UserContext *uctx, void *yyscanner)
 
 void yyerror(const YYLTYPE *loc, const UserContext *uctx, char const *format,
              ...) __attribute__((__format__(__printf__, 3, 4)));
@@ -38,6 +43,18 @@ static inline void add_string_property(String *s, uint8_t property) {
     s->property |= property;
 }
 
+// Records remarks given as values instead of lines, as the grammar does for
+// the lines of them. Note that locations are given in full, they neither use
+// nor update the last location of lines.
+Loc parse_loc(const char *src, unsigned line, unsigned col);
+void parse_meta(const char *file, long time, const char *dir);
+void parse_semantics(const char *kind, const char *name, Range range);
+void parse_lent_header(const char *file, const char *lender);
+
+// Records a node given as a value, false if the kind is unknown.
+struct remark_node;
+bool parse_node(const struct remark_node *node);
+
 struct error parse_init();
 struct error parse_halt();
 
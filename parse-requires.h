@@ -616,6 +616,12 @@ typedef struct {
   Range range;
 } Semantics;
 
+// A header left out by the TU, as remarked by the lender, i.e. another TU.
+typedef struct {
+  String *src;
+  char *lender;
+} LentHeader;
+
 // Exchanging information with the parser.
 typedef struct {
   // Whether or not to emit error messages.
@@ -1569,14 +1569,7 @@ FileLoc: SRC ':' INTEGER ':' INTEGER
     last_loc_src = $1;
     last_loc_line = $3.u;
     $$ = (Loc){last_loc_src, last_loc_line, $5.u};
-
-    const char *src = string_get(&$1->elem);
-    if (strcmp(src, "<scratch space>") == 0 ||
-        strcmp(src, "<command line>") == 0 ||
-        strcmp(src, "<built-in>") == 0)
-      add_string_property($1, SP_BUILTIN);
-
-    add_string_property($1, SP_FILE);
+    add_src_property($1);
   }
 
 LineLoc: LINE ':' INTEGER ':' INTEGER
@@ -1729,12 +1722,7 @@ Name: NAME
   }
 
 Meta: TS INTEGER  { ts = $2.i; }
- | TU TEXT
-  {
-    assert(string_len(&$2->elem) < PATH_MAX);
-    strcpy(tu, string_get(&$2->elem));
-    add_string_property($2, SP_TU);
-  }
+ | TU TEXT        { set_tu($2); }
  | CWD TEXT
   {
     assert(string_len(&$2->elem) < PATH_MAX);
@@ -0,0 +1,98 @@
+#include "pool.h"
+#include "test.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <threads.h>
+#include <unistd.h>
+
+struct pool {
+  pool_job_t job;
+  void *obj;
+  unsigned n;
+  atomic_uint next;
+  atomic_bool failed;
+};
+
+struct worker {
+  thrd_t thread;
+  struct pool *pool;
+  unsigned id;
+  struct error err;
+};
+
+static int work(void *arg) {
+  struct worker *w = arg;
+  struct pool *p = w->pool;
+
+  unsigned i;
+  while (!atomic_load(&p->failed) && (i = atomic_fetch_add(&p->next, 1)) < p->n)
+    if ((w->err = p->job(i, w->id, p->obj)).es)
+      atomic_store(&p->failed, true);
+
+  return 0;
+}
+
+unsigned pool_size() {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? n : 1;
+}
+
+struct error pool_run(unsigned n, unsigned workers, pool_job_t job, void *obj) {
+  assert(job);
+  if (!n)
+    return (struct error){};
+  if (workers > n)
+    workers = n;
+  if (!workers)
+    workers = 1;
+
+  struct worker *w = calloc(workers, sizeof(*w));
+  assert(w);
+
+  struct pool pool = {job, obj, n};
+  unsigned started = 0;
+  for (unsigned i = 0; i < workers; ++i) {
+    w[i].pool = &pool;
+    w[i].id = i;
+    if (thrd_create(&w[i].thread, work, &w[i]) != thrd_success)
+      break;
+    ++started;
+  }
+
+  struct error err = started ? (struct error){} : (struct error){ES_POOL};
+  for (unsigned i = 0; i < started; ++i) {
+    thrd_join(w[i].thread, NULL);
+    err = next_error(err, w[i].err);
+  }
+
+  free(w);
+  return err;
+}
+
+static struct error sum_job(unsigned job, unsigned worker, void *obj) {
+  atomic_fetch_add((atomic_uint *)obj, job + 1);
+  return (struct error){};
+}
+
+static struct error fail_job(unsigned job, unsigned worker, void *obj) {
+  atomic_fetch_add((atomic_uint *)obj, 1);
+  return job == 3 ? (struct error){ES_POOL, job} : (struct error){};
+}
+
+TEST(pool_run, {
+  atomic_uint sum = 0;
+  ASSERT(!pool_run(100, 4, sum_job, &sum).es);
+  ASSERT(sum == 5050);
+
+  sum = 0;
+  ASSERT(!pool_run(10, 100, sum_job, &sum).es);
+  ASSERT(sum == 55);
+
+  atomic_uint ran = 0;
+  struct error err = pool_run(1000, 1, fail_job, &ran);
+  ASSERT(err.es == ES_POOL && err.ec == 3);
+  ASSERT(ran == 4);
+})
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "error.h"
+
+// The job is given by its index and the index of the worker running it, the
+// latter is handy to address per worker resources without locking.
+typedef struct error (*pool_job_t)(unsigned job, unsigned worker, void *obj);
+
+// Returns the number of online processors, at least 1.
+unsigned pool_size();
+
+// Runs jobs [0, n) on at most the given number of threads, each job is picked
+// by the first idle worker. No more jobs are picked once a job has failed, and
+// the error of the lowest numbered worker is returned.
+//
+// Note that jobs never run on the calling thread, so thread local states, e.g.
+// the store connection, are fresh in each job.
+struct error pool_run(unsigned n, unsigned workers, pool_job_t job, void *obj);
@@ -3,15 +3,16 @@
 import {
   EditorView,
   Decoration,
+  ViewPlugin,
   lineNumbers,
   highlightActiveLineGutter,
   highlightActiveLine,
   hoverTooltip,
 } from "@codemirror/view";
 import {
-  Text,
   EditorState,
   StateField,
+  Compartment,
   RangeSetBuilder,
   RangeValue as BaseRangeValue,
 } from "@codemirror/state";
@@ -32,17 +33,107 @@ import glLightTheme from "golden-layout/dist/css/themes/goldenlayout-light-theme
  *  id: number;
  *  path: string;
  *  container: import("golden-layout").ComponentContainer;
- *  editor: import("@codemirror/view").EditorView;
+ *  editor: import("@codemirror/view").EditorView | null;
+ *  file?: FileData;
+ *  snapshot?: Snapshot;
  * }} EditorComponent
  */
 
+/**
+ * What is left of a hidden editor, to restore it once shown again.
+ * @typedef {{
+ *  scrollTop: number;
+ *  scrollLeft: number;
+ *  selection: import("@codemirror/state").EditorSelection;
+ * }} Snapshot
+ */
+
 /**
  * @typedef {"source"|"link"|"semantics"|"lint"} ScriptType
  */
 
+/**
+ * Rows decoded from a block, see encode.h. Each row is a range given by the
+ * offsets in the source, followed by the same number of fields.
+ * @typedef Block
+ * @type {{
+ *   strings: string[],
+ *   from: Uint32Array,
+ *   to: Uint32Array,
+ *   fields: Uint32Array,
+ * }}
+ */
+
+/**
+ * An encoded block, either bytes or base64 text, and the number of fields.
+ * @typedef EncodedBlock
+ * @type {{
+ *   bytes: Uint8Array | string,
+ *   width: number,
+ * }}
+ */
+
+/**
+ * Blocks are decoded aside, so the source could be shown before them.
+ * @typedef FileData
+ * @type {{
+ *   path: string,
+ *   main?: boolean,
+ *   source: string,
+ *   semantics: Promise<Block>,
+ *   link: Promise<Block>,
+ *   lint: any[],
+ * }}
+ */
+
+/**
+ * Editors are shared by visible panes, hidden panes give theirs back with their
+ * document and decorations. At most the given number of idle editors are kept,
+ * the others are destroyed.
+ */
+class EditorPool {
+  /** @type {EditorView[]} */
+  #idle = [];
+  #size;
+
+  /**
+   *
+   * @param {number} size
+   */
+  constructor(size) {
+    this.#size = size;
+  }
+
+  /**
+   *
+   * @param {HTMLElement} parent
+   * @returns {EditorView}
+   */
+  acquire(parent) {
+    const editor = this.#idle.pop();
+    if (!editor) return new EditorView({ parent });
+
+    parent.appendChild(editor.dom);
+    return editor;
+  }
+
+  /**
+   *
+   * @param {EditorView} editor
+   */
+  release(editor) {
+    if (this.#idle.length >= this.#size) return editor.destroy();
+
+    editor.setState(EditorState.create());
+    editor.dom.remove();
+    this.#idle.push(editor);
+  }
+}
+
 export class ReaderView {
   /** @type {Map<import("golden-layout").ComponentContainer, EditorComponent>} */
   #map = new Map();
+  #pool = new EditorPool(4);
   #rect = new DOMRect();
 
   /** @type {HTMLElement} */
@@ -142,6 +233,8 @@ export class ReaderView {
   /** @type {import("golden-layout").VirtualLayout.UnbindComponentEventHandler} */
   #unbind = (container) => {
     const component = this.#getComponent(container);
+    // Decoded data are released with the last editor holding the file
+    this.#hide(component);
     this.#root.removeChild(component.rootHtmlElement);
     this.#map.delete(container);
   };
@@ -158,10 +251,95 @@ export class ReaderView {
 
   /** @type {import("golden-layout").ComponentContainer.VirtualVisibilityChangeRequiredEvent} */
   #visibilityChange = (container, visible) => {
-    const parent = this.#getComponent(container).rootHtmlElement;
-    parent.style.display = visible ? "" : "none";
+    const component = this.#getComponent(container);
+    component.rootHtmlElement.style.display = visible ? "" : "none";
+    if (visible) this.#show(component);
+    else this.#hide(component);
   };
 
+  /**
+   * Gives an editor to the component, restored from its snapshot if any. The
+   * file is acquired again if dropped once hidden.
+   * @param {EditorComponent} component
+   */
+  #show(component) {
+    const { file, snapshot } = component;
+    if (component.editor) return;
+    if (!file) return this.#acquire(component);
+
+    const editor = this.#pool.acquire(component.rootHtmlElement);
+    component.editor = editor;
+    editor.setState(createState(file, snapshot?.selection));
+    if (snapshot)
+      requestAnimationFrame(() => {
+        if (component.editor !== editor) return;
+        editor.scrollDOM.scrollTop = snapshot.scrollTop;
+        editor.scrollDOM.scrollLeft = snapshot.scrollLeft;
+      });
+
+    // Blocks are decoded once per file, so they are at hand when shown again
+    Promise.all([file.semantics, file.link]).then(([s, l]) => {
+      if (component.editor !== editor) return;
+      editor.dispatch({
+        effects: decoded.reconfigure([semantics(s), link(l)]),
+      });
+    });
+  }
+
+  /**
+   * Takes a snapshot of the editor of the component and releases it, then drops
+   * the file, which is released with the last component holding it.
+   * @param {EditorComponent} component
+   */
+  #hide(component) {
+    const { editor } = component;
+    if (editor) {
+      component.snapshot = {
+        scrollTop: editor.scrollDOM.scrollTop,
+        scrollLeft: editor.scrollDOM.scrollLeft,
+        selection: editor.state.selection,
+      };
+      component.editor = null;
+      this.#pool.release(editor);
+    }
+
+    if (!component.file) return;
+    component.file = undefined;
+    this.#release(component.id);
+  }
+
+  /**
+   * Releases the file unless held by any component.
+   * @param {number} id
+   */
+  #release(id) {
+    if (![...this.#map.values()].some((c) => c.id === id && c.file))
+      releaseFile(id);
+  }
+
+  /**
+   * Loads the file of the component, by scripts of the page, which are decoded
+   * or loaded from the cache, or fetched for a site, then shows it if visible.
+   * @param {EditorComponent} component
+   */
+  #acquire(component) {
+    const { container } = component;
+    loadFile(component.id).then(
+      (file) => {
+        if (!this.#map.has(container)) return;
+        component.path = file.path;
+        container.setTitle(file.path);
+
+        // Hidden ones hold no file, see #hide()
+        if (component.file) return;
+        if (!container.visible) return this.#release(component.id);
+        component.file = file;
+        this.#show(component);
+      },
+      (e) => console.error(e)
+    );
+  }
+
   /** @type {import("golden-layout").ComponentContainer.VirtualZIndexChangeRequiredEvent} */
   #zIndexChange = (container, logicalZIndex, defaultZIndex) => {
     const parent = this.#getComponent(container).rootHtmlElement;
@@ -183,15 +361,24 @@ export class ReaderView {
       throw new Error("Invalid component state");
 
     const id = getId(componentState);
-    const node = getScript(id, "source");
+    const path = findScript(id, "source")?.dataset.path || `${id}`;
 
-    const path = node.dataset.path;
-    if (!path) throw new Error(`Missing source path for id(${id})`);
+    // Editors come and go with the visibility, events bubble up to the pane
+    parent.addEventListener("OpenFile", this.#onOpenFile(componentType));
+
+    /** @type {EditorComponent} */
+    const component = {
+      container,
+      id,
+      path,
+      editor: null,
+      rootHtmlElement: parent,
+    };
 
-    const editor = createEditor({ parent, id, lines: node.data });
-    editor.dom.addEventListener("OpenFile", this.#onOpenFile(componentType));
+    // The file is given by scripts of the page, or fetched on demand for a site
+    this.#acquire(component);
 
-    return { container, id, path, editor, rootHtmlElement: parent };
+    return component;
   }
 
   /**
@@ -264,38 +451,511 @@ function createStyle(x) {
  * @param {any} detail
  */
 function dispatchOpenFileEvent(element, detail) {
-  element.dispatchEvent(new CustomEvent("OpenFile", { detail }));
+  element.dispatchEvent(new CustomEvent("OpenFile", { detail, bubbles: true }));
 }
 
-/**
- * @typedef EditorConfig
- * @type {{
- *   id: number,
- *   parent: Element | DocumentFragment,
- *   lines: string[],
- * }}
- */
+// Extensions of decoded blocks, which are added once decoded.
+const decoded = new Compartment();
 
 /**
  *
- * @param {EditorConfig} config
+ * @param {FileData} file
+ * @param {import("@codemirror/state").EditorSelection} [selection]
  */
-function createEditor({ id, parent, lines }) {
-  return new EditorView({
-    parent,
-    doc: Text.of(lines),
+function createState(file, selection) {
+  return EditorState.create({
+    doc: file.source,
+    selection,
     extensions: [
       EditorState.readOnly.of(true),
       lineNumbers(),
       highlightActiveLineGutter(),
       highlightActiveLine(),
-      semantics(getData(id, "semantics")),
-      link(getData(id, "link")),
-      lint(getData(id, "lint")),
+      decoded.of([]),
+      lint(file.lint),
     ],
   });
 }
 
+/**
+ * Files loaded by editors, which are decoded once for all editors of them.
+ * @type {Map<number, Promise<FileData>>}
+ */
+const files = new Map();
+
+/**
+ *
+ * @param {number} id
+ */
+function releaseFile(id) {
+  files.delete(id);
+}
+
+/**
+ * Load the file from scripts of the page if any, otherwise fetch the data file
+ * rendered aside the page, i.e. the site.
+ * @param {number} id
+ * @returns {Promise<FileData>}
+ */
+function loadFile(id) {
+  let file = files.get(id);
+  if (!file) {
+    file =
+      findScript(id, "source")?.type === "text/plain"
+        ? Promise.resolve(getInlineFile(id))
+        : fetchFile(id);
+
+    // Allow retrying if failed
+    file.catch(() => files.delete(id));
+    files.set(id, file);
+  }
+  return file;
+}
+
+/**
+ *
+ * @param {number} id
+ * @returns {FileData}
+ */
+function getInlineFile(id) {
+  const node = getScript(id, "source");
+
+  const path = node.dataset.path;
+  if (!path) throw new Error(`Missing source path for id(${id})`);
+
+  // See dump_text() for the escapes
+  const source = node.text.replace(/<\\([/!\\])/g, "<$1");
+  const [semantics, link] = decode(id, source, [
+    { bytes: getScript(id, "semantics").text, width: 2 },
+    { bytes: getScript(id, "link").text, width: 1 },
+  ]);
+
+  return { path, source, semantics, link, lint: getData(id, "lint") };
+}
+
+/**
+ *
+ * @param {number} id
+ * @returns {Promise<FileData>}
+ */
+async function fetchFile(id) {
+  // See render_index() for the encoding of shards
+  const encoding = document.querySelector("meta[name='shard-encoding']");
+  const gzip = encoding?.getAttribute("content") === "gzip";
+  let response = await fetch(gzip ? `${id}.bin.gz` : `${id}.bin`);
+  if (!response.ok)
+    throw new Error(`Failed to fetch id(${id}): ${response.status}`);
+
+  // Compressed shards are inflated here unless served with the encoding
+  if (gzip && response.headers.get("Content-Encoding") !== "gzip")
+    response = new Response(
+      response.body.pipeThrough(new DecompressionStream("gzip")),
+    );
+
+  // See render_shard() for the layout
+  const reader = new ByteReader(new Uint8Array(await response.arrayBuffer()));
+  const decoder = new TextDecoder();
+  const path = decoder.decode(reader.bytes());
+  const main = !!(reader.varint() & 1);
+  const source = decoder.decode(reader.bytes());
+  const [semantics, link] = decode(id, source, [
+    { bytes: reader.bytes(), width: 2 },
+    { bytes: reader.bytes(), width: 1 },
+  ]);
+  reader.bytes(); // no lint yet
+
+  return { path, main, source, semantics, link, lint: [] };
+}
+
+class ByteReader {
+  #bytes;
+  #i = 0;
+
+  /**
+   *
+   * @param {Uint8Array} bytes
+   */
+  constructor(bytes) {
+    this.#bytes = bytes;
+  }
+
+  get done() {
+    return this.#i >= this.#bytes.length;
+  }
+
+  varint() {
+    let value = 0;
+    let scale = 1;
+    let byte;
+    do {
+      byte = this.#bytes[this.#i++];
+      value += (byte & 0x7f) * scale;
+      scale *= 0x80;
+    } while (byte & 0x80);
+    return value;
+  }
+
+  zigzag() {
+    const value = this.varint();
+    return value % 2 ? -(value + 1) / 2 : value / 2;
+  }
+
+  bytes(n = this.varint()) {
+    return this.#bytes.subarray(this.#i, (this.#i += n));
+  }
+
+  /**
+   * Count varints till the end by bytes without the continuation bit.
+   */
+  count() {
+    let n = 0;
+    for (let i = this.#i; i < this.#bytes.length; ++i)
+      n += (this.#bytes[i] >> 7) ^ 1;
+    return n;
+  }
+}
+
+/**
+ * Decode rows of the given number of fields, see encode.h.
+ * @param {Uint8Array} bytes
+ * @param {number} width
+ * @returns {{strings: string[], ranges: Uint32Array, fields: Uint32Array}}
+ */
+function decodeBlock(bytes, width) {
+  const reader = new ByteReader(bytes);
+  const decoder = new TextDecoder();
+
+  /** @type {string[]} */
+  const strings = [];
+  if (!reader.done)
+    for (let n = reader.varint(); n > 0; --n)
+      strings.push(decoder.decode(reader.bytes()));
+
+  const n = reader.count() / (4 + width);
+  const ranges = new Uint32Array(n * 4);
+  const fields = new Uint32Array(n * width);
+
+  for (let i = 0, row = 0, col = 0; i < n; ++i) {
+    const rowDelta = reader.zigzag();
+    const beginRow = row + rowDelta;
+    const beginCol = reader.zigzag() + (rowDelta ? 0 : col);
+    const endRow = beginRow + reader.zigzag();
+    const endCol = reader.zigzag() + (endRow === beginRow ? beginCol : 0);
+    ranges.set([beginRow, beginCol, endRow, endCol], i * 4);
+    for (let j = 0; j < width; ++j) fields[i * width + j] = reader.varint();
+
+    row = beginRow;
+    col = beginCol;
+  }
+
+  return { strings, ranges, fields };
+}
+
+/**
+ * Find offsets of lines in the text, which are positions of CodeMirror, i.e.
+ * any line break is counted as 1.
+ * @param {string} text
+ * @returns {Uint32Array}
+ */
+function getLineStarts(text) {
+  const starts = [0];
+  let skipped = 0; // the number of \r in \r\n so far
+  for (let i = 0; i < text.length; ++i) {
+    const c = text.charCodeAt(i);
+    if (c === 13 && text.charCodeAt(i + 1) === 10) ++skipped;
+    else if (c === 10 || c === 13) starts.push(i + 1 - skipped);
+  }
+  return Uint32Array.from(starts);
+}
+
+/**
+ * Decode blocks of the source, and translate 1-based rows and columns of
+ * ranges to offsets.
+ * @param {string} source
+ * @param {EncodedBlock[]} blocks
+ * @returns {Block[]}
+ */
+function decodeBlocks(source, blocks) {
+  const lines = getLineStarts(source);
+  return blocks.map(({ bytes, width }) => {
+    if (typeof bytes === "string")
+      bytes = Uint8Array.from(atob(bytes), (c) => c.charCodeAt(0));
+
+    const { strings, ranges, fields } = decodeBlock(bytes, width);
+    const n = ranges.length / 4;
+    const from = new Uint32Array(n);
+    const to = new Uint32Array(n);
+    for (let i = 0; i < n; ++i) {
+      from[i] = lines[ranges[i * 4] - 1] + ranges[i * 4 + 1] - 1;
+      to[i] = lines[ranges[i * 4 + 2] - 1] + ranges[i * 4 + 3] - 1;
+    }
+    return { strings, from, to, fields };
+  });
+}
+
+/**
+ * The message handler of the decoder.
+ * @param {MessageEvent} ev
+ */
+function onDecode({ data: { id, source, blocks } }) {
+  try {
+    const decoded = decodeBlocks(source, blocks);
+    const buffers = decoded.flatMap((b) => [
+      b.from.buffer,
+      b.to.buffer,
+      b.fields.buffer,
+    ]);
+    postMessage({ id, blocks: decoded }, { transfer: buffers });
+  } catch (e) {
+    postMessage({ id, error: String(e) });
+  }
+}
+
+/** @type {Worker | null | undefined} */
+let decoder;
+
+/**
+ * Decodings in progress, which are retried in place if the decoder fails.
+ * @type {Map<number, {
+ *   source: string,
+ *   blocks: EncodedBlock[],
+ *   resolve: (blocks: Block[]) => void,
+ *   reject: (e: Error) => void,
+ * }>}
+ */
+const decodings = new Map();
+let nextDecoding = 0;
+
+/**
+ * The decoder is a worker made of the functions above, it's null if workers
+ * are not allowed, e.g. by the CSP, then blocks are decoded in place.
+ * @returns {Worker | null}
+ */
+function getDecoder() {
+  if (decoder !== undefined) return decoder;
+
+  const script = [
+    ByteReader,
+    decodeBlock,
+    getLineStarts,
+    decodeBlocks,
+    onDecode,
+    "onmessage = onDecode;",
+  ].join("\n");
+
+  try {
+    const url = URL.createObjectURL(
+      new Blob([script], { type: "text/javascript" })
+    );
+    decoder = new Worker(url);
+    URL.revokeObjectURL(url);
+  } catch (e) {
+    return (decoder = null);
+  }
+
+  decoder.onmessage = ({ data: { id, blocks, error } }) => {
+    const decoding = decodings.get(id);
+    decodings.delete(id);
+    if (error) decoding?.reject(new Error(error));
+    else decoding?.resolve(blocks);
+  };
+  decoder.onerror = (ev) => {
+    // Blocks are decoded in place since then
+    ev.preventDefault();
+    decoder?.terminate();
+    decoder = null;
+    for (const { source, blocks, resolve, reject } of decodings.values()) {
+      try {
+        resolve(decodeBlocks(source, blocks));
+      } catch (e) {
+        reject(e);
+      }
+    }
+    decodings.clear();
+  };
+  return decoder;
+}
+
+/**
+ * Decode blocks of the source by the decoder.
+ * @param {string} source
+ * @param {EncodedBlock[]} blocks
+ * @returns {Promise<Block[]>}
+ */
+function decodeAside(source, blocks) {
+  const worker = getDecoder();
+
+  /** @type {Promise<Block[]>} */
+  let decoded;
+  if (!worker) {
+    decoded = Promise.resolve().then(() => decodeBlocks(source, blocks));
+  } else {
+    // Bytes are copied out of shared buffers, so could be transferred
+    const copies = blocks.map(({ bytes, width }) => ({
+      bytes: typeof bytes === "string" ? bytes : bytes.slice(),
+      width,
+    }));
+    const buffers = copies.flatMap(({ bytes }) =>
+      typeof bytes === "string" ? [] : [bytes.buffer]
+    );
+
+    const id = nextDecoding++;
+    decoded = new Promise((resolve, reject) =>
+      decodings.set(id, { source, blocks, resolve, reject })
+    );
+    worker.postMessage({ id, source, blocks: copies }, { transfer: buffers });
+  }
+
+  return decoded;
+}
+
+// Decoded blocks are cached across visits, and the least recently used ones
+// are evicted beyond the size.
+const CACHE_NAME = "clang-ast-query";
+const CACHE_VERSION = 1;
+const CACHE_SIZE = 256 << 20;
+
+/** @type {Promise<IDBDatabase | null> | undefined} */
+let cache;
+
+/**
+ * The cache is null if IndexedDB is not available, e.g. in private windows.
+ * @returns {Promise<IDBDatabase | null>}
+ */
+function openCache() {
+  if (!cache)
+    cache = new Promise((resolve) => {
+      const request = indexedDB.open(CACHE_NAME, CACHE_VERSION);
+      request.onupgradeneeded = () => {
+        const db = request.result;
+        if (db.objectStoreNames.contains("blocks"))
+          db.deleteObjectStore("blocks");
+        db.createObjectStore("blocks", { keyPath: "key" }).createIndex(
+          "used",
+          "used"
+        );
+      };
+      request.onsuccess = () => resolve(request.result);
+      request.onerror = () => resolve(null);
+    }).catch(() => null);
+  return cache;
+}
+
+/**
+ * @template T
+ * @param {IDBRequest<T>} request
+ * @returns {Promise<T>}
+ */
+function getResult(request) {
+  return new Promise((resolve, reject) => {
+    request.onsuccess = () => resolve(request.result);
+    request.onerror = () => reject(request.error);
+  });
+}
+
+/**
+ * Key the blocks by the id and the digest of everything decoded, which changes
+ * whenever rows or the source change.
+ * @param {number} id
+ * @param {string} source
+ * @param {EncodedBlock[]} blocks
+ * @returns {Promise<string | null>}
+ */
+async function getCacheKey(id, source, blocks) {
+  if (!crypto.subtle) return null; // not a secure context
+
+  const encoder = new TextEncoder();
+  const parts = [source, ...blocks.map(({ bytes }) => bytes)].map((x) =>
+    typeof x === "string" ? encoder.encode(x) : x
+  );
+  const data = new Uint8Array(parts.reduce((n, x) => n + x.length + 4, 0));
+  const view = new DataView(data.buffer);
+  let offset = 0;
+  for (const x of parts) {
+    view.setUint32(offset, x.length);
+    data.set(x, offset + 4);
+    offset += x.length + 4;
+  }
+
+  const digest = new Uint8Array(await crypto.subtle.digest("SHA-256", data));
+  const hex = Array.from(digest, (x) => x.toString(16).padStart(2, "0"));
+  return `${id}:${hex.join("")}`;
+}
+
+/**
+ *
+ * @param {string} key
+ * @returns {Promise<Block[] | undefined>}
+ */
+async function loadCache(key) {
+  const db = await openCache();
+  if (!db) return;
+
+  const store = db.transaction("blocks", "readwrite").objectStore("blocks");
+  const entry = await getResult(store.get(key));
+  if (entry) {
+    entry.used = Date.now();
+    store.put(entry);
+  }
+  return entry?.blocks;
+}
+
+/**
+ *
+ * @param {string} key
+ * @param {Block[]} blocks
+ */
+async function saveCache(key, blocks) {
+  const db = await openCache();
+  if (!db) return;
+
+  const size = blocks.reduce(
+    (n, { strings, from, to, fields }) =>
+      n +
+      strings.reduce((n, s) => n + s.length * 2, 0) +
+      from.byteLength +
+      to.byteLength +
+      fields.byteLength,
+    0
+  );
+
+  const store = db.transaction("blocks", "readwrite").objectStore("blocks");
+  await getResult(store.put({ key, blocks, size, used: Date.now() }));
+
+  // Keep the most recently used ones up to the size
+  let total = 0;
+  const cursors = store.index("used").openCursor(null, "prev");
+  cursors.onsuccess = () => {
+    const cursor = cursors.result;
+    if (!cursor) return;
+    total += cursor.value.size;
+    if (total > CACHE_SIZE) cursor.delete();
+    cursor.continue();
+  };
+}
+
+/**
+ * Decode blocks of the source, or load them from the cache.
+ * @param {number} id
+ * @param {string} source
+ * @param {EncodedBlock[]} blocks
+ * @returns {Promise<Block>[]}
+ */
+function decode(id, source, blocks) {
+  const decoded = getCacheKey(id, source, blocks)
+    .catch(() => null)
+    .then(async (key) => {
+      const cached = key && (await loadCache(key).catch(() => undefined));
+      if (cached) return cached;
+
+      const decoded = await decodeAside(source, blocks);
+      if (key) saveCache(key, decoded).catch((e) => console.warn(e));
+      return decoded;
+    });
+
+  return blocks.map((_, i) => decoded.then((b) => b[i]));
+}
+
 /**
  *
  * @param {number} x
@@ -326,17 +986,9 @@ export function getLastValueFromTransaction(tr, valueEffect) {
  * @returns {number}
  */
 function getDefaultId() {
-  /** @type {HTMLScriptElement | null} */
-  const node = document.querySelector("script[data-main]");
-  if (!node) throw new Error("Missing main <script>");
-
-  const id = node.dataset.id;
-  if (id === undefined) throw new Error("Missing data-id");
-
-  const value = Number(id);
-  if (!Number.isFinite(value)) throw new Error("Invalid ID");
-
-  return value;
+  const { main } = getScripts();
+  if (main === undefined) throw new Error("Missing main <script>");
+  return main;
 }
 
 function getDefaultParent() {
@@ -361,6 +1013,54 @@ function getId(state) {
   return getDefaultId();
 }
 
+/**
+ * @typedef {HTMLScriptElement & {data: any[]}} DataScript
+ */
+
+/**
+ * Scripts of the page by ids and types, and the id of the first main source.
+ * @type {{
+ *   scripts: Map<number, Partial<Record<ScriptType, DataScript>>>,
+ *   main?: number,
+ * } | undefined}
+ */
+let registry;
+
+/**
+ * Index scripts of the page at the first use, which are all parsed already as
+ * the reader is a module.
+ */
+function getScripts() {
+  if (registry) return registry;
+
+  registry = { scripts: new Map() };
+  /** @type {NodeListOf<DataScript>} */
+  const nodes = document.querySelectorAll("script[data-id][data-type]");
+  for (const node of nodes) {
+    const id = Number(node.dataset.id);
+    const type = /** @type {ScriptType} */ (node.dataset.type);
+    if (!Number.isFinite(id)) throw new Error(`Invalid id(${node.dataset.id})`);
+
+    let scripts = registry.scripts.get(id);
+    if (!scripts) registry.scripts.set(id, (scripts = {}));
+    scripts[type] = node;
+
+    if (node.dataset.main !== undefined && registry.main === undefined)
+      registry.main = id;
+  }
+  return registry;
+}
+
+/**
+ *
+ * @param {number} id
+ * @param {ScriptType} type
+ * @return {DataScript | null}
+ */
+function findScript(id, type) {
+  return getScripts().scripts.get(id)?.[type] ?? null;
+}
+
 /**
  *
  * @param {number} id
@@ -368,10 +1068,7 @@ function getId(state) {
  * @return
  */
 function getScript(id, type) {
-  /** @type {HTMLScriptElement & {data: any[]} | null} */
-  const node = document.querySelector(
-    `script[data-id="${id}"][data-type="${type}"]`
-  );
+  const node = findScript(id, type);
   if (!node) throw new Error(`Unknown <script> for id(${id}) type(${type})`);
   return node;
 }
@@ -387,95 +1084,112 @@ function getData(id, type) {
 }
 
 /**
- * Translate 1-based line/column to 0-based offset.
- * @param {import("@codemirror/state").Text} doc
- * @param {number} row
- * @param {number} col
- */
-function getOffset(doc, row, col) {
-  return doc.line(row).from + col - 1;
-}
-
-/**
- *
- * @param {import("@codemirror/state").Text} doc
- * @param {number} beginRow
- * @param {number} beginCol
- * @param {number} endRow
- * @param {number} endCol
+ * Find the first index in [lo, hi) of which the value is not less than x.
+ * @param {Uint32Array} values sorted ascending
+ * @param {number} x
+ * @param {number} lo
+ * @param {number} hi
  */
-function getRange(doc, beginRow, beginCol, endRow, endCol) {
-  const from = getOffset(doc, beginRow, beginCol);
-  const to = getOffset(doc, endRow, endCol);
-  return [from, to];
+function lowerBound(values, x, lo = 0, hi = values.length) {
+  while (lo < hi) {
+    const mid = (lo + hi) >>> 1;
+    if (values[mid] < x) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
 }
 
 /**
- *
- * @param {any[]} data
+ * Decorations are built for visible ranges only, from offsets of rows which are
+ * ordered by their beginnings, so opening a huge file costs nothing more than
+ * decoding, which is done aside.
+ * @param {Block} data
  * @returns
  */
-function semantics(data) {
-  return StateField.define({
-    create({ doc }) {
-      const ranges = [];
-      for (let j = 0, n = data.length; j < n; ) {
-        const beginRow = data[j++];
-        const beginCol = data[j++];
-        const endRow = data[j++];
-        const endCol = data[j++];
-        const kind = data[j++];
-        const name = data[j++];
-
-        const [from, to] = getRange(doc, beginRow, beginCol, endRow, endCol);
-
-        ranges.push(
-          Decoration.mark({ class: `semantics ${kind} ${name}` }).range(
-            from,
-            to
-          )
-        );
-      }
+function semantics({ strings, from, to, fields }) {
+  /** @type {Map<string, Decoration>} */
+  const marks = new Map();
 
-      return Decoration.set(ranges);
-    },
-    update(value, tr) {
-      return value;
-    },
-    provide: (f) => [
-      EditorView.decorations.from(f),
-      EditorView.baseTheme({
-        ".RAW": {
-          textDecorationLine: "underline",
-          textDecorationStyle: "wavy",
-        },
-      }),
-    ],
-  });
+  /**
+   * @param {number} i
+   */
+  function getMark(i) {
+    const kind = strings[fields[i * 2]];
+    const name = strings[fields[i * 2 + 1]];
+    const key = `semantics ${kind} ${name}`;
+
+    let mark = marks.get(key);
+    if (!mark) marks.set(key, (mark = Decoration.mark({ class: key })));
+    return mark;
+  }
+
+  return [
+    ViewPlugin.fromClass(
+      class {
+        /** @type {import("@codemirror/view").DecorationSet} */
+        decorations;
+
+        /**
+         * @param {EditorView} view
+         */
+        constructor(view) {
+          // The longest range, to find ranges across the border of a view
+          this.span = 0;
+          for (let i = 0; i < from.length; ++i)
+            this.span = Math.max(this.span, to[i] - from[i]);
+
+          this.decorations = this.build(view);
+        }
+
+        /**
+         * @param {import("@codemirror/view").ViewUpdate} update
+         */
+        update(update) {
+          if (update.viewportChanged)
+            this.decorations = this.build(update.view);
+        }
+
+        /**
+         * @param {EditorView} view
+         */
+        build(view) {
+          const ranges = [];
+          let next = 0; // visible ranges are ordered, so are rows in them
+          for (const visible of view.visibleRanges) {
+            const first = lowerBound(from, visible.from - this.span, next);
+            const last = lowerBound(from, visible.to, first);
+            for (let i = first; i < last; ++i)
+              if (to[i] > visible.from || from[i] === visible.from)
+                ranges.push(getMark(i).range(from[i], to[i]));
+            next = Math.max(next, last);
+          }
+          return Decoration.set(ranges, true);
+        }
+      },
+      { decorations: (v) => v.decorations }
+    ),
+    EditorView.baseTheme({
+      ".RAW": {
+        textDecorationLine: "underline",
+        textDecorationStyle: "wavy",
+      },
+    }),
+  ];
 }
 
 /**
  *
- * @param {any[]} data
+ * @param {Block} data
  * @returns
  */
-function link(data) {
+function link({ from, to, fields }) {
   return StateField.define({
-    create({ doc }) {
+    create() {
       /** @type {RangeSetBuilder<RangeValue>} */
       const builder = new RangeSetBuilder();
 
-      for (let j = 0, n = data.length; j < n; ) {
-        const beginRow = data[j++];
-        const beginCol = data[j++];
-        const endRow = data[j++];
-        const endCol = data[j++];
-        const file = data[j++];
-
-        const [from, to] = getRange(doc, beginRow, beginCol, endRow, endCol);
-
-        builder.add(from, to, new RangeValue(file));
-      }
+      for (let i = 0, n = fields.length; i < n; ++i)
+        builder.add(from[i], to[i], new RangeValue(fields[i]));
       return builder.finish();
     },
     update(value, tr) {
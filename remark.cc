@@ -1,20 +1,50 @@
 #include "remark.h"
+#include "kernel.h"
 
 #include <clang/AST/ASTConsumer.h>
+#include <clang/AST/ASTDumper.h>
 #include <clang/AST/RecursiveASTVisitor.h>
 #include <clang/AST/TextNodeDumper.h>
-#include <clang/Frontend/ASTConsumers.h>
+#include <clang/Basic/Version.h>
 #include <clang/Frontend/CompilerInstance.h>
 #include <clang/Frontend/MultiplexConsumer.h>
+#include <clang/Frontend/PrecompiledPreamble.h>
+#include <clang/Tooling/ArgumentsAdjusters.h>
 #include <clang/Tooling/Syntax/Tokens.h>
 #include <clang/Tooling/Tooling.h>
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/Hashing.h>
 #include <llvm/ADT/IntervalTree.h>
+#include <llvm/ADT/MapVector.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/VirtualFileSystem.h>
 
 #include <cctype>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <tuple>
 #include <type_traits>
 #include <unistd.h>
 
+namespace {
+struct shared_preamble;
+} // namespace
+
+// Headers remarked by the unique IDs of their files, the digests of their
+// content and of the macro state they were remarked in, to the TUs remarked
+// them. Preambles of TUs are shared by the digests of their options and their
+// content, see shared_preamble.
+struct remark_headers {
+  std::mutex lock;
+  std::map<std::tuple<uint64_t, uint64_t, size_t, size_t>, std::string> keys;
+  std::map<size_t, std::shared_ptr<shared_preamble>> preambles;
+};
+
 namespace {
 
 using namespace clang;
@@ -60,6 +90,16 @@ static inline SourceRange get_macro_range(const MacroInfo *mi,
   return {mi->getDefinitionLoc(), get_macro_end(mi, id)};
 }
 
+// The location as TextNodeDumper::dumpLocation() prints it.
+static inline remark_loc get_remark_loc(const SourceManager &sm,
+                                        SourceLocation loc) {
+  PresumedLoc ploc = sm.getPresumedLoc(sm.getSpellingLoc(loc));
+  if (ploc.isInvalid())
+    return {};
+
+  return {ploc.getFilename(), ploc.getLine(), ploc.getColumn()};
+}
+
 class expanded_decl {
 public:
   expanded_decl(SourceLocation loc, const Decl *decl)
@@ -259,6 +299,13 @@ public:
     dumper.dumpSourceRange(get_range());
   }
 
+  void give(const remark_sink &sink, const SourceManager &sm) {
+    auto v = get_full_name();
+    auto range = get_range();
+    sink.semantics(v.first, v.second, get_remark_loc(sm, range.getBegin()),
+                   get_remark_loc(sm, range.getEnd()), sink.data);
+  }
+
   std::pair<const char *, const char *> get_full_name() {
     if (is_pp_kw)
       return {"PPKEYWORD",
@@ -360,10 +407,10 @@ public:
     if (!escaped)
       return write_private(ptr, size);
 
+    const char set[] = {escaped, 0};
     size_t i = 0, j = 0;
     do {
-      while (j < size && ptr[j] != escaped)
-        ++j;
+      j += scan_any(ptr + j, size - j, set);
 
       write_private(ptr + i, j - i);
       if (j == size)
@@ -380,22 +427,19 @@ private:
   void write_private(const char *ptr, size_t size) {
     pos += size;
 
-    size_t i = 0;
-    while (i < size) {
-      if (ptr[i++] == '\n') {
-        // with 2 more slots to work with parse_line()
-        size_t cap = line.size() + i + 2;
-        if (line.capacity() < cap)
-          line.reserve(cap);
-        line.append(ptr, i);
-        if (parse)
-          parse(line.data(), line.size(), line.capacity(), data);
-
-        ptr += i;
-        size -= i;
-        i = 0;
-        line.clear();
-      }
+    size_t i;
+    while ((i = scan_line(ptr, size)) && ptr[i - 1] == '\n') {
+      // with 2 more slots to work with parse_line()
+      size_t cap = line.size() + i + 2;
+      if (line.capacity() < cap)
+        line.reserve(cap);
+      line.append(ptr, i);
+      if (parse)
+        parse(line.data(), line.size(), line.capacity(), data);
+
+      ptr += i;
+      size -= i;
+      line.clear();
     }
 
     if (size)
@@ -409,12 +453,573 @@ private:
   char escaped;
 };
 
+// Tells headers of the TU left out, i.e. ones out of the scope, or remarked
+// already by another TU given the same registry, with the same content and in
+// the same macro state. The state of a header is what the macros made of it,
+// i.e. the ranges it skipped and the macros it expanded, so it is known at the
+// end of the TU only, while the scope is known once the header is entered.
+class header_filter {
+public:
+  header_filter(remark_headers *headers, const char *scope)
+      : headers(headers), scoped(scope) {
+    for (llvm::StringRef rest = scope ? scope : ""; !rest.empty();) {
+      auto [dir, next] = rest.split(':');
+      llvm::SmallString<256> abs(dir);
+      if (!dir.empty() && !llvm::sys::fs::make_absolute(abs)) {
+        llvm::sys::path::remove_dots(abs, true);
+        while (abs.size() > 1 && llvm::sys::path::is_separator(abs.back()))
+          abs.pop_back();
+        dirs.emplace_back(abs.str());
+      }
+      rest = next;
+    }
+  }
+
+  using key_t = decltype(remark_headers::keys)::key_type;
+
+  // Headers of a preamble reused are entered by the preamble only, so they are
+  // left out as they were seen by it, even if entered again by the TU.
+  void enter(const SourceManager &sm, SourceLocation loc) {
+    auto fid = sm.getFileID(loc);
+    if (auto file = sm.getFileEntryForID(fid);
+        (headers || scoped) && file && !seeded.count(file))
+      states.insert({file, {fid, llvm::hash_code(0)}});
+  }
+
+  void skip(const SourceManager &sm, SourceRange range) {
+    auto [fid, begin] = sm.getDecomposedLoc(range.getBegin());
+    if (auto file = sm.getFileEntryForID(fid); headers && file)
+      mix(file, llvm::hash_combine(begin, sm.getFileOffset(range.getEnd())));
+  }
+
+  void expand(const Preprocessor &pp, SourceLocation loc,
+              const IdentifierInfo *id, const MacroInfo *mi) {
+    auto &sm = pp.getSourceManager();
+    auto fid = sm.getFileID(sm.getExpansionLoc(loc));
+    if (auto file = sm.getFileEntryForID(fid); headers && file && mi)
+      mix(file, get_macro_digest(pp, id, mi));
+  }
+
+  bool excludes(const SourceManager &sm, const FileEntry *file) {
+    decide(sm);
+    return file && excluded.contains(file);
+  }
+
+  // Calls back with the name of each header left out as remarked by another
+  // TU, and the TU.
+  template <typename F> void for_each_lent(const SourceManager &sm, F &&f) {
+    decide(sm);
+    for (auto &[file, state] : states) {
+      auto iter = lenders.find(file);
+      if (iter == lenders.end())
+        continue;
+      if (auto loc = get_remark_loc(sm, sm.getLocForStartOfFile(state.first));
+          loc.file)
+        f(loc.file, iter->second);
+    }
+    for (auto &[file, name] : seeded) {
+      if (auto iter = lenders.find(file); iter != lenders.end())
+        f(name.c_str(), iter->second);
+    }
+  }
+
+  // Calls back with each file entered, its first FileID and its macro state,
+  // e.g. to tell headers entered by a preamble.
+  template <typename F> void for_each_entered(F &&f) const {
+    for (auto &[file, state] : states)
+      f(file, state.first, state.second);
+  }
+
+  // Takes a header entered by a preamble reused, by its name and the TU
+  // remarked it, or none if it's out of the scope. It's left out as lent.
+  void seed(const FileEntry *file, const std::string &name,
+            const std::string *lender) {
+    seeded.try_emplace(file, name);
+    excluded.insert(file);
+    if (lender)
+      lenders.try_emplace(file, *lender);
+  }
+
+  static key_t get_key(const SourceManager &sm, const FileEntry *file,
+                       FileID fid, llvm::hash_code state) {
+    auto id = file->getUniqueID();
+    auto buffer = sm.getBufferOrFake(fid).getBuffer();
+    return {id.getDevice(), id.getFile(), llvm::hash_value(buffer), state};
+  }
+
+  bool excludes(const SourceManager &sm, SourceLocation loc) {
+    if ((!headers && !scoped) || loc.isInvalid())
+      return false;
+
+    auto fid = sm.getFileID(sm.getExpansionLoc(loc));
+    return excludes(sm, sm.getFileEntryForID(fid));
+  }
+
+  // Sources with no file, e.g. the built-in one, are always in the scope.
+  bool is_in_scope(const SourceManager &sm, SourceLocation loc) {
+    if (!scoped || loc.isInvalid())
+      return true;
+
+    auto fid = sm.getFileID(sm.getExpansionLoc(loc));
+    auto file = sm.getFileEntryRefForID(fid);
+    if (!file || fid == sm.getMainFileID())
+      return true;
+
+    auto [iter, inserted] = in_scope.try_emplace(&file->getFileEntry(), false);
+    if (inserted) {
+      llvm::SmallString<256> path(file->getFileEntry().tryGetRealPathName());
+      if (path.empty())
+        path = file->getName();
+      sm.getFileManager().makeAbsolutePath(path);
+      llvm::sys::path::remove_dots(path, true);
+
+      iter->second = llvm::any_of(dirs, [&](const std::string &dir) {
+        return path.starts_with(dir) &&
+               (path.size() == dir.size() ||
+                llvm::sys::path::is_separator(dir.back()) ||
+                llvm::sys::path::is_separator(path[dir.size()]));
+      });
+    }
+
+    return iter->second;
+  }
+
+private:
+  void mix(const FileEntry *file, llvm::hash_code digest) {
+    if (auto iter = states.find(file); iter != states.end())
+      iter->second.second = llvm::hash_combine(iter->second.second, digest);
+  }
+
+  static llvm::hash_code get_macro_digest(const Preprocessor &pp,
+                                          const IdentifierInfo *id,
+                                          const MacroInfo *mi) {
+    auto digest = llvm::hash_combine(id->getName(), mi->isFunctionLike());
+    for (auto param : mi->params())
+      digest = llvm::hash_combine(digest, param->getName());
+    for (auto &token : mi->tokens())
+      digest = llvm::hash_combine(digest, pp.getSpelling(token));
+    return digest;
+  }
+
+  // Headers are claimed at once, so the ones of a TU are either remarked by it
+  // or by the TU claimed them first.
+  void decide(const SourceManager &sm) {
+    if (decided || (!headers && !scoped))
+      return;
+
+    decided = true;
+    auto main = sm.getFileEntryForID(sm.getMainFileID());
+    for (auto &[file, state] : states) {
+      if (!is_in_scope(sm, sm.getLocForStartOfFile(state.first)))
+        excluded.insert(file);
+    }
+
+    if (!headers)
+      return;
+
+    auto tu = sm.getFileEntryRefForID(sm.getMainFileID())->getName();
+    std::lock_guard<std::mutex> guard(headers->lock);
+    for (auto &[file, state] : states) {
+      if (file == main || excluded.contains(file))
+        continue;
+
+      auto [iter, inserted] = headers->keys.try_emplace(
+          get_key(sm, file, state.first, state.second), tu.str());
+      if (!inserted) {
+        excluded.insert(file);
+        lenders.try_emplace(file, iter->second);
+      }
+    }
+  }
+
+  remark_headers *headers;
+  bool scoped;
+  std::vector<std::string> dirs; // absolute directories of the scope
+  // The first FileID of each file entered, and its macro state
+  llvm::MapVector<const FileEntry *, std::pair<FileID, llvm::hash_code>> states;
+  llvm::DenseMap<const FileEntry *, bool> in_scope;
+  llvm::DenseSet<const FileEntry *> excluded;
+  // The TUs remarked the headers left out, see remark_headers
+  llvm::DenseMap<const FileEntry *, std::string> lenders;
+  // Headers entered by a preamble reused, by their names
+  llvm::MapVector<const FileEntry *, std::string> seeded;
+  bool decided = false;
+};
+
+// A preamble of TUs built with the same options, and starting with the same
+// inclusions, see remark_action. Its callbacks are not seen by the TUs reusing
+// it, so what they saw is kept with it, i.e. the inclusions of the main file,
+// and the headers entered, which are left out by the TUs as lent by the ones
+// remarked them. Nothing else is allowed in the preamble of the main file but
+// comments, which are lexed again.
+struct shared_preamble {
+  struct inclusion {
+    unsigned hash, keyword, begin, end; // offsets in the main file
+    std::string name;                   // the keyword, e.g. include
+    std::string file;                   // the name as written
+    std::string path;                   // the file found
+    bool angled;
+  };
+
+  struct header {
+    std::string name; // the presumed one, see get_remark_loc()
+    std::string path; // the real one, to find the file again
+    header_filter::key_t key;
+    bool in_scope;
+  };
+
+  unsigned size = 0; // of the preamble
+  std::vector<inclusion> inclusions;
+  std::vector<header> headers;
+  std::optional<PrecompiledPreamble> preamble;
+  // The TUs seen with the preamble, which is built by the second one, so it's
+  // not built for a TU of its own, then reused once the first one is done.
+  unsigned seen = 0;
+  bool ready = false; // built, or failed to
+};
+
+// A preamble reused by a TU, with the TUs remarked the headers it entered, or
+// none for ones out of the scope.
+struct preamble_replay {
+  std::shared_ptr<const shared_preamble> shared;
+  std::vector<const std::string *> lenders;
+};
+
+// Records what the callbacks of a preamble see, see shared_preamble. The macro
+// states of headers are mixed as the ones of the TU, so a header of a preamble
+// is reused only if it's remarked in the same state.
+class preamble_recorder final : public PreambleCallbacks {
+public:
+  preamble_recorder(shared_preamble &shared, remark_headers *headers,
+                    const char *scope)
+      : shared(shared), filter(headers, scope) {}
+
+  void BeforeExecute(CompilerInstance &compiler) override {
+    pp = &compiler.getPreprocessor();
+  }
+
+  std::unique_ptr<PPCallbacks> createPPCallbacks() override {
+    return std::make_unique<callbacks>(*this);
+  }
+
+  void AfterExecute(CompilerInstance &compiler) override {
+    auto &sm = compiler.getSourceManager();
+    auto main = sm.getFileEntryForID(sm.getMainFileID());
+    filter.for_each_entered([&](const FileEntry *file, FileID fid,
+                                llvm::hash_code state) {
+      if (file == main)
+        return;
+
+      auto loc = sm.getLocForStartOfFile(fid);
+      auto name = get_remark_loc(sm, loc).file;
+      auto path = file->tryGetRealPathName();
+      if (!name || path.empty()) {
+        complete = false;
+        return;
+      }
+
+      shared.headers.push_back(
+          {name, path.str(), header_filter::get_key(sm, file, fid, state),
+           filter.is_in_scope(sm, loc)});
+    });
+  }
+
+  // Whether each inclusion of the main file, and each header are recorded.
+  bool is_complete() const { return complete; }
+
+private:
+  class callbacks final : public PPCallbacks {
+  public:
+    explicit callbacks(preamble_recorder &r) : r(r) {}
+
+    void FileChanged(SourceLocation loc, FileChangeReason reason,
+                     SrcMgr::CharacteristicKind file_type,
+                     FileID prev_fid = FileID()) override {
+      if (reason == EnterFile)
+        r.filter.enter(r.pp->getSourceManager(), loc);
+    }
+
+    void SourceRangeSkipped(SourceRange range,
+                            SourceLocation endif_loc) override {
+      r.filter.skip(r.pp->getSourceManager(), range);
+    }
+
+    void MacroExpands(const Token &token, const MacroDefinition &def,
+                      SourceRange range, const MacroArgs *args) override {
+      if (!depth++)
+        r.filter.expand(*r.pp, range.getBegin(), token.getIdentifierInfo(),
+                        def.getMacroInfo());
+    }
+
+    void MacroExpanded(const MacroInfo *mi, bool fast) override { --depth; }
+
+    void InclusionDirective(SourceLocation hash_loc, const Token &include_tok,
+                            StringRef filename, bool is_angled,
+                            CharSourceRange filename_range,
+                            OptionalFileEntryRef file, StringRef search_path,
+                            StringRef relative_path,
+                            const Module *suggested_module,
+                            bool module_imported,
+                            SrcMgr::CharacteristicKind file_type) override {
+      auto &sm = r.pp->getSourceManager();
+      if (!sm.isWrittenInMainFile(hash_loc))
+        return;
+
+      // Names given by macros are expanded by the TU only
+      auto begin = filename_range.getBegin();
+      if (!file || begin.isMacroID()) {
+        r.complete = false;
+        return;
+      }
+
+      r.shared.inclusions.push_back(
+          {sm.getFileOffset(hash_loc),
+           sm.getFileOffset(include_tok.getLocation()),
+           sm.getFileOffset(begin),
+           sm.getFileOffset(filename_range.getEnd()),
+           include_tok.getIdentifierInfo()->getName().str(), filename.str(),
+           file->getName().str(), is_angled});
+    }
+
+  private:
+    preamble_recorder &r;
+    unsigned depth = 0; // of macros expanding
+  };
+
+  shared_preamble &shared;
+  header_filter filter;
+  Preprocessor *pp = nullptr;
+  bool complete = true;
+};
+
+// Gives nodes of the AST to the sink as values, the ones TextNodeDumper would
+// dump by lines, including the children it dumps by itself, e.g. the
+// declaration referred by a type. The text of the base goes nowhere.
+class node_delegate : public TextNodeDumper {
+public:
+  node_delegate(ASTContext &ctx, const remark_sink &sink)
+      : TextNodeDumper(llvm::nulls(), ctx, false /* ShowColors */),
+        sm(ctx.getSourceManager()), policy(ctx.getPrintingPolicy()),
+        sink(sink) {}
+
+  using TextNodeDumper::Visit;
+
+  // Children are given in the order they are added, i.e. nothing is pending.
+  template <typename Fn> void AddChild(Fn f) { AddChild("", f); }
+
+  template <typename Fn> void AddChild(StringRef label, Fn f) {
+    ++depth;
+    f();
+    --depth;
+  }
+
+  void Visit(const Decl *d) {
+    if (!d)
+      return give({.level = depth - 1});
+
+    std::string kind = std::string(d->getDeclKindName()) + "Decl", name;
+    auto node = make_node(kind.c_str(), d, d->getSourceRange());
+    node.prev = d->getPreviousDecl();
+    node.loc = get_remark_loc(sm, d->getLocation());
+    if (auto nd = dyn_cast<NamedDecl>(d); nd && nd->getDeclName()) {
+      name = nd->getNameAsString();
+      node.name = name.c_str();
+    }
+
+    type_strings type;
+    if (auto td = dyn_cast<TypedefNameDecl>(d))
+      type = get_type(td->getUnderlyingType());
+    else if (auto vd = dyn_cast<ValueDecl>(d))
+      type = get_type(vd->getType());
+    give(type.set(node));
+
+    if (auto ifd = dyn_cast<IndirectFieldDecl>(d)) {
+      for (auto child : ifd->chain())
+        give_decl_ref(child);
+    }
+  }
+
+  void Visit(const Stmt *s) {
+    if (!s)
+      return give({.level = depth - 1});
+
+    auto node = make_node(s->getStmtClassName(), s, s->getSourceRange());
+    type_strings type;
+    if (auto e = dyn_cast<Expr>(s))
+      type = get_type(e->getType());
+    give(type.set(node));
+
+    // Only integers of values are told by the grammar
+    if (auto ce = dyn_cast<ConstantExpr>(s);
+        ce && ce->hasAPValueResult() && ce->getAPValueResult().isInt()) {
+      AddChild("value", [&] {
+        auto value = llvm::toString(ce->getAPValueResult().getInt(), 10);
+        give({.kind = "IntValue", .level = depth - 1, .text = value.c_str()});
+      });
+    }
+  }
+
+  void Visit(const Type *t) {
+    if (!t)
+      return give({.level = depth - 1});
+
+    std::string kind = std::string(t->getTypeClassName()) + "Type";
+    auto node = make_node(kind.c_str(), t);
+    give(get_type(QualType(t, 0), false).set(node));
+
+    if (auto tt = dyn_cast<TypedefType>(t))
+      give_decl_ref(tt->getDecl());
+    else if (auto tag = dyn_cast<TagType>(t))
+      give_decl_ref(tag->getDecl());
+  }
+
+  void Visit(QualType t) {
+    auto node = make_node("QualType", t.getAsOpaquePtr());
+    give(get_type(t, false).set(node));
+  }
+
+  void Visit(const Attr *a) {
+    const char *name = "";
+    switch (a->getKind()) {
+#define ATTR(X)                                                                \
+  case attr::X:                                                                \
+    name = #X;                                                                 \
+    break;
+#include <clang/Basic/AttrList.inc>
+    }
+
+    std::string kind = std::string(name) + "Attr";
+    give(make_node(kind.c_str(), a, a->getRange()));
+  }
+
+  void Visit(const comments::Comment *c, const comments::FullComment *fc) {
+    if (!c)
+      return give({.level = depth - 1});
+
+    auto node = make_node(c->getCommentKindName(), c, c->getSourceRange());
+    std::string text;
+    if (auto tc = dyn_cast<comments::TextComment>(c)) {
+      text = tc->getText();
+      node.text = text.c_str();
+    }
+    give(node);
+  }
+
+private:
+  // The type as dumpBareType() prints it, desugared if asked and different.
+  struct type_strings {
+    std::string qualified;
+    std::optional<std::string> desugared;
+
+    const remark_node &set(remark_node &node) const {
+      if (!qualified.empty())
+        node.type = qualified.c_str();
+      if (desugared)
+        node.desugared = desugared->c_str();
+      return node;
+    }
+  };
+
+  type_strings get_type(QualType t, bool desugar = true) const {
+    auto split = t.split();
+    type_strings type{QualType::getAsString(split, policy)};
+    if (desugar && !t.isNull()) {
+      if (auto desugared = t.getSplitDesugaredType(); split != desugared)
+        type.desugared = QualType::getAsString(desugared, policy);
+    }
+    return type;
+  }
+
+  remark_node make_node(const char *kind, const void *pointer,
+                        SourceRange range = {}) const {
+    return {.kind = kind,
+            .level = depth - 1,
+            .pointer = pointer,
+            .begin = get_remark_loc(sm, range.getBegin()),
+            .end = get_remark_loc(sm, range.getEnd())};
+  }
+
+  // As dumpBareDeclRef() prints the declaration as a child.
+  void give_decl_ref(const Decl *d) {
+    AddChild([=, this] {
+      remark_node node{
+          .kind = d->getDeclKindName(), .level = depth - 1, .pointer = d};
+      std::string name;
+      if (auto nd = dyn_cast<NamedDecl>(d)) {
+        name = nd->getNameAsString();
+        node.name = name.c_str();
+      }
+
+      type_strings type;
+      if (auto vd = dyn_cast<ValueDecl>(d))
+        type = get_type(vd->getType());
+      give(type.set(node));
+    });
+  }
+
+  void give(const remark_node &node) { sink.node(&node, sink.data); }
+
+  const SourceManager &sm;
+  PrintingPolicy policy;
+  const remark_sink &sink;
+  unsigned depth = 0;
+};
+
+class node_traverser final
+    : public ASTNodeTraverser<node_traverser, node_delegate> {
+public:
+  node_traverser(ASTContext &ctx, const remark_sink &sink)
+      : delegate(ctx, sink) {}
+
+  node_delegate &doGetNodeDelegate() { return delegate; }
+
+private:
+  node_delegate delegate;
+};
+
+// Dumps the AST as the -ast-dump of clang, except top level declarations of
+// headers left out. Nodes are given as values instead if the sink takes them.
+class ast_dumper final : public ASTConsumer {
+public:
+  ast_dumper(std::unique_ptr<raw_ostream> os, header_filter &headers,
+             const remark_sink &sink)
+      : os(std::move(os)), headers(headers), sink(sink) {}
+
+  void HandleTranslationUnit(ASTContext &ctx) override {
+    if (sink.node)
+      dump(node_traverser(ctx, sink), ctx);
+    else
+      dump(ASTDumper(*os, ctx, false /* ShowColors */), ctx);
+  }
+
+private:
+  template <typename T> void dump(T &&dumper, ASTContext &ctx) {
+    auto &sm = ctx.getSourceManager();
+    auto tu = ctx.getTranslationUnitDecl();
+    auto &node = dumper.doGetNodeDelegate();
+    node.AddChild([&] {
+      node.Visit(tu);
+      for (auto d : tu->noload_decls()) {
+        if (!headers.excludes(sm, d->getLocation()))
+          dumper.Visit(d);
+      }
+    });
+  }
+
+  std::unique_ptr<raw_ostream> os;
+  header_filter &headers;
+  const remark_sink &sink;
+};
+
 class ast_consumer final : public ASTConsumer {
 public:
   ast_consumer(std::unique_ptr<raw_line_ostream> os, Preprocessor &pp,
-               std::vector<semantic_token> &semantic_tokens)
-      : out(*os), pp(pp), semantic_tokens(semantic_tokens), os(std::move(os)),
-        visitor(*this), last_expansion(0, 0), dir(0) {
+               std::vector<semantic_token> &semantic_tokens,
+               header_filter &headers, const remark_sink &sink,
+               const preamble_replay *replay)
+      : out(*os), pp(pp), semantic_tokens(semantic_tokens), headers(headers),
+        sink(sink), replay(replay), os(std::move(os)), visitor(*this),
+        last_expansion(0, 0), dir(0) {
     directive_nodes.emplace_back(); // Add the dummy root
   }
 
@@ -423,12 +1028,21 @@ protected:
     dumper.emplace(out, context, false /* ShowColors */);
     pp.addPPCallbacks(std::make_unique<pp_callback>(*this));
     pp.setTokenWatcher([this](auto &token) { on_token_lexed(token); });
+    if (replay)
+      replay_preamble(context);
+  }
+
+  // Bodies of functions out of the scope are skipped by the parser given
+  // SkipFunctionBodies.
+  bool shouldSkipFunctionBody(Decl *d) override {
+    return !headers.is_in_scope(pp.getSourceManager(), d->getLocation());
   }
 
   void HandleTranslationUnit(ASTContext &ctx) override {
     visitor.TraverseDecl(ctx.getTranslationUnitDecl());
     traverse_comments(ctx);
     traverse_tokens();
+    filter_semantic_tokens();
 
     dump_preprocessor();
     dump_remarks(ctx);
@@ -712,6 +1326,9 @@ private:
 
       macro_expansions.emplace_back(token.getIdentifierInfo(),
                                     def.getMacroInfo(), range, parent, remote);
+      if (parent == -1)
+        ast.headers.expand(ast.pp, range.getBegin(), token.getIdentifierInfo(),
+                           def.getMacroInfo());
       expanding_stack.push_back(remote);
 
       // Update remote field up to the root
@@ -851,7 +1468,8 @@ private:
           hash_loc,
           SourceRange{filename_range.getBegin(), filename_range.getEnd()},
           include_tok.getIdentifierInfo()->getName(), filename,
-          file ? file->getFileEntry().tryGetRealPathName() : "", is_angled);
+          file ? file->getFileEntry().tryGetRealPathName() : "", is_angled,
+          file ? &file->getFileEntry() : nullptr);
       ast.inclusion_stack.push_back(ast.directives.size() - 1);
       ast.add_expansion();
 
@@ -867,6 +1485,9 @@ private:
     void FileChanged(SourceLocation loc, FileChangeReason reason,
                      SrcMgr::CharacteristicKind file_type,
                      FileID prev_fid = FileID()) override {
+      if (reason == EnterFile)
+        ast.headers.enter(ast.pp.getSourceManager(), loc);
+
       if (reason == ExitFile && !ast.inclusion_stack.empty()) {
         auto i = ast.inclusion_stack.back();
         auto inclusion = std::get_if<directive_inclusion>(&ast.directives[i]);
@@ -900,6 +1521,8 @@ private:
                             SourceLocation endif_loc) override {
       assert(endif_loc.isFileID());
       auto &sm = ast.pp.getSourceManager();
+      ast.headers.skip(sm, range);
+
       auto ploc = sm.getPresumedLoc(endif_loc);
       auto file = sm.getFileEntryForID(ploc.getFileID());
       assert(file);
@@ -1061,6 +1684,7 @@ private:
     StringRef file;
     StringRef path;
     bool angled;
+    const FileEntry *entry;
   };
 
   struct directive_node {
@@ -1129,6 +1753,12 @@ private:
   }
 
   void dump_macro(const MacroInfo *mi, const IdentifierInfo *id) {
+    if (sink.node) {
+      auto node = make_node("MacroPPDecl", mi, get_macro_range(mi, id));
+      node.name = id->getNameStart();
+      return give(node);
+    }
+
     out << "MacroPPDecl";
     dumper->dumpPointer(mi);
     dumper->dumpSourceRange(get_macro_range(mi, id));
@@ -1159,31 +1789,110 @@ private:
     }
   }
 
+  // The preamble of the main file is seen as the TU would see it, i.e. the
+  // inclusions are given to the callbacks, and the comments to the context, as
+  // they are lexed by the preprocessor. Headers included are left out.
+  void replay_preamble(ASTContext &ctx) {
+    auto &sm = pp.getSourceManager();
+    auto fid = sm.getMainFileID();
+    auto at = [&](unsigned offset) { return sm.getComposedLoc(fid, offset); };
+
+    Lexer lexer(fid, sm.getBufferOrFake(fid), sm, pp.getLangOpts());
+    lexer.SetCommentRetentionState(true);
+    Token token;
+    for (lexer.LexFromRawLexer(token);
+         token.isNot(tok::eof) &&
+         sm.getFileOffset(token.getLocation()) < replay->shared->size;
+         lexer.LexFromRawLexer(token)) {
+      if (token.is(tok::comment))
+        ctx.addComment(RawComment(sm, {token.getLocation(), token.getEndLoc()},
+                                  pp.getLangOpts().CommentOpts, false));
+    }
+
+    pp_callback callback(*this);
+    for (auto &inclusion : replay->shared->inclusions) {
+      token.startToken();
+      token.setKind(tok::identifier);
+      token.setLocation(at(inclusion.keyword));
+      token.setLength(inclusion.name.size());
+      token.setIdentifierInfo(pp.getIdentifierInfo(inclusion.name));
+
+      auto file = sm.getFileManager().getOptionalFileRef(inclusion.path, true);
+      callback.InclusionDirective(
+          at(inclusion.hash), token, inclusion.file, inclusion.angled,
+          CharSourceRange::getCharRange(at(inclusion.begin),
+                                        at(inclusion.end)),
+          file, {}, {}, nullptr, false, SrcMgr::C_User);
+      inclusion_stack.pop_back();
+      lift_directive();
+    }
+  }
+
   void dump_preprocessor() {
-    dumper->AddChild([this] {
-      out << "Preprocessor";
-      dumper->dumpPointer(&pp);
+    add_child([this] {
+      if (sink.node)
+        give(make_node("Preprocessor", &pp));
+      else {
+        out << "Preprocessor";
+        dumper->dumpPointer(&pp);
+      }
       for (auto child : directive_nodes.front().children) {
         dump_directive(directive_nodes[child]);
       }
     });
   }
 
+  // Semantics of headers left out are dropped, so are their raw tokens.
+  void filter_semantic_tokens() {
+    auto &sm = pp.getSourceManager();
+    std::erase_if(semantic_tokens, [&](auto &st) {
+      return headers.excludes(sm, st.get_range().getBegin());
+    });
+  }
+
   void dump_remarks(ASTContext &ctx) {
     auto &sm = ctx.getSourceManager();
     const auto file = sm.getFileEntryRefForID(sm.getMainFileID());
     const auto &filename = file->getName();
-    char cwd[PATH_MAX];
 
-    out << "#TU " << text_head << filename << '\n';
-    out << "#TS " << time(NULL) << '\n';
-    out << "#CWD " << text_head << getcwd(cwd, sizeof(cwd)) << '\n';
+    // The directory of the TU, e.g. given by -working-directory, rather than
+    // the one of the process
+    std::string cwd;
+    if (auto dir = sm.getFileManager()
+                       .getVirtualFileSystem()
+                       .getCurrentWorkingDirectory())
+      cwd = std::move(*dir);
+    else {
+      char buf[PATH_MAX];
+      if (getcwd(buf, sizeof(buf)))
+        cwd = buf;
+    }
+
+    // Values are given to the sink as is, skipping the text round trip
+    if (sink.meta)
+      sink.meta(filename.str().c_str(), time(NULL), cwd.c_str(), sink.data);
+    else {
+      out << "#TU " << text_head << filename << '\n';
+      out << "#TS " << time(NULL) << '\n';
+      out << "#CWD " << text_head << cwd << '\n';
+    }
 
     for (auto &st : semantic_tokens) {
+      if (sink.semantics) {
+        st.give(sink, sm);
+        continue;
+      }
+
       out << '#';
       st.dump(out, *dumper);
       out << '\n';
     }
+
+    if (sink.header) {
+      headers.for_each_lent(sm, [&](const char *file, const std::string &tu) {
+        sink.header(file, tu.c_str(), sink.data);
+      });
+    }
   }
 
   void cleanup_indices() {
@@ -1318,32 +2027,47 @@ private:
       auto mi = md->getMacroInfo();
       auto loc = md->getLocation();
 
+      const char *kind = nullptr;
       switch (md->getKind()) {
       case MacroDirective::MD_Define:
-        ast.out << "DefineDirective";
+        kind = "DefineDirective";
         break;
       case MacroDirective::MD_Undefine:
-        ast.out << "UndefDirective";
+        kind = "UndefDirective";
         break;
       case MacroDirective::MD_Visibility:
-        ast.out << "VisibilityDirective";
+        kind = "VisibilityDirective";
         break;
       }
 
-      ast.dumper->dumpPointer(md);
-      if (auto prev = md->getPrevious()) {
-        ast.out << " prev";
-        ast.dumper->dumpPointer(prev);
-      }
+      if (ast.sink.node) {
+        auto node = ast.make_node(kind, md, arg.range);
+        node.prev = md->getPrevious();
+        node.loc = get_remark_loc(ast.pp.getSourceManager(), loc);
+        ast.give(node);
+      } else {
+        ast.out << kind;
+        ast.dumper->dumpPointer(md);
+        if (auto prev = md->getPrevious()) {
+          ast.out << " prev";
+          ast.dumper->dumpPointer(prev);
+        }
 
-      ast.dumper->dumpSourceRange(arg.range);
-      ast.out << ' ';
-      // The location is just the macro name.
-      ast.dumper->dumpLocation(loc);
-      ast.dumper->AddChild([&ast, id, mi] { ast.dump_macro(mi, id); });
+        ast.dumper->dumpSourceRange(arg.range);
+        ast.out << ' ';
+        // The location is just the macro name.
+        ast.dumper->dumpLocation(loc);
+      }
+      ast.add_child([&ast, id, mi] { ast.dump_macro(mi, id); });
     }
 
     void operator()(const if_directive &arg) {
+      if (ast.sink.node) {
+        auto node = ast.make_node("IfDirective", &arg, arg.range);
+        node.loc = get_remark_loc(ast.pp.getSourceManager(), arg.cond_loc);
+        return ast.give(node);
+      }
+
       ast.out << "IfDirective";
       ast.dumper->dumpPointer(&arg);
       ast.dumper->dumpSourceRange(arg.range);
@@ -1356,6 +2080,9 @@ private:
     }
 
     void operator()(const if_directive::cond &arg) {
+      if (ast.sink.node)
+        return ast.give(ast.make_node("ConditionalPPExpr", &arg, arg.range));
+
       ast.out << "ConditionalPPExpr";
       ast.dumper->dumpPointer(&arg);
       ast.dumper->dumpSourceRange(arg.range);
@@ -1377,12 +2104,21 @@ private:
     }
 
     void operator()(const if_directive::block &arg) {
+      if (ast.sink.node)
+        return ast.give(ast.make_node("CompoundPPStmt", &arg, arg.range));
+
       ast.out << "CompoundPPStmt";
       ast.dumper->dumpPointer(&arg);
       ast.dumper->dumpSourceRange(arg.range);
     }
 
     void operator()(const if_directive::defined &arg) {
+      if (ast.sink.node) {
+        auto node = ast.make_node("DefinedPPOperator", &arg, arg.range);
+        node.name = arg.id->getNameStart();
+        return ast.give(node);
+      }
+
       ast.out << "DefinedPPOperator";
       ast.dumper->dumpPointer(&arg);
       ast.dumper->dumpSourceRange(arg.range);
@@ -1396,6 +2132,19 @@ private:
     }
 
     void operator()(const directive_inclusion &arg) {
+      if (ast.sink.node) {
+        auto node = ast.make_node("InclusionDirective", &arg,
+                                  {arg.hash_loc, arg.range.getEnd()});
+        node.loc = get_remark_loc(ast.pp.getSourceManager(),
+                                  arg.range.getBegin());
+        std::string name(arg.name), file(arg.file), path(arg.path);
+        node.name = name.c_str();
+        node.text = file.c_str();
+        node.path = path.c_str();
+        node.angled = arg.angled;
+        return ast.give(node);
+      }
+
       ast.out << "InclusionDirective";
       ast.dumper->dumpPointer(&arg);
       // Similar to #define, the range is starting from hash.
@@ -1410,11 +2159,25 @@ private:
     }
   };
 
-  void dump_directive(const directive_node &node) {
-    dumper->AddChild([=, this] {
+  // Directives of headers left out are dropped but inclusions, which are kept
+  // under the nearest directive dumped to tell the headers included.
+  void dump_directive(const directive_node &node, bool excluded = false) {
+    auto &directive = directives[node.i];
+    auto inclusion = std::get_if<directive_inclusion>(&directive);
+    bool excludes = inclusion ? headers.excludes(pp.getSourceManager(),
+                                                 inclusion->entry)
+                              : excluded;
+
+    if (excluded && !inclusion) {
+      for (auto child : node.children)
+        dump_directive(directive_nodes[child], true);
+      return;
+    }
+
+    add_child([=, this] {
       std::visit(directive_dumper{*this}, directives[node.i]);
       for (auto child : node.children) {
-        dump_directive(directive_nodes[child]);
+        dump_directive(directive_nodes[child], excludes);
       }
     });
   }
@@ -1424,7 +2187,11 @@ private:
       auto &sm = ctx.getSourceManager();
       for (auto begin = sm.fileinfo_begin(), end = sm.fileinfo_end();
            begin != end; ++begin) {
+        // Comments of a preamble reused are of the TU that built it, but the
+        // ones of its main file are replayed, see replay_preamble()
         auto fid = sm.translateFile(begin->first);
+        if (replay && sm.isLoadedFileID(fid))
+          continue;
         if (auto comments = ctx.Comments.getCommentsInFile(fid)) {
           for (auto &item : *comments) {
             auto raw_comment = item.second;
@@ -1606,10 +2373,16 @@ private:
       dump_macro(macro_expansions[node.i]);
 
     for (auto child : node.children)
-      dumper->AddChild([child, this] { dump_expansion(*child); });
+      add_child([child, this] { dump_expansion(*child); });
   }
 
   void dump_macro(const macro_expansion &me) {
+    if (sink.node) {
+      auto node = make_node("MacroExpansion", &me, me.range);
+      node.name = me.identifier->getNameStart();
+      return give(node);
+    }
+
     out << "MacroExpansion";
     dumper->dumpPointer(&me);
     dumper->dumpSourceRange(me.range);
@@ -1750,6 +2523,18 @@ private:
       } while (caller_loc.isMacroID());
     }
 
+    if (sink.node) {
+      std::string text;
+      llvm::raw_string_ostream os(text);
+      dump_token_content(token, os);
+      os.flush();
+
+      auto node = make_node("Token", nullptr);
+      node.loc = get_remark_loc(sm, raw_loc);
+      node.text = text.c_str();
+      return give(node);
+    }
+
     out << "Token ";
     dumper->dumpLocation(raw_loc);
 
@@ -1786,24 +2571,54 @@ private:
   }
 
   unsigned dump_token_content(const Token &token) {
+    return dump_token_content(token, out);
+  }
+
+  unsigned dump_token_content(const Token &token, raw_ostream &os) {
     if (IdentifierInfo *ii = token.getIdentifierInfo()) {
       auto name = ii->getName();
-      out << name;
+      os << name;
       return name.size();
     }
 
     if (token.isLiteral() && !token.needsCleaning() && token.getLiteralData()) {
-      out.write(token.getLiteralData(), token.getLength());
+      os.write(token.getLiteralData(), token.getLength());
       return token.getLength();
     }
 
-    return Lexer::dumpSpelling(token, out, pp.getSourceManager(),
+    return Lexer::dumpSpelling(token, os, pp.getSourceManager(),
                                pp.getLangOpts());
   }
 
+  // Children are given to the sink as values if it takes nodes, otherwise they
+  // are dumped by lines.
+  template <typename Fn> void add_child(Fn f) {
+    if (!sink.node)
+      return dumper->AddChild(f);
+
+    ++depth;
+    f();
+    --depth;
+  }
+
+  remark_node make_node(const char *kind, const void *pointer,
+                        SourceRange range = {}) const {
+    auto &sm = pp.getSourceManager();
+    return {.kind = kind,
+            .level = depth - 1,
+            .pointer = pointer,
+            .begin = get_remark_loc(sm, range.getBegin()),
+            .end = get_remark_loc(sm, range.getEnd())};
+  }
+
+  void give(const remark_node &node) { sink.node(&node, sink.data); }
+
   raw_line_ostream &out;
   Preprocessor &pp;
   std::vector<semantic_token> &semantic_tokens;
+  header_filter &headers;
+  const remark_sink &sink;
+  const preamble_replay *replay;
   std::unique_ptr<raw_line_ostream> os;
   ast_visitor visitor;
   std::optional<TextNodeDumper> dumper;
@@ -1818,7 +2633,8 @@ private:
                            if_directive::block, if_directive::defined,
                            directive_inclusion, expansion_tree::node *>>
       directives;
-  unsigned dir; // index of the present directive_node
+  unsigned dir;       // index of the present directive_node
+  unsigned depth = 0; // of the node given as a value, see add_child()
   std::vector<directive_node> directive_nodes;
   llvm::DenseMap<FileID, std::map<unsigned, index_value_t>> indices;
   std::vector<syntax::Token> syntax_tokens;
@@ -1826,42 +2642,52 @@ private:
 
 std::unique_ptr<ASTConsumer> make_ast_dumper(std::unique_ptr<raw_ostream> os,
                                              CompilerInstance &compiler,
-                                             std::string_view in_file) {
-  const auto &opts = compiler.getFrontendOpts();
-  return CreateASTDumper(std::move(os), opts.ASTDumpFilter, opts.ASTDumpDecls,
-                         opts.ASTDumpAll, opts.ASTDumpLookups,
-                         opts.ASTDumpDeclTypes, opts.ASTDumpFormat);
+                                             std::string_view in_file,
+                                             header_filter &headers,
+                                             const remark_sink &sink) {
+  return std::make_unique<ast_dumper>(std::move(os), headers, sink);
 }
 
 std::unique_ptr<ASTConsumer>
 make_ast_consumer(std::unique_ptr<raw_line_ostream> os,
                   CompilerInstance &compiler, std::string_view in_file,
-                  std::vector<semantic_token> &semantic_tokens) {
-  return std::make_unique<ast_consumer>(
-      std::move(os), compiler.getPreprocessor(), semantic_tokens);
+                  std::vector<semantic_token> &semantic_tokens,
+                  header_filter &headers, const remark_sink &sink,
+                  const preamble_replay *replay) {
+  return std::make_unique<ast_consumer>(std::move(os),
+                                        compiler.getPreprocessor(),
+                                        semantic_tokens, headers, sink, replay);
 }
 
 class frontend_action : public ASTFrontendAction {
 public:
-  frontend_action() = default;
-  frontend_action(int (*parse_line)(char *line, size_t n, size_t cap,
-                                    void *data),
-                  void *data)
-      : parse_line(parse_line), data(data) {}
+  frontend_action(const remark_sink &sink, const preamble_replay *replay)
+      : sink(sink), replay(replay), headers(sink.headers, sink.scope) {}
 
   std::unique_ptr<ASTConsumer>
   CreateASTConsumer(CompilerInstance &compiler,
                     llvm::StringRef in_file) override {
     compiler.getLangOpts().CommentOpts.ParseAllComments = true;
     compiler.getLangOpts().RetainCommentsFromSystemHeaders = true;
+    if (sink.scope)
+      compiler.getFrontendOpts().SkipFunctionBodies = true;
+
+    if (replay) {
+      auto &files = compiler.getFileManager();
+      for (size_t i = 0; i < replay->shared->headers.size(); ++i) {
+        auto &header = replay->shared->headers[i];
+        if (auto file = files.getOptionalFileRef(header.path, true))
+          headers.seed(&file->getFileEntry(), header.name, replay->lenders[i]);
+      }
+    }
 
     std::vector<std::unique_ptr<ASTConsumer>> v;
-    v.push_back(
-        make_ast_dumper(std::make_unique<raw_line_ostream>(parse_line, data),
-                        compiler, in_file));
-    v.push_back(
-        make_ast_consumer(std::make_unique<raw_line_ostream>(parse_line, data),
-                          compiler, in_file, semantic_tokens));
+    v.push_back(make_ast_dumper(
+        std::make_unique<raw_line_ostream>(sink.line, sink.data), compiler,
+        in_file, headers, sink));
+    v.push_back(make_ast_consumer(
+        std::make_unique<raw_line_ostream>(sink.line, sink.data), compiler,
+        in_file, semantic_tokens, headers, sink, replay));
     return std::make_unique<MultiplexConsumer>(std::move(v));
   }
 
@@ -1871,7 +2697,7 @@ public:
     auto &compiler = getCompilerInstance();
     auto &sm = compiler.getSourceManager();
 
-    raw_line_ostream out(parse_line, data);
+    raw_line_ostream out(sink.line, sink.data);
     TextNodeDumper dumper(out, compiler.getASTContext(), false);
 
     using interval_tree = llvm::IntervalTree<unsigned, unsigned>;
@@ -1924,7 +2750,14 @@ public:
       auto iter = trees.find(fid);
       assert(iter != trees.end() && "Failed to find interval tree");
 
-      if (iter->second.getContaining(loc.getRawEncoding()).empty()) {
+      if (!iter->second.getContaining(loc.getRawEncoding()).empty())
+        continue;
+
+      if (sink.semantics)
+        sink.semantics("RAW", tok::getTokenName(raw_tok.getKind()),
+                       get_remark_loc(sm, loc), get_remark_loc(sm, end_loc),
+                       sink.data);
+      else {
         out << '#' << name_head << "RAW " << name_head
             << tok::getTokenName(raw_tok.getKind());
         dumper.dumpSourceRange({loc, end_loc});
@@ -1934,9 +2767,146 @@ public:
   }
 
 private:
-  int (*parse_line)(char *line, size_t n, size_t cap, void *data) = nullptr;
-  void *data = nullptr;
+  remark_sink sink;
+  const preamble_replay *replay;
   std::vector<semantic_token> semantic_tokens;
+  header_filter headers;
+};
+
+// Counts the directives of the text, e.g. of a preamble.
+unsigned count_directives(const LangOptions &lang, llvm::StringRef text) {
+  Lexer lexer(SourceLocation(), lang, text.begin(), text.begin(), text.end());
+  unsigned n = 0;
+  Token token;
+  for (lexer.LexFromRawLexer(token); token.isNot(tok::eof);
+       lexer.LexFromRawLexer(token))
+    n += token.is(tok::hash) && token.isAtStartOfLine();
+  return n;
+}
+
+// Runs the frontend action with the preamble of the TU reused if it's shared
+// with other TUs, which are going to the same place, given the headers of the
+// sink. Preambles are kept in memory as long as the headers, so they are not
+// reused across runs, where TUs up to date are left out as a whole instead.
+class remark_action final : public tooling::FrontendActionFactory {
+public:
+  remark_action(const remark_sink &sink, std::optional<size_t> options)
+      : sink(sink), options(options) {}
+
+  std::unique_ptr<FrontendAction> create() override {
+    return std::make_unique<frontend_action>(sink,
+                                             replay ? &*replay : nullptr);
+  }
+
+  bool runInvocation(std::shared_ptr<CompilerInvocation> invocation,
+                     FileManager *files,
+                     std::shared_ptr<PCHContainerOperations> pch,
+                     DiagnosticConsumer *diags) override {
+    // As set by frontend_action, so preambles are built the same
+    invocation->getLangOpts().CommentOpts.ParseAllComments = true;
+    invocation->getLangOpts().RetainCommentsFromSystemHeaders = true;
+
+    llvm::IntrusiveRefCntPtr<FileManager> reusing;
+    if (options && sink.headers &&
+        invocation->getFrontendOpts().Inputs.size() == 1) {
+      if (auto vfs = reuse_preamble(*invocation, *files, pch))
+        reusing = llvm::makeIntrusiveRefCnt<FileManager>(
+            files->getFileSystemOpts(), std::move(vfs));
+    }
+
+    return FrontendActionFactory::runInvocation(
+        std::move(invocation), reusing ? reusing.get() : files,
+        std::move(pch), diags);
+  }
+
+private:
+  // Returns the file system given by the preamble reused, see shared_preamble,
+  // or null if none is reused.
+  llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem>
+  reuse_preamble(CompilerInvocation &invocation, FileManager &files,
+                 std::shared_ptr<PCHContainerOperations> pch) {
+    auto &input = invocation.getFrontendOpts().Inputs.front();
+    if (!input.isFile())
+      return nullptr;
+
+    auto buffer = files.getBufferForFile(input.getFile());
+    if (!buffer)
+      return nullptr;
+
+    main_buffer = std::move(*buffer);
+    auto bounds = ComputePreambleBounds(invocation.getLangOpts(),
+                                        main_buffer->getMemBufferRef(), 0);
+    if (!bounds.Size)
+      return nullptr;
+
+    auto text = main_buffer->getBuffer().take_front(bounds.Size);
+    size_t digest =
+        llvm::hash_combine(*options, text, bounds.PreambleEndsAtStartOfLine);
+
+    auto &lock = sink.headers->lock;
+    std::shared_ptr<shared_preamble> shared;
+    bool build;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      auto &p = sink.headers->preambles[digest];
+      if (!p)
+        p = std::make_shared<shared_preamble>();
+      shared = p;
+      build = ++shared->seen == 2;
+    }
+
+    if (build) {
+      auto engine = CompilerInstance::createDiagnostics(
+          new DiagnosticOptions, new IgnoringDiagConsumer);
+      preamble_recorder recorder(*shared, sink.headers, sink.scope);
+      auto preamble = PrecompiledPreamble::Build(
+          invocation, main_buffer.get(), bounds, *engine,
+          files.getVirtualFileSystemPtr(), pch, true, "", recorder);
+
+      shared->size = bounds.Size;
+      if (preamble && recorder.is_complete() &&
+          shared->inclusions.size() ==
+              count_directives(invocation.getLangOpts(), text))
+        shared->preamble.emplace(std::move(*preamble));
+
+      std::lock_guard<std::mutex> guard(lock);
+      shared->ready = true;
+    }
+
+    std::vector<const std::string *> lenders;
+    {
+      // Headers of the preamble have to be remarked by other TUs already
+      std::lock_guard<std::mutex> guard(lock);
+      if (!shared->ready || !shared->preamble)
+        return nullptr;
+
+      for (auto &header : shared->headers) {
+        const std::string *lender = nullptr;
+        if (header.in_scope) {
+          auto iter = sink.headers->keys.find(header.key);
+          if (iter == sink.headers->keys.end())
+            return nullptr;
+          lender = &iter->second;
+        }
+        lenders.push_back(lender);
+      }
+    }
+
+    auto vfs = files.getVirtualFileSystemPtr();
+    if (!shared->preamble->CanReuse(invocation, main_buffer->getMemBufferRef(),
+                                    bounds, *vfs))
+      return nullptr;
+
+    shared->preamble->AddImplicitPreamble(invocation, vfs, main_buffer.get());
+    replay.emplace(preamble_replay{std::move(shared), std::move(lenders)});
+    return vfs;
+  }
+
+  const remark_sink &sink;
+  // The digest of the options of a file, and its working directory
+  std::optional<size_t> options;
+  std::optional<preamble_replay> replay;
+  std::unique_ptr<llvm::MemoryBuffer> main_buffer; // remapped by the preamble
 };
 
 int print_line(char *line, size_t n, size_t cap, void *data) {
@@ -1944,29 +2914,239 @@ int print_line(char *line, size_t n, size_t cap, void *data) {
   return 0;
 }
 
+// A file served from the buffer cached by caching_fs.
+class cached_file final : public llvm::vfs::File {
+public:
+  cached_file(llvm::vfs::Status status, const llvm::MemoryBuffer &buffer)
+      : st(std::move(status)), buffer(buffer) {}
+
+  llvm::ErrorOr<llvm::vfs::Status> status() override { return st; }
+
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>>
+  getBuffer(const Twine &name, int64_t file_size, bool null_terminated,
+            bool is_volatile) override {
+    return llvm::MemoryBuffer::getMemBuffer(buffer.getBuffer(), name.str(),
+                                            null_terminated);
+  }
+
+  std::error_code close() override { return {}; }
+
+private:
+  llvm::vfs::Status st;
+  const llvm::MemoryBuffer &buffer;
+};
+
+// Keeps buffers of files read, which are mapped rather than copied by the
+// physical file system mostly, so headers included by TUs are read once.
+class caching_fs final : public llvm::vfs::ProxyFileSystem {
+public:
+  caching_fs() : ProxyFileSystem(llvm::vfs::createPhysicalFileSystem()) {}
+
+  llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>>
+  openFileForRead(const Twine &path) override {
+    llvm::SmallString<256> abs;
+    path.toVector(abs);
+    if (auto ec = makeAbsolute(abs))
+      return ec;
+
+    auto iter = cache.find(abs);
+    if (iter == cache.end()) {
+      auto file = ProxyFileSystem::openFileForRead(abs);
+      if (!file)
+        return file.getError();
+
+      auto status = (*file)->status();
+      if (!status)
+        return status.getError();
+
+      auto buffer = (*file)->getBuffer(abs, status->getSize(), true, false);
+      if (!buffer)
+        return buffer.getError();
+
+      iter = cache.try_emplace(abs, *status, std::move(*buffer)).first;
+    }
+
+    auto &[status, buffer] = iter->second;
+    return std::make_unique<cached_file>(
+        llvm::vfs::Status::copyWithNewName(status, path), *buffer);
+  }
+
+  // Drops the buffer of a file read once, e.g. the main file of a TU.
+  void forget(const Twine &path) {
+    llvm::SmallString<256> abs;
+    path.toVector(abs);
+    if (!makeAbsolute(abs))
+      cache.erase(abs);
+  }
+
+private:
+  llvm::StringMap<
+      std::pair<llvm::vfs::Status, std::unique_ptr<llvm::MemoryBuffer>>>
+      cache;
+};
+
+// The tool persists in each thread as ClangTool does for its TUs, i.e. files
+// are shared by TUs in the same working directory.
+struct remark_tool {
+  llvm::IntrusiveRefCntPtr<caching_fs> fs;
+  llvm::IntrusiveRefCntPtr<FileManager> files;
+  std::string cwd;
+};
+
+thread_local remark_tool tool;
+
+// Returns the working directory given by -working-directory, empty if none.
+std::string get_working_directory(const std::vector<std::string> &args) {
+  constexpr std::string_view flag = "-working-directory";
+  for (size_t i = 0; i < args.size(); ++i) {
+    std::string_view arg = args[i];
+    if (arg == flag && i + 1 < args.size())
+      return args[i + 1];
+    if (arg.starts_with(flag) && arg.size() > flag.size() &&
+        arg[flag.size()] == '=')
+      return std::string(arg.substr(flag.size() + 1));
+  }
+
+  return {};
+}
+
+// Relative paths are made absolute by the given working directory, as clang
+// does for -working-directory, otherwise they are kept relative to the one of
+// the process.
+FileManager &get_files(const std::string &cwd) {
+  if (!tool.fs)
+    tool.fs = llvm::makeIntrusiveRefCnt<caching_fs>();
+
+  if (!tool.files || tool.cwd != cwd) {
+    char dir[PATH_MAX];
+    if (!cwd.empty())
+      tool.fs->setCurrentWorkingDirectory(cwd);
+    else if (getcwd(dir, sizeof(dir)))
+      tool.fs->setCurrentWorkingDirectory(dir);
+
+    FileSystemOptions opts;
+    opts.WorkingDir = cwd;
+    tool.files = llvm::makeIntrusiveRefCnt<FileManager>(opts, tool.fs);
+    tool.cwd = cwd;
+  }
+
+  return *tool.files;
+}
+
+// Sources are recorded by paths as found, which are read again by the process
+// later, e.g. to digest or render them. So with a working directory of its own,
+// the input and the paths sources are searched by are made absolute.
+void make_paths_absolute(const FileManager &files,
+                         std::vector<std::string> &args,
+                         std::string &filename) {
+  auto make_absolute = [&](std::string &path) {
+    llvm::SmallString<256> abs(path);
+    if (files.makeAbsolutePath(abs)) {
+      llvm::sys::path::remove_dots(abs, true);
+      path = abs.str();
+    }
+  };
+
+  constexpr std::string_view separate[] = {
+      "-I", "-F", "-iquote", "-isystem", "-idirafter", "-include", "-imacros"};
+  constexpr std::string_view joined[] = {"-I", "-F"};
+  for (size_t i = 0; i < args.size(); ++i) {
+    std::string_view arg = args[i];
+    if (llvm::is_contained(separate, arg)) {
+      if (i + 1 < args.size())
+        make_absolute(args[++i]);
+      continue;
+    }
+
+    for (auto flag : joined) {
+      if (arg.size() > flag.size() && arg.starts_with(flag)) {
+        auto path = std::string(arg.substr(flag.size()));
+        make_absolute(path);
+        args[i] = std::string(flag) + path;
+        break;
+      }
+    }
+  }
+
+  make_absolute(filename);
+}
+
 } // namespace
 
-struct error
-remark(const char *code, size_t size, const char *filename, char **opts,
-       int (*parse_line)(char *line, size_t n, size_t cap, void *data),
-       void *data) {
+struct error remark(const char *code, size_t size, const char *filename,
+                    char **opts, const struct remark_sink *sink) {
   std::vector<std::string> args;
   if (opts) {
     while (*opts)
       args.push_back(*opts++);
   }
+
+  if (!filename)
+    filename = "input.c";
+
+  // Nothing is written by the compiler as ClangTool does, e.g. by -o or -MF of
+  // a compilation database.
+  for (const auto &adjust :
+       {clang::tooling::getClangStripOutputAdjuster(),
+        clang::tooling::getClangStripDependencyFileAdjuster()})
+    args = adjust(args, filename);
+
   args.push_back("-Xclang");
   args.push_back("-ast-dump");
   args.push_back("-fno-color-diagnostics");
 
-  if (!filename)
-    filename = "input.c";
-  if (!parse_line)
-    parse_line = print_line;
-
-  return clang::tooling::runToolOnCodeWithArgs(
-             std::make_unique<frontend_action>(parse_line, data),
-             std::string_view{code, size}, args, filename)
-             ? (struct error){}
-             : (struct error){ES_REMARK};
+  remark_sink printer = {print_line};
+  if (!sink)
+    sink = &printer;
+
+  const auto cwd = get_working_directory(args);
+  auto files = llvm::IntrusiveRefCntPtr<FileManager>(&get_files(cwd));
+
+  std::string path = filename;
+  if (!code && !cwd.empty())
+    make_paths_absolute(*files, args, path);
+
+  // The code is given aside, e.g. under another name, by a file system of its
+  // own on top of the cached one, without copying.
+  if (code) {
+    auto overlay = llvm::makeIntrusiveRefCnt<llvm::vfs::OverlayFileSystem>(
+        files->getVirtualFileSystemPtr());
+    auto memory = llvm::makeIntrusiveRefCnt<llvm::vfs::InMemoryFileSystem>();
+    overlay->pushOverlay(memory);
+    memory->addFile(filename, 0,
+                    llvm::MemoryBuffer::getMemBuffer(
+                        llvm::StringRef(code, size), filename, false));
+    files = llvm::makeIntrusiveRefCnt<FileManager>(FileSystemOptions(),
+                                                   std::move(overlay));
+  }
+
+  std::vector<std::string> argv = {"clang-tool", "-fsyntax-only"};
+  argv.insert(argv.end(), args.begin(), args.end());
+  argv.push_back(path);
+
+  // Preambles are shared only by files remarked with the same options
+  std::optional<size_t> options;
+  if (!code)
+    options = llvm::hash_combine(
+        llvm::hash_combine_range(args.begin(), args.end()), cwd,
+        llvm::StringRef(sink->scope ? sink->scope : ""));
+  remark_action action(*sink, options);
+  clang::tooling::ToolInvocation invocation(
+      std::move(argv), &action, files.get(),
+      std::make_shared<PCHContainerOperations>());
+
+  bool ok = invocation.run();
+  if (!code)
+    tool.fs->forget(path);
+
+  return ok ? (struct error){} : (struct error){ES_REMARK};
+}
+
+const char *remark_version() {
+  static const std::string version = clang::getClangFullVersion();
+  return version.c_str();
 }
+
+struct remark_headers *remark_headers_new() { return new remark_headers; }
+
+void remark_headers_free(struct remark_headers *headers) { delete headers; }
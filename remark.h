@@ -12,10 +12,79 @@ extern "C" {
 #include <stddef.h>
 #endif
 
-struct error
-remark(const char *code, size_t size, const char *filename, char **opts,
-       int (*parse_line)(char *line, size_t n, size_t cap, void *data),
-       void *data);
+// A presumed location, the file is NULL for an invalid one.
+struct remark_loc {
+  const char *file;
+  unsigned line;
+  unsigned col;
+};
+
+// A node of the AST or the preprocessor, as a line of the dump tells it. The
+// kind is the one leading the line, e.g. "VarDecl", or NULL for a null node,
+// and the level is the depth in the tree. Locations are invalid, and strings
+// are NULL, if the node has none. The text is e.g. the file included as
+// written, or the spelling of a token, and the path is the file included.
+struct remark_node {
+  const char *kind;
+  unsigned level;
+  const void *pointer;
+  const void *prev;
+  struct remark_loc begin;
+  struct remark_loc end;
+  struct remark_loc loc;
+  const char *name;
+  const char *type;
+  const char *desugared;
+  const char *text;
+  const char *path;
+  bool angled;
+};
+
+// Headers remarked by TUs going to the same place, shared by threads.
+struct remark_headers;
+
+struct remark_headers *remark_headers_new();
+
+void remark_headers_free(struct remark_headers *headers);
+
+// Where remarks go. Nodes of the dump, the meta and the semantics of tokens are
+// given as values to the callbacks set, skipping the text round trip, otherwise
+// lines of them are given. Nodes given as values carry the fields above only,
+// e.g. neither options nor macro bodies, which lines of them tell.
+//
+// Given the headers, a header remarked already by another TU with the same
+// content and macro state is left out, but where it is included. Remarks of
+// TUs are then complete only as a whole, e.g. linked into one database. Each
+// header left out is given to the header callback if set, with the TU which
+// remarked it.
+//
+// Given the scope, i.e. directories separated by colons, sources out of them
+// are left out but where they are included, and function bodies in them are
+// skipped by the parser. The main file is always in the scope, so an empty
+// scope is the main file only.
+//
+// Strings are valid only during the callback.
+struct remark_sink {
+  int (*line)(char *line, size_t n, size_t cap, void *data);
+  void (*node)(const struct remark_node *node, void *data);
+  void (*meta)(const char *tu, long ts, const char *cwd, void *data);
+  void (*semantics)(const char *kind, const char *name, struct remark_loc begin,
+                    struct remark_loc end, void *data);
+  void (*header)(const char *file, const char *tu, void *data);
+  void *data;
+  struct remark_headers *headers;
+  const char *scope;
+};
+
+// Remarks the code given as the file, or the file itself if the code is NULL.
+// Files are read once by each thread, and shared by TUs remarked later in the
+// same working directory, see -working-directory. Lines are printed to the
+// standard output without a sink.
+struct error remark(const char *code, size_t size, const char *filename,
+                    char **opts, const struct remark_sink *sink);
+
+// The version of clang the tool is built with, which remarks depend on.
+const char *remark_version();
 
 #ifdef __cplusplus
 }
@@ -1,7 +1,12 @@
 #include "render.h"
+#include "encode.h"
 #include "parse.h"
+#include "pool.h"
 #include "store.h"
 #include "util.h"
+#include "writer.h"
+
+#include <dirent.h>
 
 #ifndef READER_JS
 static const char reader_js[] = {
@@ -13,10 +18,18 @@ static const char reader_js[] = {
 #define reader_js_len (sizeof(READER_JS) - 1)
 #endif // !READER_JS
 
-#define DUMP(fp, ...)                                                          \
+// The reader imported by sites, it's written aside the index, either embedded
+// or copied from the bundle named by READER_JS, e.g. by debug builds.
+#ifndef READER_JS
+#define READER_MODULE "./reader.js"
+#else
+#define READER_MODULE READER_JS
+#endif // !READER_JS
+
+#define DUMP(w, ...)                                                           \
   do {                                                                         \
-    if (!err.es && (ferror(fp) || fprintf(fp, __VA_ARGS__) < 0))               \
-      return (struct error){ES_RENDER};                                        \
+    if (!err.es && (writer_format(w, __VA_ARGS__), (w)->err.es))               \
+      return (w)->err;                                                         \
   } while (0)
 
 #define EVAL(x)                                                                \
@@ -31,24 +44,44 @@ struct {
   char tu[PATH_MAX];
 } state;
 
+// Contents are mapped only while being rendered, so the memory stays flat no
+// matter how many sources there are.
 typedef struct {
   String file;
-  struct string content;
 } Source;
 
 typedef struct {
   struct error err;
 } StringsRowContext;
 
+typedef struct {
+  unsigned part;  // the part to key, see render_parts
+  unsigned begin; // the index of the first source to key
+  unsigned end;   // the index after the last source to key
+  uint64_t *keys; // the keys of sources [begin, end)
+} DigestRowContext;
+
 typedef struct {
   struct error err;
-  FILE *out;
+  struct writer *out;
+  const char *type; // the data-type of rendering scripts
+  unsigned first;   // the index of the first source to render
+  unsigned next;    // the index of the next source to render
+  unsigned end;     // the index after the last source to render
+  size_t *offsets;  // the offsets of sources in the output, if not NULL
+  bool skip;        // whether rows of the present group are not wanted
+  bool binary;      // whether rows are encoded, see encode.h
+  struct encoder enc;
+  struct bytes block;
 } CommonRowContext;
 
 typedef DECL_ARRAY(SourceList, Source) SourceList;
 
 SourceList all_sources;
 
+// The directory to cache fragments, NULL if not to cache.
+static const char *cache_dir;
+
 static inline int compare_source(const void *a, const void *b, size_t n) {
   auto x = ((const String *)a)->hash;
   auto y = ((const String *)b)->hash;
@@ -58,7 +91,6 @@ static inline int compare_source(const void *a, const void *b, size_t n) {
 static void destroy_source(void *p) {
   Source *src = p;
   string_clear(&src->file.elem, 1);
-  string_clear(&src->content, 1);
 }
 
 static inline IMPL_ARRAY_BSEARCH(SourceList, compare_source);
@@ -67,24 +99,17 @@ static inline IMPL_ARRAY_CLEAR(SourceList, destroy_source);
 
 static inline struct error add_source(struct string file, uint8_t property,
                                       HASH_size_t hash) {
-  struct error err = {};
   String s = {hash, property, file};
+  if (!SourceList_badd(&all_sources, &s, NULL))
+    string_clear(&file, 1);
 
-  ARRAY_size_t i;
-  if (SourceList_badd(&all_sources, &s, &i)) {
-    FILE *fp;
-    err = open_file(string_get(&all_sources.data[i].file.elem), "r", &fp);
-    if (!err.es) {
-      // We're going to dump the src content into JS, so read with escapes
-      err = reads(fp, &all_sources.data[i].content, "'\\");
-      err = next_error(err, close_file(fp));
-    }
-  }
-
-  return err;
+  return (struct error){};
 }
 
-struct error render_init() { return (struct error){}; }
+struct error render_init(const char *cache) {
+  cache_dir = cache;
+  return (struct error){};
+}
 
 struct error render_halt() {
   SourceList_clear(&all_sources, 1);
@@ -122,66 +147,192 @@ static struct error load_sources() {
   return next_error(err, ctx.err);
 }
 
-static struct error render_sources(FILE *fp) {
+// Bump it if fragments are rendered differently.
+#define FRAGMENT_VERSION 2
+
+// The key is never 0, which is left for uncacheable fragments.
+static inline void mix_key(uint64_t *key, uint64_t value) {
+  uint64_t v[] = {*key, value};
+  *key = (uint64_t)hash(v, sizeof(v)) | 1;
+}
+
+static inline void mix_key_string(uint64_t *key, const char *s) {
+  mix_key(key, (uint64_t)hash(s, strlen(s)));
+}
+
+// Dumps the text into a script as is, except that a backslash is inserted
+// after '<' followed by '/', '!' or a backslash, so neither "</script" nor
+// "<!--" could appear. The reader reverses it by /<\\([/!\\])/g -> "<$1".
+static struct error dump_text(struct writer *w, const char *s, size_t n) {
+  size_t k = 0;
+  for (size_t j = 0; (j += scan_any(s + j, n - j, "<")) + 1 < n; ++j) {
+    if (s[j + 1] && strchr("/!\\", s[j + 1])) {
+      writer_write(w, s + k, j + 1 - k);
+      writer_putc(w, '\\');
+      k = j + 1;
+    }
+  }
+  writer_write(w, s + k, n - k);
+  return w->err;
+}
+
+static struct error render_sources(struct writer *w, unsigned begin,
+                                   unsigned end, size_t *offsets) {
   struct error err = {};
-  for (unsigned i = 0; i < all_sources.i; ++i) {
-    DUMP(fp, R"code(
-    <script data-id='%u' data-type='source' data-path='%s' %s>
-      document.currentScript.data = [
-)code",
+  for (unsigned i = begin; i < end; ++i) {
+    if (offsets)
+      offsets[i - begin] = w->i;
+
+    // Sources are raw texts of non-executed scripts, so the reader splits the
+    // lines only when the source is opened.
+    DUMP(w, R"code(
+    <script type='text/plain' data-id='%u' data-type='source' data-path='%s' %s>)code",
          all_sources.data[i].file.hash,
          string_get(&all_sources.data[i].file.elem),
          all_sources.data[i].file.property & SP_TU ? "data-main" : "");
 
-    const char *code = string_get(&all_sources.data[i].content);
-    unsigned n = string_len(&all_sources.data[i].content);
+    const char *data = NULL;
+    size_t size = 0;
+    EVAL(map_file(string_get(&all_sources.data[i].file.elem), &data, &size));
+    EVAL(dump_text(w, data, size));
+    unmap_file(data, size);
+    DUMP(w, "</script>");
+  }
+  if (offsets)
+    offsets[end - begin] = w->i;
+  return err;
+}
 
-    // Instead of using String.raw, which requires escaping variable
-    // substitutions, we pass the code line by line.
-    for (unsigned j = 0, k = 0; j < n; ++j) {
-      if (code[j] == '\n') {
-        DUMP(fp, "'%.*s',\n", j - k, code + k);
-        k = j + 1;
-      }
+static struct error dump_base64(struct writer *w, const uint8_t *data,
+                                size_t n) {
+  static const char digits[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+  char buf[BUFSIZ / 4 * 4];
+  unsigned k = 0;
+  for (size_t i = 0; i < n; i += 3) {
+    uint32_t v = data[i] << 16 | (i + 1 < n ? data[i + 1] << 8 : 0) |
+                 (i + 2 < n ? data[i + 2] : 0);
+    buf[k++] = digits[v >> 18];
+    buf[k++] = digits[v >> 12 & 63];
+    buf[k++] = i + 1 < n ? digits[v >> 6 & 63] : '=';
+    buf[k++] = i + 2 < n ? digits[v & 63] : '=';
+    if (k == sizeof(buf) || i + 3 >= n) {
+      writer_write(w, buf, k);
+      k = 0;
     }
+  }
+  return w->err;
+}
 
-    DUMP(fp, "''" /* the additional line makes some editor works properly */
-             R"code(];
+// Encoded data are given by non-executed scripts in base64, and the others by
+// classic ones.
+static struct error render_data_begin(CommonRowContext *ctx, unsigned src) {
+  struct error err = {};
+  if (ctx->offsets)
+    ctx->offsets[ctx->next - ctx->first] = ctx->out->i;
+
+  if (ctx->binary)
+    DUMP(ctx->out, R"code(
+    <script type='application/octet-stream' data-id='%u' data-type='%s'>)code",
+         src, ctx->type);
+  else
+    DUMP(ctx->out, R"code(
+    <script data-id='%u' data-type='%s'>
+      document.currentScript.data = [
+)code",
+         src, ctx->type);
+  return err;
+}
+
+static struct error render_data_end(CommonRowContext *ctx) {
+  struct error err = {};
+  if (ctx->binary) {
+    encode_finish(&ctx->enc, &ctx->block);
+    EVAL(dump_base64(ctx->out, ctx->block.data, ctx->block.i));
+    bytes_clear(&ctx->block, ARRAY_DESTROY_ELEMENTS_ONLY);
+    DUMP(ctx->out, "</script>");
+  } else {
+    DUMP(ctx->out, R"code(];
     </script>)code");
   }
   return err;
 }
 
-bool semantics_row(unsigned begin_row, unsigned begin_col, unsigned end_row,
-                   unsigned end_col, const char *kind, const char *name,
-                   void *obj) {
+// Renders empty data for sources ahead of the given one, since queries only
+// return groups having rows.
+static struct error render_data_until(CommonRowContext *ctx, uint64_t src) {
+  struct error err = {};
+  for (; ctx->next < ctx->end &&
+         all_sources.data[ctx->next].file.hash < src;
+       ++ctx->next) {
+    EVAL(render_data_begin(ctx, all_sources.data[ctx->next].file.hash));
+    EVAL(render_data_end(ctx));
+  }
+  return err;
+}
+
+static bool group_row(unsigned src, bool end, void *obj) {
   CommonRowContext *ctx = obj;
   assert(ctx && ctx->out);
 
-  if (fprintf(ctx->out, "%u,%u,%u,%u,'%s','%s',\n", begin_row, begin_col,
-              end_row, end_col, kind, name) < 0)
-    ctx->err = (struct error){ES_RENDER};
+  if (end) {
+    if (!ctx->skip) {
+      ctx->err = render_data_end(ctx);
+      ++ctx->next;
+    }
+  } else {
+    ctx->err = render_data_until(ctx, src);
+    ctx->skip = ctx->next == ctx->end ||
+                all_sources.data[ctx->next].file.hash != src;
+    if (!ctx->err.es && !ctx->skip)
+      ctx->err = render_data_begin(ctx, src);
+  }
 
   return ctx->err.es;
 }
 
-struct error render_semantics(FILE *fp) {
-  struct error err = {};
-  for (unsigned i = 0; i < all_sources.i; ++i) {
-    unsigned src = all_sources.data[i].file.hash;
-    DUMP(fp, R"code(
-    <script data-id='%u' data-type='semantics'>
-      document.currentScript.data = [
-)code",
-         src);
+// Renders the data of sources [begin, end) in one ordered scan.
+#define RENDER_DATA(w, kind, begin, end, encoded, offs)                        \
+  do {                                                                         \
+    CommonRowContext ctx = {.out = w,                                          \
+                            .type = #kind,                                     \
+                            .first = begin,                                    \
+                            .next = begin,                                     \
+                            .end = end,                                        \
+                            .offsets = offs,                                   \
+                            .binary = encoded};                                \
+    err = begin < end ? query_##kind##_in(all_sources.data[begin].file.hash,   \
+                                          all_sources.data[end - 1].file.hash, \
+                                          group_row, kind##_row, &ctx)         \
+                      : (struct error){};                                      \
+    EVAL(ctx.err);                                                             \
+    EVAL(render_data_until(&ctx, UINT64_MAX));                                 \
+    if (offs)                                                                  \
+      offs[end - begin] = (w)->i;                                              \
+    encoder_clear(&ctx.enc);                                                   \
+    bytes_clear(&ctx.block, ARRAY_DESTROY_ALL);                                \
+  } while (0)
 
-    CommonRowContext ctx = {.out = fp};
-    EVAL(query_semantics(src, semantics_row, &ctx));
-    EVAL(ctx.err);
+bool semantics_row(unsigned begin_row, unsigned begin_col, unsigned end_row,
+                   unsigned end_col, const char *kind, const char *name,
+                   void *obj) {
+  CommonRowContext *ctx = obj;
+  assert(ctx && ctx->out);
 
-    DUMP(fp, R"code(];
-    </script>)code");
+  if (!ctx->skip) {
+    encode_range(&ctx->enc, begin_row, begin_col, end_row, end_col);
+    encode_string(&ctx->enc, kind, strlen(kind));
+    encode_string(&ctx->enc, name, strlen(name));
   }
+
+  return ctx->err.es;
+}
+
+static struct error render_semantics(struct writer *w, unsigned begin,
+                                     unsigned end, size_t *offsets) {
+  struct error err;
+  RENDER_DATA(w, semantics, begin, end, true, offsets);
   return err;
 }
 
@@ -194,32 +345,20 @@ bool link_row(unsigned begin_row, unsigned begin_col, unsigned end_row,
               unsigned end_col, unsigned link, void *obj) {
   CommonRowContext *ctx = obj;
   assert(ctx && ctx->out);
-  assert(check_link(link));
+  assert(ctx->skip || check_link(link));
 
-  if (fprintf(ctx->out, "%u,%u,%u,%u,%u,\n", begin_row, begin_col, end_row,
-              end_col, link) < 0)
-    ctx->err = (struct error){ES_RENDER};
+  if (!ctx->skip) {
+    encode_range(&ctx->enc, begin_row, begin_col, end_row, end_col);
+    encode_uint(&ctx->enc, link);
+  }
 
   return ctx->err.es;
 }
 
-struct error render_link(FILE *fp) {
-  struct error err = {};
-  for (unsigned i = 0; i < all_sources.i; ++i) {
-    unsigned src = all_sources.data[i].file.hash;
-    DUMP(fp, R"code(
-    <script data-id='%u' data-type='link'>
-      document.currentScript.data = [
-)code",
-         src);
-
-    CommonRowContext ctx = {.out = fp};
-    EVAL(query_link(src, link_row, &ctx));
-    EVAL(ctx.err);
-
-    DUMP(fp, R"code(];
-    </script>)code");
-  }
+static struct error render_link(struct writer *w, unsigned begin,
+                                unsigned end, size_t *offsets) {
+  struct error err;
+  RENDER_DATA(w, link, begin, end, true, offsets);
   return err;
 }
 
@@ -232,69 +371,494 @@ bool lint_row(unsigned begin_row, unsigned begin_col, unsigned end_row,
   return ctx->err.es;
 }
 
-struct error render_lint(FILE *fp) {
-  struct error err = {};
-  for (unsigned i = 0; i < all_sources.i; ++i) {
-    unsigned src = all_sources.data[i].file.hash;
-    DUMP(fp, R"code(
-    <script data-id='%u' data-type='lint'>
-      document.currentScript.data = [
-)code",
-         src);
+static struct error render_lint(struct writer *w, unsigned begin,
+                                unsigned end, size_t *offsets) {
+  struct error err;
+  RENDER_DATA(w, lint, begin, end, false, offsets);
+  return err;
+}
 
-    CommonRowContext ctx = {.out = fp};
-    EVAL(query_lint(src, lint_row, &ctx));
-    EVAL(ctx.err);
+// Fragments are keyed by the digests of what they are rendered from, i.e. the
+// source, or the rows of it, which are digested at the time of storing and
+// linking. Sources rendered are as mapped now, so they are keyed by the status
+// of the files as well, e.g. in case they are edited after storing.
+static bool digest_row(unsigned src, uint64_t source, uint64_t semantics,
+                       uint64_t link, void *obj) {
+  DigestRowContext *ctx = obj;
+  Source s = {{.hash = src}};
+  ARRAY_size_t i;
+  if (!SourceList_bsearch(&all_sources, &s, &i) || i < ctx->begin ||
+      i >= ctx->end)
+    return false;
+
+  // Lints are not stored yet, so no rows of them.
+  const uint64_t rows[] = {0, semantics, link, 0};
+  uint64_t *key = &ctx->keys[i - ctx->begin];
+  *key = FRAGMENT_VERSION;
+  mix_key(key, ctx->part);
+  mix_key(key, source);
+  mix_key(key, rows[ctx->part]);
+
+  // Sources unable to read are not cached, they are rendered empty anyway.
+  if (ctx->part == 0) {
+    const char *file = string_get(&all_sources.data[i].file.elem);
+    struct stat st;
+    if (!source || stat(file, &st)) {
+      *key = 0;
+      return false;
+    }
+    mix_key_string(key, file);
+    mix_key(key, all_sources.data[i].file.property & SP_TU);
+    mix_key(key, st.st_size);
+    mix_key(key, st.st_mtim.tv_sec);
+    mix_key(key, st.st_mtim.tv_nsec);
+  }
+  return false;
+}
 
-    DUMP(fp, R"code(];
-    </script>)code");
+// Keys the part of sources [begin, end), the ones never digested are not
+// cached.
+static struct error digest_part(unsigned part, unsigned begin, unsigned end,
+                                uint64_t *keys) {
+  DigestRowContext ctx = {part, begin, end, keys};
+  memset(keys, 0, (end - begin) * sizeof(*keys));
+  return begin < end ? query_digests_in(all_sources.data[begin].file.hash,
+                                        all_sources.data[end - 1].file.hash,
+                                        digest_row, &ctx)
+                     : (struct error){};
+}
+
+// Scripts are rendered part by part in this order, each part is made of the
+// scripts of sources in the same order as all_sources. If offsets are given,
+// the offsets of the scripts of sources in the output, and the offset of the
+// end after them, are recorded, which are meaningful for memory writers only.
+typedef struct error (*render_part_t)(struct writer *w, unsigned begin,
+                                      unsigned end, size_t *offsets);
+
+static const render_part_t render_parts[] = {
+    render_sources,
+    render_semantics,
+    render_link,
+    render_lint,
+};
+
+#define RENDER_PARTS (sizeof(render_parts) / sizeof(*render_parts))
+
+static inline bool is_cacheable(uint64_t key) { return cache_dir && key; }
+
+static inline void get_fragment_file(char file[PATH_MAX], unsigned part,
+                                     const Source *src) {
+  snprintf(file, PATH_MAX, "%s/%u-%u", cache_dir, src->file.hash, part);
+}
+
+// Maps the cached fragment, which is led by the key, if it's up to date.
+static bool map_fragment(unsigned part, const Source *src, uint64_t key,
+                         const char **data, size_t *size) {
+  if (!is_cacheable(key))
+    return false;
+
+  char file[PATH_MAX];
+  get_fragment_file(file, part, src);
+  if (access(file, F_OK) || map_file(file, data, size).es)
+    return false;
+
+  if (*size >= sizeof(key) && !memcmp(*data, &key, sizeof(key)))
+    return true;
+
+  unmap_file(*data, *size);
+  return false;
+}
+
+// Caches the fragment via a temporary file, as others might be reading it.
+static struct error save_fragment(unsigned part, const Source *src,
+                                  uint64_t key, const char *data,
+                                  size_t size) {
+  char file[PATH_MAX], tmp[PATH_MAX + 16], str[8];
+  get_fragment_file(file, part, src);
+  snprintf(tmp, sizeof(tmp), "%s.tmp-%s", file, rands(str, sizeof(str)));
+
+  FILE *fp;
+  struct error err = open_file(tmp, "w", &fp);
+  if (err.es)
+    return err;
+
+  if (fwrite(&key, sizeof(key), 1, fp) != 1 ||
+      (size && fwrite(data, size, 1, fp) != 1))
+    err = (struct error){ES_FILE_WRITE, errno};
+  err = next_error(err, close_file(fp));
+  return next_error(err, err.es ? unlink_file(tmp) : rename_file(tmp, file));
+}
+
+// Renders a part of sources [begin, end), where fragments cached already are
+// spliced as is, and others are rendered by runs in between and then cached.
+static struct error render_cached(unsigned part, struct writer *w,
+                                  unsigned begin, unsigned end) {
+  if (!cache_dir)
+    return render_parts[part](w, begin, end, NULL);
+
+  size_t *offsets = malloc((end - begin + 1) * sizeof(*offsets));
+  uint64_t *keys = malloc((end - begin + 1) * sizeof(*keys));
+  assert(offsets && keys);
+
+  struct writer run;
+  writer_open(&run, NULL);
+
+  struct error err = digest_part(part, begin, end, keys);
+  for (unsigned i = begin; !err.es && i < end;) {
+    const char *data = NULL;
+    size_t size = 0;
+    unsigned j = i;
+    while (j < end && !map_fragment(part, &all_sources.data[j],
+                                    keys[j - begin], &data, &size))
+      ++j;
+
+    if (i < j) {
+      run.i = 0;
+      err = render_parts[part](&run, i, j, offsets);
+      writer_write(w, run.data, run.i);
+      for (unsigned k = i; !err.es && k < j; ++k) {
+        if (is_cacheable(keys[k - begin]))
+          err = save_fragment(part, &all_sources.data[k], keys[k - begin],
+                              run.data + offsets[k - i],
+                              offsets[k - i + 1] - offsets[k - i]);
+      }
+    }
+
+    if (j < end) {
+      writer_write(w, data + sizeof(uint64_t), size - sizeof(uint64_t));
+      unmap_file(data, size);
+    }
+    i = j + 1;
+    EVAL(w->err);
   }
+
+  writer_close(&run);
+  free(offsets);
+  free(keys);
   return err;
 }
 
-struct error render(FILE *fp) {
-  memset(&state, 0, sizeof(state));
+typedef struct {
+  const char *db_file;
+  const char *dir; // the directory of the site to render
+  bool gzip;
+  unsigned ranges;
+  struct writer *fragments;
+} RenderContext;
+
+// Renders a part of a range of sources into its own fragment, the connection
+// of the main thread is not shared, so a read-only one is opened.
+static struct error render_fragment(unsigned job, unsigned worker, void *obj) {
+  RenderContext *ctx = obj;
+  assert(ctx && job < ctx->ranges * RENDER_PARTS);
+
+  unsigned part = job / ctx->ranges;
+  unsigned range = job % ctx->ranges;
+  unsigned begin = (uint64_t)all_sources.i * range / ctx->ranges;
+  unsigned end = (uint64_t)all_sources.i * (range + 1) / ctx->ranges;
+
+  struct writer *w = &ctx->fragments[job];
+  writer_open(w, NULL);
+
+  struct error err = store_open_readonly(ctx->db_file);
+  if (!err.es) {
+    err = render_cached(part, w, begin, end);
+    err = next_error(err, store_close());
+  }
+  return err;
+}
 
-  struct error err = next_error(load_state(), load_sources());
+// Renders all parts, in parallel if the opened database could be shared.
+static struct error render_scripts(struct writer *w) {
+  struct error err = {};
+  RenderContext ctx = {store_file()};
+
+  unsigned workers = pool_size();
+  ctx.ranges = all_sources.i < workers ? all_sources.i : workers;
+  if (!ctx.db_file || workers < 2 || !ctx.ranges) {
+    for (unsigned i = 0; i < RENDER_PARTS; ++i)
+      EVAL(render_cached(i, w, 0, all_sources.i));
+    return err;
+  }
+
+  unsigned n = ctx.ranges * RENDER_PARTS;
+  ctx.fragments = calloc(n, sizeof(*ctx.fragments));
+  assert(ctx.fragments);
+
+  err = pool_run(n, workers, render_fragment, &ctx);
+  for (unsigned i = 0; i < n; ++i) {
+    if (!err.es)
+      writer_write(w, ctx.fragments[i].data, ctx.fragments[i].i);
+    writer_close(&ctx.fragments[i]);
+  }
+  EVAL(w->err);
+
+  free(ctx.fragments);
+  return err;
+}
+
+// Renders the beginning of a page, the reader is imported from the given module
+// or inlined if it's NULL.
+static struct error render_head(struct writer *w, const char *reader) {
+  struct error err = {};
 
   // We provide the reader as a module script which already implied 'defer'.
-  DUMP(fp,
-       R"code(
+  DUMP(w, R"code(
 <!DOCTYPE html>
 <html lang='en'>
   <head>
     <title>%s</title>
     <meta charset='utf-8'>
     <script type='module'>
-)code"
-#ifdef READER_JS
-       R"code(
-      import {ReaderView} from '%.*s';
-)code"
-#else
-       R"code(%.*s)code"
-#endif // READER_JS
-       R"code(
+)code",
+       state.tu);
+
+  if (reader)
+    DUMP(w, R"code(
+      import {ReaderView} from '%s';
+)code",
+         reader);
+  else
+    writer_write(w, reader_js, reader_js_len);
+
+  DUMP(w, R"code(
       new ReaderView();
-    </script>)code",
-       state.tu, (int)reader_js_len, reader_js);
+    </script>)code");
 
-  // We provide data by classic scripts without 'defer' or 'async'.
-  // For a big project involving hundreds of thousands of files, the generated
-  // final HTML will be too huge to fetch and load, one can roughly split the
-  // HTML into many small pieces of scripts before serving.
-  EVAL(render_sources(fp));
-  EVAL(render_semantics(fp));
-  EVAL(render_link(fp));
-  EVAL(render_lint(fp));
-
-  DUMP(fp, R"code(
+  return err;
+}
+
+static struct error render_tail(struct writer *w) {
+  struct error err = {};
+  DUMP(w, R"code(
   </head>
   <body>
     <div></div>
   </body>
 </html>
 )code");
+  return err;
+}
+
+struct error render(FILE *fp, bool gzip) {
+  memset(&state, 0, sizeof(state));
+
+  struct error err = next_error(load_state(), load_sources());
+  if (cache_dir)
+    EVAL(make_dir(cache_dir));
+
+  struct writer w;
+  writer_open(&w, fp);
+  if (gzip)
+    EVAL(writer_gzip(&w, true));
+
+#ifdef READER_JS
+  EVAL(render_head(&w, READER_JS));
+#else
+  EVAL(render_head(&w, NULL));
+#endif // READER_JS
+
+  // We provide data by classic scripts without 'defer' or 'async'.
+  // For a big project involving hundreds of thousands of files, the generated
+  // final HTML will be too huge to fetch and load, one can render a site
+  // instead, see render_site().
+  EVAL(render_scripts(&w));
+  EVAL(render_tail(&w));
 
+  return next_error(err, writer_close(&w));
+}
+
+// Renders everything of a source into a binary file, so the reader could fetch
+// the source on demand. The file is laid out as
+//
+//   shard := path flags source semantics link lint
+//
+// where flags is a varint of which bit 0 is set for main sources, and others
+// are given by a varint length and bytes, data are blocks of encode.h.
+static void dump_block(struct writer *w, const uint8_t *data, size_t n) {
+  uint8_t buf[10];
+  struct bytes size = {.data = buf, .n = sizeof(buf)};
+  encode_varint(&size, n);
+  writer_write(w, size.data, size.i);
+  writer_write(w, data, n);
+}
+
+static struct error render_shard(struct writer *w, const Source *src) {
+  const char *path = string_get(&src->file.elem);
+  dump_block(w, (const uint8_t *)path, strlen(path));
+  writer_putc(w, !!(src->file.property & SP_TU));
+
+  // The mapped source is written as is, without a copy in between
+  const char *data;
+  size_t size;
+  struct error err = map_file(path, &data, &size);
+  dump_block(w, (const uint8_t *)data, size);
+  unmap_file(data, size);
+
+  CommonRowContext ctx = {.out = w, .binary = true};
+  EVAL(query_semantics(src->file.hash, semantics_row, &ctx));
+  EVAL(ctx.err);
+  encode_finish(&ctx.enc, &ctx.block);
+  dump_block(w, ctx.block.data, ctx.block.i);
+  bytes_clear(&ctx.block, ARRAY_DESTROY_ELEMENTS_ONLY);
+
+  EVAL(query_link(src->file.hash, link_row, &ctx));
+  EVAL(ctx.err);
+  encode_finish(&ctx.enc, &ctx.block);
+  dump_block(w, ctx.block.data, ctx.block.i);
+
+  writer_putc(w, 0); // no lint yet
+
+  encoder_clear(&ctx.enc);
+  bytes_clear(&ctx.block, ARRAY_DESTROY_ALL);
+  return next_error(err, w->err);
+}
+
+static struct error render_shards(const char *dir, bool gzip, unsigned begin,
+                                  unsigned end) {
+  struct error err = {};
+  for (unsigned i = begin; !err.es && i < end; ++i) {
+    char file[PATH_MAX];
+    snprintf(file, sizeof(file), "%s/%u.bin%s", dir,
+             all_sources.data[i].file.hash, gzip ? ".gz" : "");
+
+    FILE *fp;
+    if (!(err = open_file(file, "w", &fp)).es) {
+      // Shards are already rendered in parallel, so compressed in place
+      struct writer w;
+      writer_open(&w, fp);
+      if (gzip)
+        err = writer_gzip(&w, false);
+      if (!err.es)
+        err = render_shard(&w, &all_sources.data[i]);
+      err = next_error(err, writer_close(&w));
+      err = next_error(err, close_file(fp));
+    }
+  }
+  return err;
+}
+
+static struct error render_shards_job(unsigned job, unsigned worker,
+                                      void *obj) {
+  RenderContext *ctx = obj;
+  assert(ctx && job < ctx->ranges);
+
+  unsigned begin = (uint64_t)all_sources.i * job / ctx->ranges;
+  unsigned end = (uint64_t)all_sources.i * (job + 1) / ctx->ranges;
+
+  struct error err = store_open_readonly(ctx->db_file);
+  if (!err.es) {
+    err = render_shards(ctx->dir, ctx->gzip, begin, end);
+    err = next_error(err, store_close());
+  }
   return err;
-}
\ No newline at end of file
+}
+
+static struct error render_index(const char *dir, bool gzip) {
+  char file[PATH_MAX];
+  snprintf(file, sizeof(file), "%s/index.html", dir);
+
+  FILE *fp;
+  struct error err = open_file(file, "w", &fp);
+  if (err.es)
+    return err;
+
+  struct writer w;
+  writer_open(&w, fp);
+  EVAL(render_head(&w, READER_MODULE));
+
+  // Shards are fetched by the encoding, without probing the other one.
+  DUMP(&w, R"code(
+    <meta name='shard-encoding' content='%s'>)code",
+       gzip ? "gzip" : "identity");
+
+  // Only main sources are listed, others are found by following links.
+  for (unsigned i = 0; !err.es && i < all_sources.i; ++i) {
+    if (all_sources.data[i].file.property & SP_TU)
+      DUMP(&w, R"code(
+    <script data-id='%u' data-type='source' data-path='%s' data-main></script>)code",
+           all_sources.data[i].file.hash,
+           string_get(&all_sources.data[i].file.elem));
+  }
+
+  EVAL(render_tail(&w));
+  err = next_error(err, writer_close(&w));
+  return next_error(err, close_file(fp));
+}
+
+// Removes files rendered before into the directory, e.g. shards of sources
+// gone or of the other encoding, while leaving files of others as they are.
+static struct error clear_site(const char *dir) {
+  DIR *d = opendir(dir);
+  if (!d)
+    return (struct error){ES_FILE_OPEN, errno};
+
+  const char *reader = strrchr(READER_MODULE, '/');
+  reader = reader ? reader + 1 : READER_MODULE;
+
+  struct error err = {};
+  for (struct dirent *e; !err.es && (e = readdir(d));) {
+    size_t n = strspn(e->d_name, "0123456789");
+    const char *end = e->d_name + n;
+    bool shard = n && (!strcmp(end, ".bin") || !strcmp(end, ".bin.gz"));
+    if (!shard && strcmp(e->d_name, "index.html") && strcmp(e->d_name, reader))
+      continue;
+
+    char file[PATH_MAX];
+    snprintf(file, sizeof(file), "%s/%s", dir, e->d_name);
+    err = unlink_file(file);
+  }
+
+  closedir(d);
+  return err;
+}
+
+static struct error render_reader(const char *dir) {
+  char file[PATH_MAX];
+  snprintf(file, sizeof(file), "%s/%s", dir, READER_MODULE);
+
+  struct error err = {};
+#ifndef READER_JS
+  const char *data = reader_js;
+  size_t size = reader_js_len;
+#else
+  const char *data;
+  size_t size;
+  if ((err = map_file(READER_JS, &data, &size)).es)
+    return err;
+#endif // !READER_JS
+
+  FILE *fp;
+  if (!(err = open_file(file, "w", &fp)).es) {
+    struct writer w;
+    writer_open(&w, fp);
+    writer_write(&w, data, size);
+    err = next_error(writer_close(&w), close_file(fp));
+  }
+
+#ifdef READER_JS
+  unmap_file(data, size);
+#endif // READER_JS
+  return err;
+}
+
+struct error render_site(const char *dir, bool gzip) {
+  memset(&state, 0, sizeof(state));
+
+  struct error err = next_error(load_state(), load_sources());
+  EVAL(make_dir(dir));
+  EVAL(clear_site(dir));
+  EVAL(render_index(dir, gzip));
+  EVAL(render_reader(dir));
+
+  // Shards are rendered in parallel as well if the database could be shared.
+  RenderContext ctx = {.db_file = store_file(), .dir = dir, .gzip = gzip};
+  unsigned workers = pool_size();
+  ctx.ranges = all_sources.i < workers ? all_sources.i : workers;
+  if (!ctx.db_file || workers < 2 || !ctx.ranges)
+    EVAL(render_shards(dir, gzip, 0, all_sources.i));
+  else
+    EVAL(pool_run(ctx.ranges, workers, render_shards_job, &ctx));
+
+  return err;
+}
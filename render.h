@@ -2,9 +2,21 @@
 
 #include "error.h"
 
+#include <stdbool.h>
 #include <stdio.h>
 
-struct error render_init();
+// Fragments of sources are cached in the directory and reused by later renders
+// if it's not NULL, see render_cached().
+struct error render_init(const char *cache);
 struct error render_halt();
 
-struct error render(FILE *fp);
\ No newline at end of file
+// Renders a page, which is compressed by gzip on a thread aside if asked.
+struct error render(FILE *fp, bool gzip);
+
+// Renders a directory of an index page, the reader and a binary file per
+// source, which is fetched by the reader on demand, so the initial load stays
+// small.
+//
+// If gzip, binary files are compressed as <hash>.bin.gz, which could be served
+// as is by servers, e.g. nginx with "gzip_static always".
+struct error render_site(const char *dir, bool gzip);
\ No newline at end of file
@@ -0,0 +1,416 @@
+Context
+  setup() {
+    dir=$(mktemp -d /tmp/clang-ast-query-link.XXXXXX)
+    ./caq -c -o $dir/references.sqlite samples/references.c
+    ./caq -c -o $dir/declarations.sqlite samples/declarations.c
+    ./caq -c -o $dir/project.sqlite \
+      $dir/references.sqlite $dir/declarations.sqlite
+    ./caq -xw -o $dir/project.site \
+      $dir/references.sqlite $dir/declarations.sqlite
+    ./caq -c -j 2 -o $dir/parallel.sqlite \
+      samples/references.c samples/declarations.c
+    cat > $dir/compile_commands.json <<EOF
+[{"directory": "$PWD", "file": "samples/references.c",
+  "arguments": ["cc", "-c", "-o", "references.o", "samples/references.c"]},
+ {"directory": "$PWD", "file": "samples/declarations.c",
+  "command": "cc -c -o declarations.o samples/declarations.c"}]
+EOF
+    ./caq -c -j 2 -p $dir/compile_commands.json -o $dir/compdb.sqlite
+    ./caq -c -j 2 -p $dir/compile_commands.json -o $dir/compdb.sqlite
+    mkdir -p $dir/tree/inc $dir/tree/src
+    printf 'int tree(void);\n' > $dir/tree/inc/tree.h
+    printf '#include "tree.h"\nint tree(void) { return 0; }\n' \
+      > $dir/tree/src/tree.c
+    cat > $dir/tree/compile_commands.json <<EOF
+[{"directory": "$dir/tree", "file": "src/tree.c",
+  "arguments": ["cc", "-c", "-I", "inc", "-o", "tree.o", "src/tree.c"]}]
+EOF
+    ./caq -c -p $dir/tree/compile_commands.json -o $dir/tree.sqlite
+    printf 'static inline int scoped(int x) { return x + 1; }\n' > $dir/scope.h
+    printf '#include "scope.h"\nint main() { return scoped(0); }\n' \
+      > $dir/scope.c
+    mkdir -p $dir/shared
+    printf '#ifdef WIDE\ntypedef long width;\n' > $dir/shared/shared.h
+    printf '#else\ntypedef int width;\n#endif\n' >> $dir/shared/shared.h
+    for tu in a b; do
+      printf '#include "shared.h"\nwidth %s(width x) { return x; }\n' $tu \
+        > $dir/shared/$tu.c
+    done
+    cat > $dir/shared/compile_commands.json <<EOF
+[{"directory": "$dir/shared", "file": "a.c",
+  "arguments": ["cc", "-c", "a.c"]},
+ {"directory": "$dir/shared", "file": "b.c",
+  "arguments": ["cc", "-c", "-DWIDE", "b.c"]}]
+EOF
+    ./caq -c -j 2 -p $dir/shared/compile_commands.json -o $dir/shared.sqlite
+    mkdir -p $dir/lend
+    printf 'int lent(void);\n' > $dir/lend/lent.h
+    printf '#include "lent.h"\n/* remarked first */\nint a(void);\n' \
+      > $dir/lend/a.c
+    printf '#include "lent.h"\nint b(void);\n' > $dir/lend/b.c
+    cat > $dir/lend/compile_commands.json <<EOF
+[{"directory": "$dir/lend", "file": "a.c", "arguments": ["cc", "-c", "a.c"]},
+ {"directory": "$dir/lend", "file": "b.c", "arguments": ["cc", "-c", "b.c"]}]
+EOF
+    ./caq -c -p $dir/lend/compile_commands.json -o $dir/lend.sqlite
+    printf 'int a(void);\n' > $dir/lend/a.c
+    ./caq -c -p $dir/lend/compile_commands.json -o $dir/lend.sqlite
+    ./caq -c -o $dir/shared/a.sqlite $dir/shared/a.c
+    ./caq -c -o $dir/shared/b.sqlite -- -DWIDE $dir/shared/b.c
+    ./caq -c -o $dir/apart.sqlite $dir/shared/a.sqlite $dir/shared/b.sqlite
+    set -- references declarations shared/a shared/b
+    ./caq -c -o $dir/four.sqlite $(for tu; do echo $dir/$tu.sqlite; done)
+    for tu; do
+      ./caq -c -o $dir/serial.sqlite $dir/$tu.sqlite
+    done
+    ./caq -xt -o $dir/references.txt samples/references.c
+    ./caq -c -o $dir/text.sqlite $dir/references.txt
+    ./caq -c -o $dir/whole.sqlite $dir/scope.c
+    ./caq -c -r main -o $dir/scoped.sqlite $dir/scope.c
+  }
+  cleanup() { rm -r $dir; }
+  BeforeAll 'setup'
+  AfterAll 'cleanup'
+
+  query() {
+    sqlite3 $dir/$1.sqlite "$2"
+  }
+
+  # The number of rows of columns $3 in table $4 of either database only
+  query_diff() {
+    sqlite3 $dir/$1.sqlite "ATTACH '$dir/$2.sqlite' AS t;
+      SELECT (SELECT count(*) FROM
+        (SELECT $3 FROM $4 EXCEPT SELECT $3 FROM t.$4))
+      + (SELECT count(*) FROM
+        (SELECT $3 FROM t.$4 EXCEPT SELECT $3 FROM $4))"
+  }
+
+  query_main_semantics() {
+    echo "SELECT count(*) FROM semantics WHERE begin_src ="
+    echo "(SELECT hash FROM strings WHERE key LIKE '%$1.c')"
+  }
+
+  Describe 'Linked TUs'
+    It 'records each TU once'
+      When call query project 'SELECT count(*) FROM meta'
+      The output should eq 2
+    End
+
+    It 'records the members of each TU'
+      When call query project 'SELECT count(DISTINCT tu) FROM members'
+      The output should eq 2
+    End
+
+    It 'replaces a relinked TU'
+      relink() {
+        ./caq -c -o $dir/relink.sqlite \
+          $dir/references.sqlite $dir/declarations.sqlite
+        ./caq -c -o $dir/relink.sqlite $dir/references.sqlite 2>/dev/null
+        query relink 'SELECT count(*) FROM meta'
+      }
+      When call relink
+      The output should eq 2
+    End
+
+    Describe 'with a changed header'
+      setup_shared() {
+        mkdir -p $dir/$1
+        printf 'int shared_old(void);\n' > $dir/$1/shared.h
+        for tu in a b; do
+          printf '#include "shared.h"\nint %s(void) { return 0; }\n' $tu \
+            > $dir/$1/$tu.c
+          ./caq -c -o $dir/$1/$tu.sqlite $dir/$1/$tu.c
+        done
+        ./caq -c -o $dir/$1.sqlite $dir/$1/a.sqlite $dir/$1/b.sqlite
+        printf '\n\nint shared_new(void);\n' > $dir/$1/shared.h
+      }
+
+      relink_shared() {
+        ./caq -c -o $dir/$1/$2.sqlite $dir/$1/$2.c
+        ./caq -c -o $dir/$1.sqlite $dir/$1/$2.sqlite 2>/dev/null
+      }
+
+      query_shared_rows() {
+        query $1 "SELECT count(DISTINCT begin_row) FROM semantics
+          WHERE begin_src IN
+          (SELECT hash FROM strings WHERE key LIKE '%shared.h')"
+      }
+
+      It 'keeps rows of the header owned by TUs not relinked'
+        relink() {
+          setup_shared kept
+          relink_shared kept a
+          query_shared_rows kept
+        }
+        When call relink
+        The output should eq 2
+      End
+
+      It 'drops rows of the header owned by no TU'
+        relink() {
+          setup_shared dropped
+          relink_shared dropped a
+          relink_shared dropped b
+          query_shared_rows dropped
+        }
+        When call relink
+        The output should eq 1
+      End
+    End
+
+    It 'records the digests of sources'
+      When call query project 'SELECT count(*) FROM members WHERE digest IS NULL
+        AND src NOT IN (SELECT hash FROM strings WHERE property & 4)'
+      The output should eq 0
+    End
+
+    It 'has no duplicated semantics'
+      When call query project "SELECT count(*) FROM (SELECT 1 FROM semantics
+        GROUP BY begin_src, begin_row, begin_col, end_src, end_row, end_col
+        HAVING count(*) > 1)"
+      The output should eq 0
+    End
+  End
+
+  Describe 'TUs linked by partial databases'
+    It 'records each TU once'
+      When call query four 'SELECT count(*) FROM meta'
+      The output should eq 4
+    End
+
+    It 'has the semantics of TUs linked one by one'
+      When call query_diff four serial 'kind, name, begin_src, begin_row,
+        begin_col, end_src, end_row, end_col' semantics
+      The output should eq 0
+    End
+
+    It 'has the nodes of TUs linked one by one'
+      When call query_diff four serial \
+        'node, begin_src, begin_row, begin_col, end_src, end_row, end_col' nodes
+      The output should eq 0
+    End
+  End
+
+  Describe 'Site of TUs'
+    It 'has a data file per source of the project'
+      compare() {
+        a=$(ls $dir/project.site/*.bin | wc -l)
+        b=$(query project 'SELECT count(*) FROM strings
+          WHERE property & 1 AND NOT property & 4')
+        echo $((a-b))
+      }
+      When call compare
+      The output should eq 0
+    End
+
+    It 'leaves no temporary database'
+      When call sh -c "ls -d $dir/project.site.* 2>/dev/null"
+      The status should be failure
+    End
+  End
+
+  Describe 'TUs remarked at once'
+    It 'records each TU once'
+      When call query parallel 'SELECT count(*) FROM meta'
+      The output should eq 2
+    End
+
+    It 'has as many semantics as linked TUs'
+      compare() {
+        a=$(query parallel 'SELECT count(*) FROM semantics')
+        b=$(query project 'SELECT count(*) FROM semantics')
+        echo $((a-b))
+      }
+      When call compare
+      The output should eq 0
+    End
+
+    It 'leaves no temporary database'
+      When call sh -c "ls -d $dir/parallel.sqlite.* 2>/dev/null"
+      The status should be failure
+    End
+  End
+
+  Describe 'A single TU'
+    It 'leaves out a single TU up to date'
+      rebuild() {
+        ./caq -c -o $dir/single.sqlite samples/references.c
+        query single 'UPDATE history SET duration = 7'
+        ./caq -c -o $dir/single.sqlite samples/references.c
+        query single 'SELECT count(*) FROM history WHERE duration = 7'
+      }
+      When call rebuild
+      The output should eq 1
+    End
+
+    It 'keeps other TUs of the output'
+      relink() {
+        ./caq -c -o $dir/others.sqlite samples/references.c \
+          samples/declarations.c
+        query others 'UPDATE history SET options = 1'
+        ./caq -c -o $dir/others.sqlite samples/references.c
+        query others 'SELECT count(*) FROM meta'
+      }
+      When call relink
+      The output should eq 2
+    End
+  End
+
+  Describe 'TUs of a compilation database'
+    It 'records each TU once'
+      When call query compdb 'SELECT count(*) FROM meta'
+      The output should eq 2
+    End
+
+    It 'records the time of each TU'
+      When call query compdb 'SELECT count(*) FROM history WHERE duration > 0'
+      The output should eq 2
+    End
+
+    It 'leaves out TUs up to date'
+      rebuild() {
+        query compdb 'UPDATE history SET duration = 7'
+        ./caq -c -j 2 -p $dir/compile_commands.json -o $dir/compdb.sqlite
+        query compdb 'SELECT count(*) FROM history WHERE duration = 7'
+      }
+      When call rebuild
+      The output should eq 2
+    End
+
+    It 'records the directory of a TU as its working directory'
+      When call query tree 'SELECT cwd FROM meta'
+      The output should eq "$dir/tree"
+    End
+
+    It 'records sources found by relative paths of the directory'
+      When call query tree "SELECT count(*) FROM members WHERE src IN
+        (SELECT hash FROM strings WHERE key = '$dir/tree/inc/tree.h')"
+      The output should eq 1
+    End
+
+    It 'remarks a TU again once a new header shadows one it included'
+      rebuild() {
+        cp -r $dir/tree $dir/shadow
+        sed "s|$dir/tree|$dir/shadow|" $dir/tree/compile_commands.json \
+          > $dir/shadow/compile_commands.json
+        ./caq -c -p $dir/shadow/compile_commands.json -o $dir/shadow.sqlite
+        query shadow 'UPDATE history SET duration = 7'
+        printf 'int tree(void);\n' > $dir/shadow/src/tree.h
+        ./caq -c -p $dir/shadow/compile_commands.json -o $dir/shadow.sqlite
+        query shadow 'SELECT count(*) FROM history WHERE duration = 7'
+      }
+      When call rebuild
+      The output should eq 0
+    End
+  End
+
+  Describe 'Remarks given as values'
+    It 'records the meta as the text does'
+      When call query_diff references text 'tu, cwd' meta
+      The output should eq 0
+    End
+
+    It 'records semantics as the text does'
+      When call query_diff references text \
+        'kind, name, begin_row, begin_col, end_row, end_col' semantics
+      The output should eq 0
+    End
+
+    # Nodes without ranges are left out by linked databases
+    It 'records nodes as the text does'
+      When call query_diff references text \
+        'node, begin_row, begin_col, end_row, end_col' \
+        'nodes WHERE begin_src IS NOT NULL'
+      The output should eq 0
+    End
+  End
+
+  Describe 'A header shared by TUs remarked at once'
+    It 'has the semantics of TUs remarked apart'
+      When call query_diff shared apart 'kind, name, begin_src, begin_row,
+        begin_col, end_src, end_row, end_col' semantics
+      The output should eq 0
+    End
+
+    It 'has the nodes of TUs remarked apart'
+      When call query_diff shared apart \
+        'node, begin_src, begin_row, begin_col, end_src, end_row, end_col' nodes
+      The output should eq 0
+    End
+
+    It 'keeps rows of the header for a TU left it out'
+      When call query lend "SELECT count(*) FROM semantics WHERE begin_src IN
+        (SELECT hash FROM strings WHERE key LIKE '%lent.h')"
+      The output should not eq 0
+    End
+
+    It 'settles headers left out once their TUs are linked'
+      When call query lend 'SELECT count(*) FROM lent_headers'
+      The output should eq 0
+    End
+  End
+
+  Describe 'Sources out of the scope'
+    query_header() {
+      query $1 "SELECT count(*) FROM $2 WHERE $3 IN
+        (SELECT hash FROM strings WHERE key LIKE '%scope.h')"
+    }
+
+    It 'has semantics of the header without a scope'
+      When call query_header whole semantics begin_src
+      The output should not eq 0
+    End
+
+    It 'has no semantics of the header'
+      When call query_header scoped semantics begin_src
+      The output should eq 0
+    End
+
+    It 'keeps the inclusion of the header'
+      When call query_header scoped nodes link
+      The output should eq 1
+    End
+
+    It 'keeps semantics of the main file'
+      compare() {
+        a=$(query whole "`query_main_semantics scope`")
+        b=$(query scoped "`query_main_semantics scope`")
+        echo $((a-b))
+      }
+      When call compare
+      The output should eq 0
+    End
+  End
+
+  Describe 'Semantics of main files'
+    Parameters
+      references
+      declarations
+    End
+
+    compare() {
+      a=$(query project "`query_main_semantics $1`")
+      b=$(query $1 "`query_main_semantics $1`")
+      echo $((a-b))
+    }
+
+    It "keeps all rows of $1"
+      When call compare "$1"
+      The output should eq 0
+    End
+  End
+
+  Describe 'Number of jobs'
+    Parameters
+      x
+      -1
+      2x
+    End
+
+    It "is rejected if given as $1"
+      When call ./caq -c -j "$1" -o $dir/jobs.sqlite samples/references.c
+      The status should be failure
+      The stderr should include 'invalid number of jobs'
+    End
+  End
+End
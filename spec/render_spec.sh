@@ -0,0 +1,113 @@
+Context
+  setup() {
+    dir=$(mktemp -d /tmp/clang-ast-query-render.XXXXXX)
+    ./caq -c -o $dir/references.sqlite samples/references.c
+    ./caq -o $dir/memory.html samples/references.c
+    ./caq -o $dir/data.html $dir/references.sqlite
+    ./caq -xw -o $dir/site $dir/references.sqlite
+    ./caq -z -o $dir/data.html.gz $dir/references.sqlite
+    ./caq -k $dir/cache -o $dir/cold.html $dir/references.sqlite
+    ./caq -k $dir/cache -o $dir/warm.html $dir/references.sqlite
+    ./caq -z -xw -o $dir/site.gz $dir/references.sqlite
+    ./caq -z -xw -o $dir/again $dir/references.sqlite
+    touch $dir/again/notes.txt
+    ./caq -xw -o $dir/again $dir/references.sqlite
+  }
+  cleanup() { rm -r $dir; }
+  BeforeAll 'setup'
+  AfterAll 'cleanup'
+
+  Describe 'Rendered HTML'
+    It 'is the same whether rendered in parallel or not'
+      When call cmp $dir/memory.html $dir/data.html
+      The status should be success
+    End
+
+    It 'is the same when compressed'
+      When call sh -c "zcat $dir/data.html.gz | cmp $dir/data.html"
+      The status should be success
+    End
+
+    It 'is the same when rendered with cached fragments'
+      compare() {
+        cmp $dir/data.html $dir/cold.html && cmp $dir/data.html $dir/warm.html
+      }
+      When call compare
+      The status should be success
+    End
+
+    It 'caches fragments of all parts of sources'
+      compare() {
+        a=$(ls $dir/cache | wc -l)
+        b=$(sqlite3 $dir/references.sqlite \
+          'SELECT count(*) * 4 FROM sources')
+        echo $((a-b))
+      }
+      When call compare
+      The output should eq 0
+    End
+  End
+
+  Describe 'Rendered site'
+    It 'has an index'
+      The path "$dir/site/index.html" should be file
+    End
+
+    It 'has a data file per source'
+      compare() {
+        a=$(ls $dir/site/*.bin | wc -l)
+        b=$(sqlite3 $dir/references.sqlite \
+          'SELECT count(*) FROM strings WHERE property & 1 AND NOT property & 4')
+        echo $((a-b))
+      }
+      When call compare
+      The output should eq 0
+    End
+
+    It 'records the encoding of data files by the index'
+      When call grep -c "name='shard-encoding' content='gzip'" \
+        $dir/site.gz/index.html
+      The output should eq 1
+    End
+
+    It 'has the same data files when compressed'
+      compare() {
+        for i in $dir/site/*.bin; do
+          zcat $dir/site.gz/${i##*/}.gz | cmp $i || return
+        done
+      }
+      When call compare
+      The status should be success
+    End
+
+    It 'has the reader imported by the index'
+      reader() {
+        sed -n "s|.*import {ReaderView} from '\\(.*\\)';|\\1|p" \
+          $dir/site/index.html
+      }
+      The path "$dir/site/$(reader)" should be file
+    End
+
+    It 'has no data files rendered before into the directory'
+      When call find $dir/again -name '*.bin.gz'
+      The output should eq ''
+    End
+
+    It 'keeps other files in the directory'
+      The path "$dir/again/notes.txt" should be file
+    End
+
+    It 'is the same when rendered again into the directory'
+      When call diff -r -x notes.txt $dir/site $dir/again
+      The status should be success
+    End
+  End
+
+  Describe 'Compressed output'
+    It 'is rejected unless HTML'
+      When call ./caq -z -c -o $dir/gzip.sqlite $dir/references.sqlite
+      The status should be failure
+      The stderr should include 'only for HTML'
+    End
+  End
+End
@@ -16,8 +16,8 @@
 #define if_prepared_stmt(sql, ...)                                             \
   do {                                                                         \
     assert(state % 2 == 1 && "Should be in open");                             \
-    static sqlite3_stmt *stmt;                                                 \
-    static unsigned last_state;                                                \
+    static thread_local sqlite3_stmt *stmt;                                    \
+    static thread_local unsigned last_state;                                   \
     __VA_ARGS__;                                                               \
     if (last_state != state) {                                                 \
       last_state = state;                                                      \
@@ -99,13 +99,13 @@ static_assert(sizeof(long) <= 8, "Should be filled in sqlite3 integer");
 #define COL_TEXT(k) (const char *)sqlite3_column_text(stmt, k)
 #define COL_SIZE(k) sqlite3_column_bytes(stmt, k)
 
-#define OPEN_DB(file)                                                          \
+#define OPEN_DB(file, flags)                                                   \
   do {                                                                         \
     assert(state % 2 == 0 && "Should be closed");                              \
     db = NULL;                                                                 \
     memset(stmts, 0, sizeof(stmts));                                           \
     errmsg = NULL;                                                             \
-    if ((errcode = sqlite3_open(file, &db)))                                   \
+    if ((errcode = sqlite3_open_v2(file, &db, flags, NULL)))                   \
       fprintf(stderr, "%s:%d: sqlite3_open(%s) error(%d): %s\n", __func__,     \
               __LINE__, file, errcode, sqlite3_errstr(errcode));               \
     else                                                                       \
@@ -153,30 +153,198 @@ static_assert(sizeof(long) <= 8, "Should be filled in sqlite3 integer");
 
 #define ERROR_OF(x) (errcode ? (struct error){x, errcode} : (struct error){})
 
-static sqlite3 *db;
-static sqlite3_stmt *stmts[MAX_STMT_SIZE];
-static char *errmsg;
-static int errcode;
-static unsigned state; // increasing, even for closed, odd for being open
+// The connection is per thread, so workers could open their own stores.
+static thread_local sqlite3 *db;
+static thread_local sqlite3_stmt *stmts[MAX_STMT_SIZE];
+static thread_local char *errmsg;
+static thread_local int errcode;
+static thread_local unsigned state; // increasing, even for closed, odd for open
+
+// Rows of meta, semantics and nodes are referred to by their ids, which are
+// declared as primary keys so VACUUM keeps them.
+#define META_TABLE                                                             \
+  "meta ("                                                                     \
+  " id INTEGER PRIMARY KEY,"                                                   \
+  " cwd TEXT,"                                                                 \
+  " tu TEXT,"                                                                  \
+  " ts INTEGER)"
+
+#define STRINGS_TABLE                                                          \
+  "strings ("                                                                  \
+  " key TEXT PRIMARY KEY,"                                                     \
+  " property INTEGER,"                                                         \
+  " hash INTEGER)"
+
+#define SEMANTICS_TABLE                                                        \
+  "semantics ("                                                                \
+  " id INTEGER PRIMARY KEY,"                                                   \
+  " kind TEXT,"                                                                \
+  " name TEXT,"                                                                \
+  " begin_src INTEGER,"                                                        \
+  " begin_row INTEGER,"                                                        \
+  " begin_col INTEGER,"                                                        \
+  " end_src INTEGER,"                                                          \
+  " end_row INTEGER,"                                                          \
+  " end_col INTEGER)"
+
+#define NODES_TABLE                                                            \
+  "nodes ("                                                                    \
+  " id INTEGER PRIMARY KEY,"                                                   \
+  " node INTEGER,"                                                             \
+  " ptr INTEGER,"                                                              \
+  " prev_ptr INTEGER,"                                                         \
+  " begin_src INTEGER,"                                                        \
+  " begin_row INTEGER,"                                                        \
+  " begin_col INTEGER,"                                                        \
+  " end_src INTEGER,"                                                          \
+  " end_row INTEGER,"                                                          \
+  " end_col INTEGER,"                                                          \
+  " src INTEGER,"                                                              \
+  " row INTEGER,"                                                              \
+  " col INTEGER,"                                                              \
+  "link INTEGER)"
+
+// The content digest of each source at the time of storing.
+#define SOURCES_TABLE                                                          \
+  "sources ("                                                                  \
+  " src INTEGER PRIMARY KEY,"                                                  \
+  " digest INTEGER)"
+
+// The digests of each source and of its rows of each part of pages, which key
+// the fragments of the pages, see render.c. The digest of a source is the one
+// at the time of storing, by the TU linked last including it if linked.
+#define DIGESTS_TABLE                                                          \
+  "digests ("                                                                  \
+  " src INTEGER PRIMARY KEY,"                                                  \
+  " source INTEGER,"                                                           \
+  " semantics INTEGER,"                                                        \
+  " link INTEGER)"
+
+// The manifest of sources included by each TU, which exists in linked
+// databases only, to tell TUs including changed sources.
+#define MEMBERS_TABLE                                                          \
+  "members ("                                                                  \
+  " tu TEXT,"                                                                  \
+  " src INTEGER,"                                                              \
+  " digest INTEGER,"                                                           \
+  " UNIQUE (tu, src))"
+
+// The time of remarking each TU in milliseconds and the digest of its options,
+// which are kept by the output across builds to schedule TUs, and to tell the
+// ones up to date.
+#define HISTORY_TABLE                                                          \
+  "history ("                                                                  \
+  " tu TEXT PRIMARY KEY,"                                                      \
+  " duration INTEGER,"                                                         \
+  " options INTEGER)"
+
+// Headers left out by each TU as remarked by another one, the lender, whose
+// rows of them are owned by the TU as well once both are linked. Entries are
+// dropped once the lender is linked, so only pending ones are kept.
+#define LENT_HEADERS_TABLE                                                     \
+  "lent_headers ("                                                             \
+  " tu TEXT,"                                                                  \
+  " src INTEGER,"                                                              \
+  " lender TEXT)"
+
+// The TUs contributing each row of a table, by the ids of both the row and the
+// TU in meta, which exist in linked databases only. The number of owners is
+// the reference count of a row, which is dropped once no TU owns it, so
+// relinking a TU leaves the rows of others as they were.
+#define OWNERS_TABLE(table, ...)                                               \
+  table "_owners ("                                                            \
+        " row INTEGER,"                                                        \
+        " tu INTEGER," __VA_ARGS__                                             \
+        " PRIMARY KEY (row, tu)) WITHOUT ROWID"
+
+// Pointers of nodes are addresses unique within their TUs only, so linked
+// databases keep them by the owners, i.e. per TU, rather than by the nodes.
+#define POINTERS_COLUMNS " ptr INTEGER, prev_ptr INTEGER,"
+#define NO_POINTERS(x) ""
+#define POINTERS(x) ", " x "ptr, " x "prev_ptr"
 
 static void store_meta();
 static void store_strings();
 static void store_semantics();
 static void store_nodes();
+static void store_sources();
+static void store_lent_headers();
+static void store_digests();
+static void link_tables();
+static void link_incoming(unsigned tables);
+static void unlink_stale();
+static void link_rows(unsigned tables);
+
+// Digests rows in any order, as a sum of the digests of the values of each.
+static void row_digest_step(sqlite3_context *ctx, int n, sqlite3_value **v) {
+  uint64_t *sum = sqlite3_aggregate_context(ctx, sizeof(*sum));
+  if (!sum)
+    return sqlite3_result_error_nomem(ctx);
+
+  uint64_t digest = 0;
+  for (int i = 0; i < n; ++i) {
+    uint64_t value[] = {digest, sqlite3_value_type(v[i])};
+    if (value[1] == SQLITE_TEXT)
+      value[1] = (uint64_t)hash(sqlite3_value_text(v[i]),
+                                sqlite3_value_bytes(v[i]));
+    else if (value[1] == SQLITE_INTEGER)
+      value[1] = sqlite3_value_int64(v[i]);
+    digest = (uint64_t)hash(value, sizeof(value));
+  }
+  *sum += digest;
+}
+
+static void row_digest_final(sqlite3_context *ctx) {
+  uint64_t *sum = sqlite3_aggregate_context(ctx, 0);
+  sqlite3_result_int64(ctx, sum ? (sqlite3_int64)*sum : 0);
+}
+
+#define CREATE_FUNCTIONS()                                                     \
+  do {                                                                         \
+    if (!errcode &&                                                            \
+        (errcode = sqlite3_create_function_v2(                                 \
+             db, "row_digest", -1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,   \
+             NULL, row_digest_step, row_digest_final, NULL)))                  \
+      fprintf(stderr, "%s:%d: sqlite3_create_function error(%d): %s\n",        \
+              __func__, __LINE__, errcode, sqlite3_errstr(errcode));           \
+  } while (0)
 
 struct error store_open(const char *db_file) {
-  OPEN_DB(db_file);
+  OPEN_DB(db_file, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+  CREATE_FUNCTIONS();
   EXEC_SQL("PRAGMA synchronous = OFF");
   EXEC_SQL("PRAGMA journal_mode = MEMORY");
   return ERROR_OF(ES_STORE_OPEN);
 }
 
+struct error store_open_durable(const char *db_file) {
+  OPEN_DB(db_file, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+  CREATE_FUNCTIONS();
+  EXEC_SQL("PRAGMA synchronous = NORMAL");
+  EXEC_SQL("PRAGMA journal_mode = DELETE");
+  return ERROR_OF(ES_STORE_OPEN);
+}
+
+struct error store_open_readonly(const char *db_file) {
+  OPEN_DB(db_file, SQLITE_OPEN_READONLY);
+  return ERROR_OF(ES_STORE_OPEN);
+}
+
+const char *store_file() {
+  assert(state % 2 == 1 && "Should be in open");
+  const char *file = sqlite3_db_filename(db, "main");
+  return file && *file ? file : NULL;
+}
+
 struct error store() {
   EXEC_SQL("BEGIN TRANSACTION");
   store_meta();
   store_strings();
   store_semantics();
   store_nodes();
+  store_sources();
+  store_lent_headers();
+  store_digests();
   EXEC_SQL("END TRANSACTION");
   return ERROR_OF(ES_STORE);
 }
@@ -186,11 +354,58 @@ struct error store_close() {
   return ERROR_OF(ES_STORE_CLOSE);
 }
 
+// Runs the statement even after an error, which is kept as the first one.
+static void exec_anyway(const char *sql) {
+  const int first = errcode;
+  errcode = 0;
+  EXEC_SQL(sql);
+  if (first)
+    errcode = first;
+}
+
+struct error store_link(const char *db_file) {
+  QUERY("ATTACH DATABASE ? AS input");
+  FILL_TEXT(1, db_file);
+  END_QUERY();
+  if (errcode)
+    return ERROR_OF(ES_STORE_LINK);
+
+  // The input is a linked one as well if having members, e.g. a partially
+  // linked result, otherwise it might be stored without sources by old ones.
+  // Linked ones have owners of rows unless linked by old ones, and old ones
+  // have no lent headers.
+  unsigned tables = 0;
+  QUERY("SELECT name FROM input.sqlite_master"
+        " WHERE type = 'table'"
+        " AND name IN ('members', 'sources', 'semantics_owners',"
+        " 'lent_headers')");
+  END_QUERY({
+    const char *name = COL_TEXT(0);
+    tables |= !strcmp(name, "members")            ? 1
+              : !strcmp(name, "sources")          ? 2
+              : !strcmp(name, "semantics_owners") ? 4
+                                                  : 8;
+  });
+
+  // TUs linked already are replaced as a whole, so only the rows they owned
+  // alone are touched.
+  EXEC_SQL("BEGIN TRANSACTION");
+  link_tables();
+  link_incoming(tables);
+  unlink_stale();
+  link_rows(tables);
+  EXEC_SQL("END TRANSACTION");
+
+  // A failed link leaves the transaction open, which is rolled back as a
+  // whole, and the input is detached anyway.
+  if (!sqlite3_get_autocommit(db))
+    exec_anyway("ROLLBACK TRANSACTION");
+  exec_anyway("DETACH DATABASE input");
+  return ERROR_OF(ES_STORE_LINK);
+}
+
 static void store_meta() {
-  EXEC_SQL("CREATE TABLE meta ("
-           " cwd TEXT,"
-           " tu TEXT,"
-           " ts INTEGER)");
+  EXEC_SQL("CREATE TABLE " META_TABLE);
 
   INSERT_INTO(meta, CWD, TU, TS);
   FILL_TEXT(CWD, cwd);
@@ -200,10 +415,7 @@ static void store_meta() {
 }
 
 static void store_strings() {
-  EXEC_SQL("CREATE TABLE strings ("
-           " key TEXT PRIMARY KEY,"
-           " property INTEGER,"
-           " hash INTEGER)");
+  EXEC_SQL("CREATE TABLE " STRINGS_TABLE);
 
   StringSet_for(all_strings, i) {
     if (errcode)
@@ -218,15 +430,7 @@ static void store_strings() {
 }
 
 static void store_semantics() {
-  EXEC_SQL("CREATE TABLE semantics ("
-           " kind TEXT,"
-           " name TEXT,"
-           " begin_src INTEGER,"
-           " begin_row INTEGER,"
-           " begin_col INTEGER,"
-           " end_src INTEGER,"
-           " end_row INTEGER,"
-           " end_col INTEGER)");
+  EXEC_SQL("CREATE TABLE " SEMANTICS_TABLE);
 
   for (unsigned i = 0; i < all_semantics.i && !errcode; ++i) {
     const char *kind = string_get(&all_semantics.data[i].kind->elem);
@@ -248,20 +452,7 @@ static void store_semantics() {
 }
 
 static void store_nodes() {
-  EXEC_SQL("CREATE TABLE nodes ("
-           " node INTEGER,"
-           " ptr INTEGER,"
-           " prev_ptr INTEGER,"
-           " begin_src INTEGER,"
-           " begin_row INTEGER,"
-           " begin_col INTEGER,"
-           " end_src INTEGER,"
-           " end_row INTEGER,"
-           " end_col INTEGER,"
-           " src INTEGER,"
-           " row INTEGER,"
-           " col INTEGER,"
-           "link INTEGER)");
+  EXEC_SQL("CREATE TABLE " NODES_TABLE);
 
   for (unsigned i = 0; i < all_nodes.i && !errcode; ++i) {
     INSERT_INTO(nodes, NODE, PTR, PREV_PTR, BEGIN_SRC, BEGIN_ROW, BEGIN_COL,
@@ -306,6 +497,401 @@ static void store_nodes() {
   }
 }
 
+static void store_sources() {
+  EXEC_SQL("CREATE TABLE " SOURCES_TABLE);
+
+  StringSet_for(all_strings, i) {
+    if (errcode)
+      break;
+
+    const String *file = &all_strings.data[i];
+    if (!(file->property & SP_FILE) || file->property & SP_BUILTIN)
+      continue;
+
+    // Files unable to read, e.g. from a textual AST elsewhere, are left out.
+    uint64_t digest;
+    if (digest_file(string_get(&file->elem), &digest).es)
+      continue;
+
+    INSERT_INTO(sources, SRC, DIGEST);
+    FILL_INT(SRC, file->hash);
+    FILL_INT(DIGEST, (long)digest);
+    END_INSERT_INTO();
+  }
+}
+
+// Digests the given sources, i.e. a query of src, and their rows into digests,
+// where digests of the sources are given by a query of src and digest. Sources
+// without rows of a part are of the digest of no rows.
+#define DIGEST_SOURCES(srcs, sources)                                          \
+  do {                                                                         \
+    QUERY("INSERT INTO digests (src, source, semantics, link)"                 \
+          " SELECT s.src, d.digest, ifnull(a.digest, 0), ifnull(b.digest, 0)"  \
+          " FROM (" srcs ") AS s"                                              \
+          " LEFT JOIN (" sources ") AS d ON d.src = s.src"                     \
+          " LEFT JOIN (SELECT begin_src AS src, row_digest(begin_row,"         \
+          " begin_col, end_row, end_col, kind, name) AS digest"                \
+          " FROM semantics WHERE begin_src IN (" srcs ")"                      \
+          " GROUP BY begin_src) AS a ON a.src = s.src"                         \
+          " LEFT JOIN (SELECT begin_src AS src, row_digest(begin_row,"         \
+          " begin_col, end_row, end_col, link) AS digest"                      \
+          " FROM nodes WHERE begin_src IN (" srcs ")"                          \
+          " AND (node & 0xFFFF) = ?2"                                          \
+          " GROUP BY begin_src) AS b ON b.src = s.src");                       \
+    FILL_INT(1, SP_FILE);                                                      \
+    FILL_INT(2, TOK_InclusionDirective);                                       \
+    END_QUERY();                                                               \
+  } while (0)
+
+static void store_digests() {
+  EXEC_SQL("CREATE TABLE " DIGESTS_TABLE);
+  DIGEST_SOURCES("SELECT hash AS src FROM strings WHERE (property & ?1)",
+                 "SELECT src, digest FROM sources");
+}
+
+// Tables of old ones have implicit rowids only, which become their ids, so
+// owners referring to them are kept.
+#define ADD_ID(table, create, columns)                                         \
+  do {                                                                         \
+    unsigned n = 0, ids = 0;                                                   \
+    QUERY("SELECT count(*), ifnull(sum(name = 'id'), 0)"                       \
+          " FROM pragma_table_info('" table "', 'main')");                     \
+    END_QUERY({                                                                \
+      PICK_INT(0, n);                                                          \
+      PICK_INT(1, ids);                                                        \
+    });                                                                        \
+    if (n && !ids) {                                                           \
+      EXEC_SQL("ALTER TABLE " table " RENAME TO old_" table);                  \
+      EXEC_SQL("CREATE TABLE " create);                                        \
+      EXEC_SQL("INSERT INTO " table " (id, " columns ")"                       \
+               " SELECT rowid, " columns " FROM old_" table);                  \
+      EXEC_SQL("DROP TABLE old_" table);                                       \
+    }                                                                          \
+  } while (0)
+
+static void store_lent_headers() {
+  EXEC_SQL("CREATE TABLE " LENT_HEADERS_TABLE);
+
+  for (unsigned i = 0; i < all_lent_headers.i && !errcode; ++i) {
+    INSERT_INTO(lent_headers, TU, SRC, LENDER);
+    FILL_TEXT(TU, tu);
+    FILL_INT(SRC, all_lent_headers.data[i].src->hash);
+    FILL_TEXT(LENDER, all_lent_headers.data[i].lender);
+    END_INSERT_INTO();
+  }
+}
+
+static void link_tables() {
+  ADD_ID("meta", META_TABLE, "cwd, tu, ts");
+  ADD_ID("semantics", SEMANTICS_TABLE,
+         "kind, name, begin_src, begin_row, begin_col, end_src, end_row,"
+         " end_col");
+  ADD_ID("nodes", NODES_TABLE,
+         "node, ptr, prev_ptr, begin_src, begin_row, begin_col, end_src,"
+         " end_row, end_col, src, row, col, link");
+
+  // Tables of the output as of the input, see store_link()
+  unsigned tables = 0;
+  QUERY("SELECT name FROM sqlite_master"
+        " WHERE type = 'table'"
+        " AND name IN ('members', 'sources', 'semantics_owners')");
+  END_QUERY({
+    const char *name = COL_TEXT(0);
+    tables |= !strcmp(name, "members") ? 1 : !strcmp(name, "sources") ? 2 : 4;
+  });
+
+  EXEC_SQL("CREATE TABLE IF NOT EXISTS " META_TABLE);
+  EXEC_SQL("CREATE TABLE IF NOT EXISTS " STRINGS_TABLE);
+  EXEC_SQL("CREATE TABLE IF NOT EXISTS " SEMANTICS_TABLE);
+  EXEC_SQL("CREATE TABLE IF NOT EXISTS " NODES_TABLE);
+  EXEC_SQL("CREATE TABLE IF NOT EXISTS " MEMBERS_TABLE);
+  EXEC_SQL("CREATE TABLE IF NOT EXISTS " LENT_HEADERS_TABLE);
+  EXEC_SQL("CREATE TABLE IF NOT EXISTS " DIGESTS_TABLE);
+  EXEC_SQL("CREATE TABLE IF NOT EXISTS " OWNERS_TABLE("semantics"));
+  EXEC_SQL("CREATE TABLE IF NOT EXISTS "
+           OWNERS_TABLE("nodes", POINTERS_COLUMNS));
+  EXEC_SQL("CREATE INDEX IF NOT EXISTS members_src ON members (src)");
+  EXEC_SQL("CREATE INDEX IF NOT EXISTS meta_tu ON meta (tu)");
+  EXEC_SQL("CREATE INDEX IF NOT EXISTS semantics_owners_tu"
+           " ON semantics_owners (tu)");
+  EXEC_SQL("CREATE INDEX IF NOT EXISTS nodes_owners_tu ON nodes_owners (tu)");
+
+  // Owners of nodes by old ones have no pointers, which are left unknown.
+  bool pointers = false;
+  QUERY("SELECT 1 FROM pragma_table_info('nodes_owners', 'main')"
+        " WHERE name = 'ptr'");
+  END_QUERY({ pointers = true; });
+  if (!pointers) {
+    EXEC_SQL("ALTER TABLE nodes_owners ADD COLUMN ptr INTEGER");
+    EXEC_SQL("ALTER TABLE nodes_owners ADD COLUMN prev_ptr INTEGER");
+  }
+
+  // Rows linked by old ones are owned by the TUs including their sources, and
+  // pointers of their nodes can't tell the TUs.
+  if ((tables & 5) == 1) {
+    EXEC_SQL("INSERT INTO semantics_owners (row, tu)"
+             " SELECT r.id, m.id FROM semantics AS r"
+             " JOIN members AS c ON c.src = r.begin_src"
+             " JOIN meta AS m ON m.tu = c.tu");
+    EXEC_SQL("INSERT INTO nodes_owners (row, tu)"
+             " SELECT r.id, m.id FROM nodes AS r"
+             " JOIN members AS c ON c.src = r.begin_src"
+             " JOIN meta AS m ON m.tu = c.tu");
+    EXEC_SQL("UPDATE nodes SET ptr = NULL, prev_ptr = NULL");
+  }
+
+  // Outputs stored alone, e.g. a single TU by old ones, become linked ones of
+  // their only TU, as if linked into an empty one. Nothing is done for empty
+  // ones.
+  if (!(tables & 5)) {
+    EXEC_SQL("DELETE FROM digests");
+    EXEC_SQL("DELETE FROM semantics WHERE id NOT IN"
+             " (SELECT min(id) FROM semantics GROUP BY"
+             " begin_src, begin_row, begin_col, end_src, end_row, end_col)");
+    EXEC_SQL("DELETE FROM nodes WHERE begin_src IS NULL OR id NOT IN"
+             " (SELECT min(id) FROM nodes GROUP BY"
+             " node, begin_src, begin_row, begin_col, end_src, end_row,"
+             " end_col)");
+    EXEC_SQL("INSERT INTO semantics_owners (row, tu)"
+             " SELECT r.id, m.id FROM semantics AS r, meta AS m");
+    EXEC_SQL("INSERT INTO nodes_owners (row, tu, ptr, prev_ptr)"
+             " SELECT r.id, m.id, r.ptr, r.prev_ptr FROM nodes AS r, meta AS m");
+    EXEC_SQL("UPDATE nodes SET ptr = NULL, prev_ptr = NULL");
+
+    if (tables & 2) {
+      QUERY("INSERT INTO members"
+            " SELECT m.tu, s.hash, d.digest"
+            " FROM meta AS m, strings AS s"
+            " LEFT JOIN sources AS d ON d.src = s.hash"
+            " WHERE (s.property & ?)");
+      FILL_INT(1, SP_FILE);
+      END_QUERY();
+      EXEC_SQL("DROP TABLE sources");
+    } else {
+      QUERY("INSERT INTO members"
+            " SELECT m.tu, s.hash, NULL"
+            " FROM meta AS m, strings AS s"
+            " WHERE (s.property & ?)");
+      FILL_INT(1, SP_FILE);
+      END_QUERY();
+    }
+  }
+
+  // Rows from shared headers are deduplicated by their ranges, the indices
+  // also serve the per source queries which are ordered by positions.
+  EXEC_SQL("CREATE UNIQUE INDEX IF NOT EXISTS semantics_range ON semantics"
+           " (begin_src, begin_row, begin_col, end_src, end_row, end_col)");
+  EXEC_SQL("CREATE UNIQUE INDEX IF NOT EXISTS nodes_range ON nodes"
+           " (node, begin_src, begin_row, begin_col, end_src, end_row,"
+           " end_col)");
+}
+
+static void link_incoming(unsigned tables) {
+  EXEC_SQL("CREATE TEMP TABLE incoming ("
+           " tu TEXT,"
+           " src INTEGER,"
+           " digest INTEGER)");
+
+  switch (tables & 3) {
+  case 1:
+  case 3:
+    EXEC_SQL("INSERT INTO incoming"
+             " SELECT tu, src, digest FROM input.members");
+    break;
+
+  case 2:
+    QUERY("INSERT INTO incoming"
+          " SELECT m.tu, s.hash, d.digest"
+          " FROM input.meta AS m, input.strings AS s"
+          " LEFT JOIN input.sources AS d ON d.src = s.hash"
+          " WHERE (s.property & ?)");
+    FILL_INT(1, SP_FILE);
+    END_QUERY();
+    break;
+
+  default:
+    QUERY("INSERT INTO incoming"
+          " SELECT m.tu, s.hash, NULL"
+          " FROM input.meta AS m, input.strings AS s"
+          " WHERE (s.property & ?)");
+    FILL_INT(1, SP_FILE);
+    END_QUERY();
+    break;
+  }
+}
+
+// Drops the owners of the given table by the relinked TUs, then the rows
+// owned by no TU any more.
+#define UNLINK_ROWS(table)                                                     \
+  do {                                                                         \
+    EXEC_SQL("CREATE TEMP TABLE unowned AS"                                    \
+             " SELECT row FROM " table "_owners"                               \
+             " WHERE tu IN (SELECT tu FROM relinked)");                        \
+    EXEC_SQL("DELETE FROM " table "_owners"                                    \
+             " WHERE tu IN (SELECT tu FROM relinked)");                        \
+    EXEC_SQL("DELETE FROM " table " WHERE id IN"                               \
+             " (SELECT row FROM unowned EXCEPT"                                \
+             " SELECT row FROM " table "_owners"                               \
+             " WHERE row IN (SELECT row FROM unowned))");                      \
+    EXEC_SQL("DROP TABLE temp.unowned");                                       \
+  } while (0)
+
+static void unlink_stale() {
+  // TUs linked already, and sources they included.
+  EXEC_SQL("CREATE TEMP TABLE relinked AS"
+           " SELECT id AS tu FROM meta"
+           " WHERE tu IN (SELECT tu FROM input.meta)");
+  EXEC_SQL("CREATE TEMP TABLE stale AS"
+           " SELECT DISTINCT src FROM members"
+           " WHERE tu IN (SELECT tu FROM input.meta)");
+
+  UNLINK_ROWS("semantics");
+  UNLINK_ROWS("nodes");
+  EXEC_SQL("DELETE FROM members"
+           " WHERE tu IN (SELECT tu FROM input.meta)");
+  EXEC_SQL("DELETE FROM lent_headers"
+           " WHERE tu IN (SELECT tu FROM input.meta)");
+  EXEC_SQL("DELETE FROM meta"
+           " WHERE tu IN (SELECT tu FROM input.meta)");
+}
+
+#define SAME_RANGE(a, b)                                                       \
+  " " a ".begin_src IS " b ".begin_src AND " a ".begin_row IS " b ".begin_row" \
+  " AND " a ".begin_col IS " b ".begin_col AND " a ".end_src IS " b ".end_src" \
+  " AND " a ".end_row IS " b ".end_row AND " a ".end_col IS " b ".end_col"
+
+// Rows of the input are owned by the TUs owning them in the input, or by the
+// TUs including their sources if linked by old ones, or by the only TU. The
+// given columns of pointers are carried with the owners.
+#define LINK_OWNERS(table, same_row, pointers, tables)                         \
+  do {                                                                         \
+    if ((tables) & 4)                                                          \
+      EXEC_SQL("INSERT OR IGNORE INTO " table "_owners"                        \
+               " (row, tu" pointers("") ")"                                    \
+               " SELECT r.id, m.id" pointers("o.")                             \
+               " FROM input." table "_owners AS o"                             \
+               " JOIN input." table " AS i ON i.id = o.row"                    \
+               " JOIN " table " AS r ON " same_row                             \
+               " JOIN input.meta AS t ON t.id = o.tu"                          \
+               " JOIN meta AS m ON m.tu = t.tu");                              \
+    else if ((tables) & 1)                                                     \
+      EXEC_SQL("INSERT OR IGNORE INTO " table "_owners (row, tu)"              \
+               " SELECT r.id, m.id FROM input." table " AS i"                  \
+               " JOIN " table " AS r ON " same_row                             \
+               " JOIN incoming AS c ON c.src = i.begin_src"                    \
+               " JOIN meta AS m ON m.tu = c.tu");                              \
+    else                                                                       \
+      EXEC_SQL("INSERT OR IGNORE INTO " table "_owners"                        \
+               " (row, tu" pointers("") ")"                                    \
+               " SELECT r.id, m.id" pointers("i.")                             \
+               " FROM input." table " AS i"                                    \
+               " JOIN " table " AS r ON " same_row                             \
+               " JOIN meta AS m ON m.tu IN (SELECT tu FROM input.meta)");      \
+  } while (0)
+
+// Rows of lent headers owned by the lenders are owned by the TUs left them out
+// as well, so they are kept while any of the TUs is.
+#define LEND_ROWS(table)                                                       \
+  EXEC_SQL("INSERT OR IGNORE INTO " table "_owners (row, tu)"                  \
+           " SELECT o.row, b.id FROM lent_headers AS l"                        \
+           " JOIN meta AS a ON a.tu = l.lender"                                \
+           " JOIN meta AS b ON b.tu = l.tu"                                    \
+           " JOIN " table "_owners AS o ON o.tu = a.id"                        \
+           " JOIN " table " AS r ON r.id = o.row AND r.begin_src = l.src")
+
+static void link_rows(unsigned tables) {
+  EXEC_SQL("INSERT INTO meta (cwd, tu, ts)"
+           " SELECT cwd, tu, ts FROM input.meta");
+
+  EXEC_SQL("INSERT INTO strings"
+           " SELECT key, property, hash FROM input.strings WHERE true"
+           " ON CONFLICT (key) DO UPDATE"
+           " SET property = property | excluded.property");
+
+  EXEC_SQL("INSERT OR IGNORE INTO semantics (kind, name, begin_src, begin_row,"
+           " begin_col, end_src, end_row, end_col)"
+           " SELECT kind, name, begin_src, begin_row, begin_col,"
+           " end_src, end_row, end_col"
+           " FROM input.semantics");
+  LINK_OWNERS("semantics", SAME_RANGE("r", "i"), NO_POINTERS, tables);
+
+  // Nodes without ranges can't be told apart across TUs, so they are left out.
+  // Links are hashes of the included files, which are the same in all TUs.
+  EXEC_SQL("INSERT OR IGNORE INTO nodes (node, begin_src, begin_row,"
+           " begin_col, end_src, end_row, end_col, src, row, col, link)"
+           " SELECT node, begin_src, begin_row, begin_col,"
+           " end_src, end_row, end_col, src, row, col, link"
+           " FROM input.nodes"
+           " WHERE begin_src IS NOT NULL");
+  LINK_OWNERS("nodes", "r.node = i.node AND" SAME_RANGE("r", "i"), POINTERS,
+              tables);
+
+  EXEC_SQL("INSERT OR IGNORE INTO members"
+           " SELECT tu, src, digest FROM incoming");
+
+  // Lent headers are settled once their lenders are linked, which might be
+  // linked by either the input or the output.
+  if (tables & 8)
+    EXEC_SQL("INSERT INTO lent_headers"
+             " SELECT tu, src, lender FROM input.lent_headers");
+  LEND_ROWS("semantics");
+  LEND_ROWS("nodes");
+  EXEC_SQL("DELETE FROM lent_headers"
+           " WHERE lender IN (SELECT tu FROM meta)");
+
+  // Sources no longer included by any TU are not files of the project.
+  QUERY("UPDATE strings SET property = property & ~?"
+        " WHERE hash IN (SELECT src FROM stale)"
+        " AND hash NOT IN (SELECT src FROM members)");
+  FILL_INT(1, SP_FILE);
+  END_QUERY();
+
+  // Sources of rows unlinked or linked are digested again, so are the ones
+  // never digested, e.g. all of ones linked by old ones.
+  EXEC_SQL("CREATE TEMP TABLE redigested AS"
+           " SELECT src FROM stale UNION SELECT src FROM incoming");
+  QUERY("DELETE FROM digests WHERE src IN (SELECT src FROM redigested)"
+        " OR src NOT IN (SELECT hash FROM strings WHERE (property & ?))");
+  FILL_INT(1, SP_FILE);
+  END_QUERY();
+  DIGEST_SOURCES("SELECT hash AS src FROM strings WHERE (property & ?1)"
+                 " AND (hash IN (SELECT src FROM redigested)"
+                 " OR hash NOT IN (SELECT src FROM digests))",
+                 "SELECT src, digest, max(rowid) FROM members"
+                 " WHERE digest IS NOT NULL GROUP BY src");
+
+  EXEC_SQL("DROP TABLE temp.redigested");
+  EXEC_SQL("DROP TABLE temp.incoming");
+  EXEC_SQL("DROP TABLE temp.relinked");
+  EXEC_SQL("DROP TABLE temp.stale");
+}
+
+typedef struct {
+  query_group_t group;
+  void *obj;
+  unsigned src;
+  bool started;
+  bool stopped;
+} Grouping;
+
+// Returns true if to stop the query, i.e. the group callback says so.
+static inline bool group_next(Grouping *g, unsigned src) {
+  if (g->started && g->src == src)
+    return false;
+
+  if (g->started && (g->stopped = g->group(g->src, true, g->obj)))
+    return true;
+
+  g->src = src;
+  g->started = true;
+  return g->stopped = g->group(src, false, g->obj);
+}
+
+static inline void group_end(Grouping *g) {
+  if (g->started && !g->stopped)
+    g->group(g->src, true, g->obj);
+}
+
 struct error query_meta(query_meta_row_t row, void *obj) {
   assert(row);
   QUERY("SELECT cwd, tu FROM meta");
@@ -334,6 +920,146 @@ struct error query_strings(uint8_t property, query_strings_row_t row,
   return ERROR_OF(ES_QUERY_STRINGS);
 }
 
+struct error store_history(unsigned n, const char *const *tu,
+                           const unsigned *duration, const uint64_t *options) {
+  EXEC_SQL("BEGIN TRANSACTION");
+  EXEC_SQL("CREATE TABLE IF NOT EXISTS " HISTORY_TABLE);
+  for (unsigned i = 0; i < n && !errcode; ++i) {
+    if (!duration[i])
+      continue;
+
+    QUERY("INSERT OR REPLACE INTO history (tu, duration, options)"
+          " VALUES (?, ?, ?)");
+    FILL_TEXT(1, tu[i]);
+    FILL_INT(2, duration[i]);
+    FILL_INT(3, (long)options[i]);
+    END_QUERY();
+  }
+  EXEC_SQL("END TRANSACTION");
+  return ERROR_OF(ES_STORE_HISTORY);
+}
+
+// Databases of a single TU have its sources as members.
+#define MEMBERS_OF_TU                                                          \
+  "WITH members AS"                                                            \
+  " (SELECT m.tu, d.src, d.digest FROM meta AS m, sources AS d) "
+
+// Tables of members, sources and history in the bits.
+static unsigned history_tables() {
+  unsigned tables = 0;
+  QUERY("SELECT name FROM sqlite_master WHERE type = 'table'"
+        " AND name IN ('members', 'sources', 'history')");
+  END_QUERY({
+    const char *name = COL_TEXT(0);
+    tables |= !strcmp(name, "members") ? 1 : !strcmp(name, "sources") ? 2 : 4;
+  });
+  return tables;
+}
+
+#define HISTORY_ROWS(with)                                                     \
+  do {                                                                         \
+    unsigned includes, duration;                                               \
+    long options;                                                              \
+    QUERY(with "SELECT m.tu, count(*),"                                        \
+               " ifnull(h.duration, 0), ifnull(h.options, 0)"                  \
+               " FROM members AS m LEFT JOIN history AS h ON h.tu = m.tu"      \
+               " GROUP BY m.tu ORDER BY m.tu");                                \
+    END_QUERY({                                                                \
+      PICK_INT(1, includes);                                                   \
+      PICK_INT(2, duration);                                                   \
+      PICK_INT(3, options);                                                    \
+      if (row(COL_TEXT(0), COL_SIZE(0), includes, duration, options, obj))     \
+        break;                                                                 \
+    });                                                                        \
+  } while (0)
+
+struct error query_history(query_history_row_t row, void *obj) {
+  assert(row);
+
+  const unsigned tables = history_tables();
+  if ((tables & 5) == 5)
+    HISTORY_ROWS("");
+  else if ((tables & 6) == 6 && !(tables & 1))
+    HISTORY_ROWS(MEMBERS_OF_TU);
+  else if (tables & 1) {
+    unsigned includes;
+    QUERY("SELECT tu, count(*) FROM members GROUP BY tu ORDER BY tu");
+    END_QUERY({
+      PICK_INT(1, includes);
+      if (row(COL_TEXT(0), COL_SIZE(0), includes, 0, 0, obj))
+        break;
+    });
+  }
+
+  return ERROR_OF(ES_STORE_HISTORY);
+}
+
+#define MEMBER_FILE_ROWS(with)                                                 \
+  do {                                                                         \
+    long digest;                                                               \
+    QUERY(with "SELECT s.key, m.digest, m.tu"                                  \
+               " FROM members AS m JOIN strings AS s ON s.hash = m.src"        \
+               " WHERE s.property & 1 AND m.digest IS NOT NULL"                \
+               " ORDER BY s.key");                                             \
+    END_QUERY({                                                                \
+      PICK_INT(1, digest);                                                     \
+      if (row(COL_TEXT(0), digest, COL_TEXT(2), COL_SIZE(2), obj))             \
+        break;                                                                 \
+    });                                                                        \
+  } while (0)
+
+struct error query_member_files(query_member_files_row_t row, void *obj) {
+  assert(row);
+
+  const unsigned tables = history_tables();
+  if (tables & 1)
+    MEMBER_FILE_ROWS("");
+  else if (tables & 2)
+    MEMBER_FILE_ROWS(MEMBERS_OF_TU);
+
+  return ERROR_OF(ES_STORE_HISTORY);
+}
+
+// Nodes of a database of a single TU are owned by it.
+#define NODES_OWNERS_OF_TU                                                     \
+  "WITH nodes_owners AS"                                                       \
+  " (SELECT n.rowid AS row, m.rowid AS tu FROM nodes AS n, meta AS m) "
+
+#define INCLUSION_ROWS(with)                                                   \
+  do {                                                                         \
+    unsigned line, col;                                                        \
+    QUERY(with "SELECT s.key, n.row, n.col, p.key"                             \
+               " FROM meta AS m"                                               \
+               " JOIN nodes_owners AS o ON o.tu = m.rowid"                     \
+               " JOIN nodes AS n ON n.rowid = o.row"                           \
+               " JOIN strings AS s ON s.hash = n.src"                          \
+               " JOIN strings AS p ON p.hash = n.link"                         \
+               " WHERE m.tu = ? AND (n.node & 0xFFFF) = ?"                     \
+               " AND s.property & 1 AND p.key != ''"                           \
+               " ORDER BY s.key, n.row, n.col");                               \
+    FILL_TEXT(1, tu);                                                          \
+    FILL_INT(2, TOK_InclusionDirective);                                       \
+    END_QUERY({                                                                \
+      PICK_INT(1, line);                                                       \
+      PICK_INT(2, col);                                                        \
+      if (row(COL_TEXT(0), line, col, COL_TEXT(3), obj))                       \
+        break;                                                                 \
+    });                                                                        \
+  } while (0)
+
+struct error query_inclusions(const char *tu, query_inclusions_row_t row,
+                              void *obj) {
+  assert(tu && row);
+
+  const unsigned tables = history_tables();
+  if (tables & 1)
+    INCLUSION_ROWS("");
+  else if (tables & 2)
+    INCLUSION_ROWS(NODES_OWNERS_OF_TU);
+
+  return ERROR_OF(ES_STORE_HISTORY);
+}
+
 struct error query_semantics(unsigned src, query_semantics_row_t row,
                              void *obj) {
   assert(row);
@@ -359,6 +1085,37 @@ struct error query_semantics(unsigned src, query_semantics_row_t row,
   return ERROR_OF(ES_QUERY_SEMANTICS);
 }
 
+struct error query_semantics_in(unsigned first, unsigned last,
+                                query_group_t group,
+                                query_semantics_row_t row, void *obj) {
+  assert(group && row);
+  Grouping g = {group, obj};
+  QUERY("SELECT begin_src, begin_row, begin_col, end_row, end_col, kind, name"
+        " FROM semantics"
+        " WHERE begin_src BETWEEN ? AND ?"
+        " ORDER BY begin_src, begin_row, begin_col");
+  FILL_INT(1, first);
+  FILL_INT(2, last);
+  END_QUERY({
+    unsigned src, begin_row, begin_col, end_row, end_col;
+
+    PICK_INT(0, src);
+    PICK_INT(1, begin_row);
+    PICK_INT(2, begin_col);
+    PICK_INT(3, end_row);
+    PICK_INT(4, end_col);
+
+    const char *kind = COL_TEXT(5);
+    const char *name = COL_TEXT(6);
+
+    if (group_next(&g, src) ||
+        row(begin_row, begin_col, end_row, end_col, kind, name, obj))
+      break;
+  });
+  group_end(&g);
+  return ERROR_OF(ES_QUERY_SEMANTICS);
+}
+
 struct error query_link(unsigned src, query_link_row_t row, void *obj) {
   assert(row);
   QUERY("SELECT begin_row, begin_col, end_row, end_col, link"
@@ -383,8 +1140,77 @@ struct error query_link(unsigned src, query_link_row_t row, void *obj) {
   return ERROR_OF(ES_QUERY_LINK);
 }
 
+struct error query_link_in(unsigned first, unsigned last, query_group_t group,
+                           query_link_row_t row, void *obj) {
+  assert(group && row);
+  Grouping g = {group, obj};
+  QUERY("SELECT begin_src, begin_row, begin_col, end_row, end_col, link"
+        " FROM nodes"
+        " WHERE begin_src BETWEEN ? AND ?"
+        " AND (node & 0xFFFF) = ?"
+        " ORDER BY begin_src, begin_row, begin_col");
+  FILL_INT(1, first);
+  FILL_INT(2, last);
+  FILL_INT(3, TOK_InclusionDirective);
+  END_QUERY({
+    unsigned src, begin_row, begin_col, end_row, end_col, link;
+
+    PICK_INT(0, src);
+    PICK_INT(1, begin_row);
+    PICK_INT(2, begin_col);
+    PICK_INT(3, end_row);
+    PICK_INT(4, end_col);
+    PICK_INT(5, link);
+
+    if (group_next(&g, src) ||
+        row(begin_row, begin_col, end_row, end_col, link, obj))
+      break;
+  });
+  group_end(&g);
+  return ERROR_OF(ES_QUERY_LINK);
+}
+
+struct error query_digests_in(unsigned first, unsigned last,
+                              query_digests_row_t row, void *obj) {
+  assert(row);
+
+  // Databases stored by old ones have no digests.
+  bool digested = false;
+  QUERY("SELECT 1 FROM sqlite_master"
+        " WHERE type = 'table' AND name = 'digests'");
+  END_QUERY({ digested = true; });
+  if (!digested)
+    return ERROR_OF(ES_QUERY_DIGESTS);
+
+  QUERY("SELECT src, ifnull(source, 0), semantics, link FROM digests"
+        " WHERE src BETWEEN ? AND ?"
+        " ORDER BY src");
+  FILL_INT(1, first);
+  FILL_INT(2, last);
+  END_QUERY({
+    unsigned src;
+    long source, semantics, link;
+
+    PICK_INT(0, src);
+    PICK_INT(1, source);
+    PICK_INT(2, semantics);
+    PICK_INT(3, link);
+
+    if (row(src, source, semantics, link, obj))
+      break;
+  });
+  return ERROR_OF(ES_QUERY_DIGESTS);
+}
+
 struct error query_lint(unsigned src, query_lint_row_t row, void *obj) {
   assert(row);
 
   return ERROR_OF(ES_QUERY_LINT);
 }
+
+struct error query_lint_in(unsigned first, unsigned last, query_group_t group,
+                           query_lint_row_t row, void *obj) {
+  assert(group && row);
+
+  return ERROR_OF(ES_QUERY_LINT);
+}
\ No newline at end of file
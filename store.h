@@ -7,6 +7,22 @@ struct error store_open(const char *db_file);
 struct error store();
 struct error store_close();
 
+// Opens a database kept across builds, e.g. the output linked in place, with a
+// rollback journal synced to the disk, so it's left as it was by failed links
+// or crashes. Others are opened as scratch ones, journaled in memory only.
+struct error store_open_durable(const char *db_file);
+
+// Opens another connection to an existing database for querying only, e.g.
+// from a worker thread while the database is opened by the main one.
+struct error store_open_readonly(const char *db_file);
+
+// Returns the file of the opened database, NULL if it's in memory.
+const char *store_file();
+
+// Merges the given database, either from a TU or linked already, into the
+// opened one within a transaction, the shared rows are deduplicated.
+struct error store_link(const char *db_file);
+
 typedef bool (*query_meta_row_t)(const char *cwd, int cwd_len, const char *tu,
                                  int tu_len, void *obj);
 struct error query_meta(query_meta_row_t row, void *obj);
@@ -16,20 +32,70 @@ typedef bool (*query_strings_row_t)(const char *key, int key_len,
 struct error query_strings(uint8_t property, query_strings_row_t row,
                            void *obj);
 
+// Records the time of remarking TUs in milliseconds, 0 for unknown, and the
+// digests of their options.
+struct error store_history(unsigned n, const char *const *tu,
+                           const unsigned *duration, const uint64_t *options);
+
+// Rows are TUs of the database ordered by name, either linked or the only one,
+// with the number of sources they include, the time they took last time and the
+// digest of their options, 0 if unknown.
+typedef bool (*query_history_row_t)(const char *tu, int tu_len,
+                                    unsigned includes, unsigned duration,
+                                    uint64_t options, void *obj);
+struct error query_history(query_history_row_t row, void *obj);
+
+// Rows are files included by TUs of the database with their digests at the time
+// of storing, ordered by files, i.e. rows of the same file are adjacent.
+typedef bool (*query_member_files_row_t)(const char *file, uint64_t digest,
+                                         const char *tu, int tu_len,
+                                         void *obj);
+struct error query_member_files(query_member_files_row_t row, void *obj);
+
+// Rows are inclusions of the TU in the database, each by the file including it,
+// the location of the name included, i.e. the left quotation mark, and the file
+// found, ordered by the files including, then the locations.
+typedef bool (*query_inclusions_row_t)(const char *file, unsigned row,
+                                       unsigned col, const char *path,
+                                       void *obj);
+struct error query_inclusions(const char *tu, query_inclusions_row_t row,
+                              void *obj);
+
+// Rows of the ranged queries are grouped by sources in the ascending order, the
+// group callback is called with the source before the first row of a group, and
+// after the last row with `end` set. Returning true from any callback stops.
+typedef bool (*query_group_t)(unsigned src, bool end, void *obj);
+
 typedef bool (*query_semantics_row_t)(unsigned begin_row, unsigned begin_col,
                                       unsigned end_row, unsigned end_col,
                                       const char *kind, const char *name,
                                       void *obj);
 struct error query_semantics(unsigned src, query_semantics_row_t row,
                              void *obj);
+struct error query_semantics_in(unsigned first, unsigned last,
+                                query_group_t group,
+                                query_semantics_row_t row, void *obj);
 
 typedef bool (*query_link_row_t)(unsigned begin_row, unsigned begin_col,
                                  unsigned end_row, unsigned end_col,
                                  unsigned link, void *obj);
 struct error query_link(unsigned src, query_link_row_t row, void *obj);
+struct error query_link_in(unsigned first, unsigned last, query_group_t group,
+                           query_link_row_t row, void *obj);
+
+// Rows are digests of sources in [first, last] in the ascending order, each of
+// the source at the time of storing, 0 if unknown, and of its rows of semantics
+// and links. Databases stored by old ones have none.
+typedef bool (*query_digests_row_t)(unsigned src, uint64_t source,
+                                    uint64_t semantics, uint64_t link,
+                                    void *obj);
+struct error query_digests_in(unsigned first, unsigned last,
+                              query_digests_row_t row, void *obj);
 
 typedef bool (*query_lint_row_t)(unsigned begin_row, unsigned begin_col,
                                  unsigned end_row, unsigned end_col,
                                  unsigned severity, const char *message,
                                  void *obj);
-struct error query_lint(unsigned src, query_lint_row_t row, void *obj);
\ No newline at end of file
+struct error query_lint(unsigned src, query_lint_row_t row, void *obj);
+struct error query_lint_in(unsigned first, unsigned last, query_group_t group,
+                           query_lint_row_t row, void *obj);
\ No newline at end of file
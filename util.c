@@ -3,7 +3,9 @@
 #include "test.h"
 
 #include <assert.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 
 struct error reads(FILE *fp, struct string *s, const char *escape) {
   assert(fp && s);
@@ -31,6 +33,79 @@ struct error reads(FILE *fp, struct string *s, const char *escape) {
   return (struct error){};
 }
 
+struct error map_file(const char *file, const char **data, size_t *size) {
+  assert(file && data && size);
+  *data = NULL;
+  *size = 0;
+
+  int fd = open(file, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st)) {
+    fprintf(stderr, "%s: open('%s') error: %s\n", __func__, file,
+            strerror(errno));
+    struct error err = {ES_FILE_OPEN, errno};
+    if (fd >= 0)
+      close(fd);
+    return err;
+  }
+
+  struct error err = {};
+  if (st.st_size) {
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+      fprintf(stderr, "%s: mmap('%s') error: %s\n", __func__, file,
+              strerror(errno));
+      err = (struct error){ES_FILE_READ, errno};
+    } else {
+      madvise(p, st.st_size, MADV_SEQUENTIAL);
+      *data = p;
+      *size = st.st_size;
+    }
+  }
+
+  close(fd);
+  return err;
+}
+
+void unmap_file(const char *data, size_t size) {
+  if (data)
+    munmap((void *)data, size);
+}
+
+TEST(map_file, {
+  const char *data;
+  size_t size;
+  ASSERT(!map_file("/dev/null", &data, &size).es);
+  ASSERT(!data && !size);
+
+  ASSERT(!map_file(__FILE__, &data, &size).es);
+  ASSERT(data && size && !memcmp(data, "#include", 8));
+  unmap_file(data, size);
+})
+
+struct error digest_file(const char *file, uint64_t *digest) {
+  assert(file && digest);
+
+  FILE *fp = fopen(file, "r");
+  if (!fp)
+    return (struct error){ES_FILE_OPEN, errno};
+
+  struct string s = {};
+  struct error err = reads(fp, &s, NULL);
+  if (!err.es)
+    *digest = hash(string_get(&s), string_len(&s));
+
+  string_clear(&s, 1);
+  return next_error(err, close_file(fp));
+}
+
+TEST(digest_file, {
+  uint64_t digest = 0;
+  ASSERT(!digest_file("/dev/null", &digest).es);
+  ASSERT(digest == (uint64_t)hash("", 0));
+  ASSERT(digest_file("/nonexistent/file", &digest).es == ES_FILE_OPEN);
+})
+
 const char *expand_path(const char *cwd, unsigned n, const char *in,
                         char *const restrict out, unsigned cap) {
   assert(n < cap);
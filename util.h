@@ -1,11 +1,13 @@
 #pragma once
 
 #include "error.h"
+#include "kernel.h"
 #include "string.h"
 
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #define ALT(x, y) (x ? x : y)
@@ -15,8 +17,7 @@
     size_t j = 0, k = 0;                                                       \
                                                                                \
     do {                                                                       \
-      while (j < n && !strchr(escape, in[j]))                                  \
-        ++j;                                                                   \
+      j += scan_any(in + j, n - j, escape);                                    \
                                                                                \
       string_append(out, in + k, j - k);                                       \
       if (j == n)                                                              \
@@ -58,8 +59,28 @@ static inline struct error unlink_file(const char *file) {
   return (struct error){};
 }
 
+// Makes the directory if it doesn't exist.
+static inline struct error make_dir(const char *dir) {
+  if (mkdir(dir, 0755) && errno != EEXIST) {
+    fprintf(stderr, "%s: mkdir('%s') error: %s\n", __func__, dir,
+            strerror(errno));
+    return (struct error){ES_FILE_OPEN, errno};
+  }
+
+  return (struct error){};
+}
+
 struct error reads(FILE *fp, struct string *s, const char *escape);
 
+// Maps the whole file for reading, the data of an empty file is NULL.
+struct error map_file(const char *file, const char **data, size_t *size);
+
+void unmap_file(const char *data, size_t size);
+
+// Computes the digest of the file content quietly, i.e. the failure of opening
+// the file is left to the caller.
+struct error digest_file(const char *file, uint64_t *digest);
+
 // This function expands a given input path to the absolute one. Note that if
 // the input itself is already an absolute path, it will return it directly to
 // avoid unnecessary copies.
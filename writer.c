@@ -0,0 +1,403 @@
+#include "writer.h"
+#include "kernel.h"
+#include "test.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <threads.h>
+#include <unistd.h>
+#include <zlib.h>
+
+struct gzip {
+  z_stream z;
+  char *data; // the buffer being compressed
+  size_t i;
+  bool finish; // whether the buffer is the last one
+  bool async;
+  bool busy; // whether the buffer is not compressed yet
+  bool quit;
+  thrd_t thread;
+  mtx_t mtx;
+  cnd_t cnd;
+  struct error err;
+  unsigned char out[WRITER_BUFSIZ];
+};
+
+void writer_open(struct writer *w, FILE *file) {
+  assert(w);
+  *w = (struct writer){file, -1};
+  if (file && !fflush(file))
+    w->fd = fileno(file);
+
+  w->cap = WRITER_BUFSIZ;
+  w->data = malloc(w->cap);
+  assert(w->data);
+}
+
+// Writes both pieces of bytes to the stream in order.
+static struct error put(FILE *file, int fd, const void *a, size_t an,
+                        const void *b, size_t bn) {
+  if (fd < 0) {
+    if ((an && fwrite(a, an, 1, file) != 1) ||
+        (bn && fwrite(b, bn, 1, file) != 1))
+      return (struct error){ES_FILE_WRITE, errno};
+    return (struct error){};
+  }
+
+  struct iovec iov[] = {{(void *)a, an}, {(void *)b, bn}};
+  for (unsigned k = 0; k < 2;) {
+    ssize_t m = writev(fd, iov + k, 2 - k);
+    if (m < 0) {
+      if (errno != EINTR)
+        return (struct error){ES_FILE_WRITE, errno};
+      continue;
+    }
+
+    for (; k < 2 && (size_t)m >= iov[k].iov_len; ++k)
+      m -= iov[k].iov_len;
+    if (k < 2) {
+      iov[k].iov_base = (char *)iov[k].iov_base + m;
+      iov[k].iov_len -= m;
+    }
+  }
+  return (struct error){};
+}
+
+// Compresses the buffer of the gzip and writes the output to the stream.
+static struct error deflate_buffer(struct gzip *g, FILE *file, int fd) {
+  g->z.next_in = (unsigned char *)g->data;
+  g->z.avail_in = g->i;
+
+  struct error err = {};
+  int ret;
+  do {
+    g->z.next_out = g->out;
+    g->z.avail_out = sizeof(g->out);
+    ret = deflate(&g->z, g->finish ? Z_FINISH : Z_NO_FLUSH);
+    if (ret == Z_STREAM_ERROR)
+      return (struct error){ES_GZIP, ret};
+
+    err = put(file, fd, g->out, sizeof(g->out) - g->z.avail_out, NULL, 0);
+  } while (!err.es &&
+           (!g->z.avail_out || (g->finish && ret != Z_STREAM_END)));
+
+  g->i = 0;
+  return err;
+}
+
+static int compressor(void *arg) {
+  struct writer *w = arg;
+  struct gzip *g = w->gzip;
+
+  mtx_lock(&g->mtx);
+  for (;;) {
+    while (!g->busy && !g->quit)
+      cnd_wait(&g->cnd, &g->mtx);
+    if (!g->busy)
+      break;
+
+    mtx_unlock(&g->mtx);
+    struct error err = g->err.es ? g->err : deflate_buffer(g, w->file, w->fd);
+    mtx_lock(&g->mtx);
+
+    g->err = err;
+    g->busy = false;
+    cnd_broadcast(&g->cnd);
+  }
+  mtx_unlock(&g->mtx);
+  return 0;
+}
+
+// Hands the buffer to the compressor, the previous buffer of which is taken
+// as the new one once compressed.
+static void compress_buffer(struct writer *w, bool finish) {
+  struct gzip *g = w->gzip;
+  if (!g->async) {
+    char *data = g->data;
+    g->data = w->data;
+    g->i = w->i;
+    g->finish = finish;
+    w->err = deflate_buffer(g, w->file, w->fd);
+    w->data = data;
+    return;
+  }
+
+  mtx_lock(&g->mtx);
+  while (g->busy)
+    cnd_wait(&g->cnd, &g->mtx);
+  if (!(w->err = g->err).es) {
+    char *data = g->data;
+    g->data = w->data;
+    g->i = w->i;
+    g->finish = finish;
+    g->busy = true;
+    w->data = data;
+    cnd_broadcast(&g->cnd);
+  }
+  mtx_unlock(&g->mtx);
+}
+
+struct error writer_gzip(struct writer *w, bool async) {
+  assert(w && w->file && !w->gzip && !w->i);
+
+  struct gzip *g = calloc(1, sizeof(*g));
+  assert(g);
+  g->data = malloc(w->cap);
+  assert(g->data);
+  g->async = async;
+
+  // The window bits of 15 + 16 are for the gzip header and trailer
+  int ret = deflateInit2(&g->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                         Z_DEFAULT_STRATEGY);
+  if (ret != Z_OK) {
+    free(g->data);
+    free(g);
+    return w->err = (struct error){ES_GZIP, ret};
+  }
+
+  w->gzip = g;
+  if (async) {
+    // Compress on the calling thread instead if any of them fails, with ones
+    // created already destroyed
+    const bool mtx = mtx_init(&g->mtx, mtx_plain) == thrd_success;
+    const bool cnd = mtx && cnd_init(&g->cnd) == thrd_success;
+    if (!cnd || thrd_create(&g->thread, compressor, w) != thrd_success) {
+      if (cnd)
+        cnd_destroy(&g->cnd);
+      if (mtx)
+        mtx_destroy(&g->mtx);
+      g->async = false;
+    }
+  }
+  return w->err;
+}
+
+// Writes the buffer and then the given bytes to the stream.
+static void flush(struct writer *w, const void *s, size_t n) {
+  assert(w->file && !(w->gzip && n));
+
+  if (w->gzip)
+    compress_buffer(w, false);
+  else
+    w->err = put(w->file, w->fd, w->data, w->i, s, n);
+  w->i = 0;
+}
+
+struct error writer_flush(struct writer *w) {
+  if (!w->err.es && w->file && w->i)
+    flush(w, NULL, 0);
+  return w->err;
+}
+
+struct error writer_close(struct writer *w) {
+  struct gzip *g = w->gzip;
+  if (!g) {
+    writer_flush(w);
+  } else {
+    if (!w->err.es)
+      compress_buffer(w, true);
+
+    if (g->async) {
+      mtx_lock(&g->mtx);
+      g->quit = true;
+      cnd_broadcast(&g->cnd);
+      mtx_unlock(&g->mtx);
+      thrd_join(g->thread, NULL);
+      w->err = next_error(w->err, g->err);
+      cnd_destroy(&g->cnd);
+      mtx_destroy(&g->mtx);
+    }
+
+    deflateEnd(&g->z);
+    free(g->data);
+    free(g);
+  }
+
+  struct error err = w->err;
+  free(w->data);
+  *w = (struct writer){.fd = -1};
+  return err;
+}
+
+void writer_write(struct writer *w, const void *s, size_t n) {
+  if (w->err.es)
+    return;
+
+  if (w->cap - w->i < n) {
+    if (!w->file) {
+      w->cap = proper_capacity(w->i + n);
+      w->data = realloc(w->data, w->cap);
+      assert(w->data);
+    } else if (n >= w->cap / 2 && !w->gzip) {
+      // Large data are written at once with the buffer, without copying
+      return flush(w, s, n);
+    } else {
+      // Buffers are flushed full, which is what the compressor likes
+      while (!w->err.es && w->cap - w->i < n) {
+        size_t k = w->cap - w->i;
+        memcpy(w->data + w->i, s, k);
+        w->i += k;
+        s = (const char *)s + k;
+        n -= k;
+        flush(w, NULL, 0);
+      }
+      if (w->err.es)
+        return;
+    }
+  }
+
+  memcpy(w->data + w->i, s, n);
+  w->i += n;
+}
+
+void writer_uint(struct writer *w, uint64_t v) {
+  char buf[20];
+  unsigned k = sizeof(buf);
+  do {
+    buf[--k] = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  writer_write(w, buf + k, sizeof(buf) - k);
+}
+
+void writer_format(struct writer *w, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+
+  for (size_t n = strlen(fmt); n;) {
+    size_t k = scan_any(fmt, n, "%");
+    writer_write(w, fmt, k);
+    if (k == n)
+      break;
+
+    const char *s;
+    int len;
+    switch (fmt[k + 1]) {
+    case '%':
+      writer_putc(w, '%');
+      k += 2;
+      break;
+    case 's':
+      s = va_arg(ap, const char *);
+      writer_write(w, s, strlen(s));
+      k += 2;
+      break;
+    case 'u':
+      writer_uint(w, va_arg(ap, unsigned));
+      k += 2;
+      break;
+    case 'd':
+      len = va_arg(ap, int);
+      if (len < 0)
+        writer_putc(w, '-');
+      writer_uint(w, len < 0 ? -(int64_t)len : len);
+      k += 2;
+      break;
+    case '.':
+      assert(fmt[k + 2] == '*' && fmt[k + 3] == 's');
+      len = va_arg(ap, int);
+      s = va_arg(ap, const char *);
+      writer_write(w, s, len);
+      k += 4;
+      break;
+    default:
+      assert(0 && "Unsupported conversion");
+      k += 1;
+      break;
+    }
+
+    fmt += k;
+    n -= k;
+  }
+
+  va_end(ap);
+}
+
+TEST(writer_format, {
+  struct writer w;
+  writer_open(&w, NULL);
+  writer_format(&w, "%s:%u:%d:%.*s:%%:%d", "a", 4294967295U, -12, 2, "bcd", 0);
+  writer_putc(&w, 0);
+  ASSERT(!strcmp(w.data, "a:4294967295:-12:bc:%:0"), "%s", w.data);
+
+  // Memory writers grow to keep everything
+  char big[WRITER_BUFSIZ];
+  memset(big, 'x', sizeof(big));
+  writer_write(&w, big, sizeof(big));
+  ASSERT(w.i == 24 + sizeof(big) && w.cap >= w.i);
+  ASSERT(!writer_close(&w).es);
+})
+
+TEST(writer_flush, {
+  FILE *fp = tmpfile();
+  ASSERT(fp);
+  fputs("head:", fp); // buffered by the stream before the writer
+
+  struct writer w;
+  writer_open(&w, fp);
+  ASSERT(w.fd >= 0);
+
+  static char big[WRITER_BUFSIZ * 3 / 2];
+  memset(big, 'x', sizeof(big));
+  writer_format(&w, "%u:", 42);
+  writer_write(&w, big, sizeof(big)); // written at once with the buffer
+  writer_write(&w, "tail", 4);
+  ASSERT(!writer_close(&w).es);
+
+  fseek(fp, 0, SEEK_END);
+  long n = ftell(fp);
+  ASSERT(n == 5 + 3 + sizeof(big) + 4, "%ld", n);
+
+  char buf[8] = {};
+  fseek(fp, 0, SEEK_SET);
+  ASSERT(fread(buf, 1, 8, fp) == 8 && !memcmp(buf, "head:42:", 8));
+  fseek(fp, -4, SEEK_END);
+  ASSERT(fread(buf, 1, 4, fp) == 4 && !memcmp(buf, "tail", 4));
+  fclose(fp);
+})
+
+TEST(writer_gzip, {
+  static char big[WRITER_BUFSIZ * 5 / 2];
+  for (size_t i = 0; i < sizeof(big); ++i)
+    big[i] = 'a' + i % 7;
+
+  for (int async = 0; async < 2; ++async) {
+    FILE *fp = tmpfile();
+    ASSERT(fp);
+
+    struct writer w;
+    writer_open(&w, fp);
+    ASSERT(!writer_gzip(&w, async).es);
+    writer_format(&w, "%u:", 42);
+    writer_write(&w, big, sizeof(big));
+    ASSERT(!writer_close(&w).es);
+
+    fseek(fp, 0, SEEK_END);
+    long n = ftell(fp);
+    ASSERT(n > 0 && n < sizeof(big) / 8, "%ld", n);
+
+    unsigned char *in = malloc(n);
+    char *out = malloc(sizeof(big) + 4);
+    fseek(fp, 0, SEEK_SET);
+    ASSERT(fread(in, 1, n, fp) == n);
+    ASSERT(in[0] == 0x1f && in[1] == 0x8b);
+
+    z_stream z = {.next_in = in,
+                  .avail_in = n,
+                  .next_out = (unsigned char *)out,
+                  .avail_out = sizeof(big) + 4};
+    ASSERT(inflateInit2(&z, 15 + 16) == Z_OK);
+    ASSERT(inflate(&z, Z_FINISH) == Z_STREAM_END);
+    ASSERT(z.total_out == sizeof(big) + 3);
+    ASSERT(!memcmp(out, "42:", 3) && !memcmp(out + 3, big, sizeof(big)));
+    inflateEnd(&z);
+
+    free(out);
+    free(in);
+    fclose(fp);
+  }
+})
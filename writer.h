@@ -0,0 +1,53 @@
+#pragma once
+
+#include "error.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef WRITER_BUFSIZ
+#define WRITER_BUFSIZ (1U << 16)
+#endif // !WRITER_BUFSIZ
+
+// The writer buffers output in user space and flushes by writev(2) to the
+// descriptor of the stream, or by fwrite(3) if the stream has none, e.g. a
+// memory stream. Without a stream, the buffer grows to keep all output.
+//
+// Errors are sticky, i.e. nothing is written once a write failed.
+struct writer {
+  FILE *file;
+  int fd;
+  char *data;
+  size_t cap, i;
+  struct error err;
+  struct gzip *gzip;
+};
+
+void writer_open(struct writer *w, FILE *file);
+
+// Compresses the output of a stream writer by gzip. If async, buffers are
+// compressed and written by a thread of the writer, while the next one is
+// being filled.
+struct error writer_gzip(struct writer *w, bool async);
+
+// Flushes the output, frees the buffer and returns the first error.
+struct error writer_close(struct writer *w);
+
+struct error writer_flush(struct writer *w);
+
+void writer_write(struct writer *w, const void *s, size_t n);
+
+static inline void writer_putc(struct writer *w, char c) {
+  if (w->i < w->cap)
+    w->data[w->i++] = c;
+  else
+    writer_write(w, &c, 1);
+}
+
+void writer_uint(struct writer *w, uint64_t v);
+
+// Writes by the format like printf(3), but only %s, %.*s, %u, %d and %% are
+// supported, which are all the render needs.
+void writer_format(struct writer *w, const char *fmt, ...);